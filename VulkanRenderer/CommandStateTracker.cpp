@@ -0,0 +1,121 @@
+#include "CommandStateTracker.h"
+
+#include <cstring>
+
+CommandStateTracker::Counters& CommandStateTracker::Counters::operator+=(const Counters& o)
+{
+	pipelines += o.pipelines;
+	descriptorSets += o.descriptorSets;
+	vertexBuffers += o.vertexBuffers;
+	indexBuffers += o.indexBuffers;
+	pushConstants += o.pushConstants;
+	return *this;
+}
+
+void CommandStateTracker::reset(VkCommandBuffer commandBuffer)
+{
+	this->commandBuffer = commandBuffer;
+	graphics = {};
+	compute = {};
+	vertexBuffer = VK_NULL_HANDLE;
+	indexBuffer = VK_NULL_HANDLE;
+	pushLayout = VK_NULL_HANDLE;
+	pushStages = 0;
+	pushValid.reset();
+}
+
+void CommandStateTracker::bindPipeline(VkPipelineBindPoint bindPoint, VkPipeline pipeline)
+{
+	BindPointState& state = getBindPoint(bindPoint);
+	if (state.pipeline == pipeline) {
+		stats.elided.pipelines++;
+		return;
+	}
+
+	vkCmdBindPipeline(commandBuffer, bindPoint, pipeline);
+	state.pipeline = pipeline;
+	stats.issued.pipelines++;
+}
+
+void CommandStateTracker::bindDescriptorSet(VkPipelineBindPoint bindPoint, VkPipelineLayout layout, uint32_t set, VkDescriptorSet descriptorSet)
+{
+	BindPointState& state = getBindPoint(bindPoint);
+
+	// Sets bound with another layout may be disturbed, don't trust any of them
+	if (state.layout != layout) {
+		state.sets = {};
+		state.layout = layout;
+	}
+
+	if (set < MaxDescriptorSets && state.sets[set] == descriptorSet) {
+		stats.elided.descriptorSets++;
+		return;
+	}
+
+	vkCmdBindDescriptorSets(commandBuffer, bindPoint, layout, set, 1, &descriptorSet, 0, nullptr);
+	if (set < MaxDescriptorSets)
+		state.sets[set] = descriptorSet;
+	stats.issued.descriptorSets++;
+}
+
+void CommandStateTracker::bindVertexBuffer(VkBuffer buffer, VkDeviceSize offset)
+{
+	if (vertexBuffer == buffer && vertexOffset == offset) {
+		stats.elided.vertexBuffers++;
+		return;
+	}
+
+	vkCmdBindVertexBuffers(commandBuffer, 0, 1, &buffer, &offset);
+	vertexBuffer = buffer;
+	vertexOffset = offset;
+	stats.issued.vertexBuffers++;
+}
+
+void CommandStateTracker::bindIndexBuffer(VkBuffer buffer, VkDeviceSize offset, VkIndexType indexType)
+{
+	if (indexBuffer == buffer && indexOffset == offset && this->indexType == indexType) {
+		stats.elided.indexBuffers++;
+		return;
+	}
+
+	vkCmdBindIndexBuffer(commandBuffer, buffer, offset, indexType);
+	indexBuffer = buffer;
+	indexOffset = offset;
+	this->indexType = indexType;
+	stats.issued.indexBuffers++;
+}
+
+void CommandStateTracker::pushConstants(VkPipelineLayout layout, VkShaderStageFlags stages, uint32_t offset, uint32_t size, const void* data)
+{
+	if (layout != pushLayout || stages != pushStages) {
+		pushValid.reset();
+		pushLayout = layout;
+		pushStages = stages;
+	}
+
+	const bool tracked = offset + size <= MaxPushConstantsSize;
+	if (tracked) {
+		bool same = memcmp(&pushData[offset], data, size) == 0;
+		for (uint32_t i = offset; same && i < offset + size; i++)
+			same = pushValid[i];
+
+		if (same) {
+			stats.elided.pushConstants++;
+			return;
+		}
+
+		memcpy(&pushData[offset], data, size);
+		for (uint32_t i = offset; i < offset + size; i++)
+			pushValid[i] = true;
+	}
+
+	vkCmdPushConstants(commandBuffer, layout, stages, offset, size, data);
+	stats.issued.pushConstants++;
+}
+
+CommandStateTracker::Stats CommandStateTracker::takeStats()
+{
+	Stats taken = stats;
+	stats = {};
+	return taken;
+}
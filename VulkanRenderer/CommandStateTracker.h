@@ -0,0 +1,79 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+
+/*
+* What is currently bound on one command buffer, the bind and push calls go through it and are
+* skipped when they would not change anything.
+* Only knows about what went through it, reset() whenever something else may have touched the
+* command buffer (new recording, executed secondaries, ImGui...).
+*/
+class CommandStateTracker {
+public:
+	struct Counters {
+		uint32_t pipelines = 0;
+		uint32_t descriptorSets = 0;
+		uint32_t vertexBuffers = 0;
+		uint32_t indexBuffers = 0;
+		uint32_t pushConstants = 0;
+
+		Counters& operator+=(const Counters& o);
+		uint32_t total() const { return pipelines + descriptorSets + vertexBuffers + indexBuffers + pushConstants; }
+	};
+
+	struct Stats {
+		Counters issued;
+		Counters elided;
+
+		Stats& operator+=(const Stats& o) { issued += o.issued; elided += o.elided; return *this; }
+	};
+
+	static constexpr uint32_t MaxDescriptorSets = 8;
+	static constexpr uint32_t MaxPushConstantsSize = 256;
+
+	// Forgets everything, stats are kept until takeStats
+	void reset(VkCommandBuffer commandBuffer);
+	VkCommandBuffer getCommandBuffer() const { return commandBuffer; }
+
+	void bindPipeline(VkPipelineBindPoint bindPoint, VkPipeline pipeline);
+	void bindDescriptorSet(VkPipelineBindPoint bindPoint, VkPipelineLayout layout, uint32_t set, VkDescriptorSet descriptorSet);
+	void bindVertexBuffer(VkBuffer buffer, VkDeviceSize offset);
+	void bindIndexBuffer(VkBuffer buffer, VkDeviceSize offset, VkIndexType indexType);
+	void pushConstants(VkPipelineLayout layout, VkShaderStageFlags stages, uint32_t offset, uint32_t size, const void* data);
+
+	// Returns what was counted since the last call and starts over
+	Stats takeStats();
+
+private:
+	// Graphics and compute binding points don't share anything
+	struct BindPointState {
+		VkPipeline pipeline = VK_NULL_HANDLE;
+		VkPipelineLayout layout = VK_NULL_HANDLE; // Of the bound descriptor sets
+		std::array<VkDescriptorSet, MaxDescriptorSets> sets{};
+	};
+
+	VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+	BindPointState graphics;
+	BindPointState compute;
+
+	VkBuffer vertexBuffer = VK_NULL_HANDLE;
+	VkDeviceSize vertexOffset = 0;
+	VkBuffer indexBuffer = VK_NULL_HANDLE;
+	VkDeviceSize indexOffset = 0;
+	VkIndexType indexType = VK_INDEX_TYPE_UINT32;
+
+	// Last pushed bytes, only compared while the layout and stages stay the same
+	VkPipelineLayout pushLayout = VK_NULL_HANDLE;
+	VkShaderStageFlags pushStages = 0;
+	std::array<uint8_t, MaxPushConstantsSize> pushData{};
+	std::bitset<MaxPushConstantsSize> pushValid;
+
+	Stats stats;
+
+	BindPointState& getBindPoint(VkPipelineBindPoint bindPoint) { return bindPoint == VK_PIPELINE_BIND_POINT_COMPUTE ? compute : graphics; }
+};
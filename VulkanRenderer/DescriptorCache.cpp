@@ -0,0 +1,259 @@
+#include "DescriptorCache.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <array>
+#include <functional>
+
+// Evicted sets we keep around per layout, the rest goes back to its pool
+static constexpr size_t maxFreeSetsPerLayout = 64;
+// No need to walk the whole cache every frame
+static constexpr uint64_t evictionInterval = 32;
+
+size_t DescriptorCache::KeyHasher::operator()(const Key& k) const
+{
+	size_t seed = std::hash<VkDescriptorSetLayout>()(k.layout);
+	seed ^= k.hash + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+	return seed;
+}
+
+void DescriptorCache::init(VkDevice device, uint32_t framesInFlight, uint32_t setsPerPool, uint32_t staleFrames)
+{
+	this->device = device;
+	this->framesInFlight = framesInFlight;
+	this->setsPerPool = setsPerPool;
+	this->staleFrames = std::max(staleFrames, framesInFlight + 1);
+	frame = 0;
+	currentFrameHits = 0;
+	currentFrameMisses = 0;
+	stats = {};
+}
+
+void DescriptorCache::cleanup()
+{
+	for (const Pool& pool : pools) {
+		vkDestroyDescriptorPool(device, pool.pool, nullptr);
+	}
+
+	pools.clear();
+	entries.clear();
+	freeSets.clear();
+	uncachedSets.clear();
+	stats = {};
+}
+
+DescriptorCache::Pool& DescriptorCache::createPool()
+{
+	// Generic mix, roughly what our sets look like. A pool that runs out of one type is skipped until something is freed from it
+	std::array<VkDescriptorPoolSize, 4> poolSizes = {
+		VkDescriptorPoolSize{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, setsPerPool * 2 },
+		VkDescriptorPoolSize{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, setsPerPool * 4 },
+		VkDescriptorPoolSize{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, setsPerPool },
+		VkDescriptorPoolSize{ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, setsPerPool },
+	};
+
+	VkDescriptorPoolCreateInfo poolInfo{
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+		.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT,
+		.maxSets = setsPerPool,
+		.poolSizeCount = static_cast<uint32_t>(poolSizes.size()),
+		.pPoolSizes = poolSizes.data(),
+	};
+
+	VkDescriptorPool pool;
+	if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &pool) != VK_SUCCESS) {
+		throw std::runtime_error("failed to create descriptor pool!");
+	}
+
+	pools.push_back({ .pool = pool });
+	stats.pools = static_cast<uint32_t>(pools.size());
+	return pools.back();
+}
+
+DescriptorCache::Entry DescriptorCache::allocateEntry(VkDescriptorSetLayout layout)
+{
+	VkDescriptorSetAllocateInfo allocInfo{
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+		.descriptorSetCount = 1,
+		.pSetLayouts = &layout,
+	};
+
+	Entry entry;
+
+	// Older pools get room back when their sets are freed, newer ones are the most likely to have some
+	for (auto it = pools.rbegin(); it != pools.rend(); ++it) {
+		Pool& pool = *it;
+		if (pool.exhausted || pool.allocatedSets >= setsPerPool)
+			continue;
+
+		allocInfo.descriptorPool = pool.pool;
+		VkResult res = vkAllocateDescriptorSets(device, &allocInfo, &entry.set);
+		if (res == VK_SUCCESS) {
+			pool.allocatedSets++;
+			entry.pool = pool.pool;
+			return entry;
+		}
+
+		if (res != VK_ERROR_OUT_OF_POOL_MEMORY && res != VK_ERROR_FRAGMENTED_POOL) {
+			throw std::runtime_error("failed to allocate descriptor sets!");
+		}
+		pool.exhausted = true;
+	}
+
+	Pool& pool = createPool();
+	allocInfo.descriptorPool = pool.pool;
+	if (vkAllocateDescriptorSets(device, &allocInfo, &entry.set) != VK_SUCCESS) {
+		throw std::runtime_error("failed to allocate descriptor sets!");
+	}
+
+	pool.allocatedSets++;
+	entry.pool = pool.pool;
+	return entry;
+}
+
+void DescriptorCache::freeEntry(const Entry& entry)
+{
+	vkFreeDescriptorSets(device, entry.pool, 1, &entry.set);
+
+	auto it = std::find_if(pools.begin(), pools.end(), [&](const Pool& pool) { return pool.pool == entry.pool; });
+	if (it == pools.end())
+		return;
+
+	it->allocatedSets--;
+	it->exhausted = false;
+
+	// Keep the last one around, the next miss would create it again
+	if (it->allocatedSets == 0 && pools.size() > 1) {
+		vkDestroyDescriptorPool(device, it->pool, nullptr);
+		pools.erase(it);
+		stats.pools = static_cast<uint32_t>(pools.size());
+	}
+}
+
+VkDescriptorSet DescriptorCache::get(VkDescriptorSetLayout layout, size_t hash, bool& out_created)
+{
+	auto it = entries.find({ layout, hash });
+	if (it != entries.end()) {
+		it->second.lastUsedFrame = frame;
+		stats.hits++;
+		currentFrameHits++;
+		out_created = false;
+		return it->second.set;
+	}
+
+	stats.misses++;
+	currentFrameMisses++;
+	out_created = true;
+
+	Entry entry;
+	auto& recycled = freeSets[layout];
+	if (!recycled.empty()) {
+		entry = recycled.back();
+		recycled.pop_back();
+		stats.freeSets--;
+	}
+	else {
+		entry = allocateEntry(layout);
+	}
+
+	entry.lastUsedFrame = frame;
+	entries[{ layout, hash }] = entry;
+	stats.liveSets = static_cast<uint32_t>(entries.size());
+
+	return entry.set;
+}
+
+bool DescriptorCache::touch(VkDescriptorSetLayout layout, size_t hash)
+{
+	auto it = entries.find({ layout, hash });
+	if (it == entries.end())
+		return false;
+
+	it->second.lastUsedFrame = frame;
+	return true;
+}
+
+VkDescriptorSet DescriptorCache::allocate(VkDescriptorSetLayout layout)
+{
+	Entry entry = allocateEntry(layout);
+	uncachedSets[entry.set] = entry.pool;
+	return entry.set;
+}
+
+void DescriptorCache::free(VkDescriptorSet set)
+{
+	auto it = uncachedSets.find(set);
+	if (it == uncachedSets.end())
+		return;
+
+	freeEntry({ .set = set, .pool = it->second });
+	uncachedSets.erase(it);
+}
+
+void DescriptorCache::releaseLayout(VkDescriptorSetLayout layout)
+{
+	for (auto it = entries.begin(); it != entries.end();) {
+		if (it->first.layout == layout) {
+			freeEntry(it->second);
+			it = entries.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+
+	if (auto it = freeSets.find(layout); it != freeSets.end()) {
+		for (const Entry& entry : it->second) {
+			freeEntry(entry);
+		}
+		stats.freeSets -= static_cast<uint32_t>(it->second.size());
+		freeSets.erase(it);
+	}
+
+	stats.liveSets = static_cast<uint32_t>(entries.size());
+}
+
+void DescriptorCache::evictStaleSets()
+{
+	for (auto it = entries.begin(); it != entries.end();) {
+		const Entry& entry = it->second;
+
+		// Not bound for staleFrames frames, so no command buffer in flight can use it anymore
+		if (entry.lastUsedFrame + staleFrames < frame) {
+			auto& recycled = freeSets[it->first.layout];
+			if (recycled.size() < maxFreeSetsPerLayout) {
+				recycled.push_back(entry);
+				stats.freeSets++;
+			}
+			else {
+				freeEntry(entry);
+			}
+
+			stats.evictions++;
+			it = entries.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+
+	stats.liveSets = static_cast<uint32_t>(entries.size());
+}
+
+void DescriptorCache::nextFrame()
+{
+	frame++;
+	stats.frameHits = currentFrameHits;
+	stats.frameMisses = currentFrameMisses;
+	currentFrameHits = 0;
+	currentFrameMisses = 0;
+
+	if (frame % evictionInterval == 0)
+		evictStaleSets();
+}
+
+float DescriptorCache::getFrameHitRate() const
+{
+	const uint32_t total = stats.frameHits + stats.frameMisses;
+	return total > 0 ? static_cast<float>(stats.frameHits) / total : 1.0f;
+}
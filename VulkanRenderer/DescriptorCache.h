@@ -0,0 +1,93 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <unordered_map>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+/*
+* Descriptor sets keyed by (layout, hash of what is written in them).
+* Pools are chained when the others are full, sets that were not bound for a while are
+* recycled for the next miss on the same layout, far enough behind the frames in flight to be safe.
+* Freed sets make room in their pool for the next allocations, pools left empty are destroyed.
+*/
+class DescriptorCache {
+public:
+	struct Stats {
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t evictions = 0;
+		uint32_t frameHits = 0;		// Last finished frame only
+		uint32_t frameMisses = 0;
+		uint32_t liveSets = 0;
+		uint32_t freeSets = 0;
+		uint32_t pools = 0;
+	};
+
+	// staleFrames is how long a set stays cached without being bound, at least framesInFlight + 1
+	void init(VkDevice device, uint32_t framesInFlight, uint32_t setsPerPool = 256, uint32_t staleFrames = 120);
+	void cleanup();
+
+	// out_created is true when the set is new or recycled and the caller has to write it
+	VkDescriptorSet get(VkDescriptorSetLayout layout, size_t hash, bool& out_created);
+	// Uncached set, given back with free or cleanup
+	VkDescriptorSet allocate(VkDescriptorSetLayout layout);
+	void free(VkDescriptorSet set);
+	// Frees every cached set of the layout, must be called before destroying it so a new layout can't hit stale entries
+	void releaseLayout(VkDescriptorSetLayout layout);
+
+	// Marks a set as used this frame without binding it, for command buffers that are reused as they are.
+	// False if it is not cached anymore
+	bool touch(VkDescriptorSetLayout layout, size_t hash);
+
+	// Once per frame, after waiting on the frame slot's last submit
+	void nextFrame();
+
+	const Stats& getStats() const { return stats; }
+	float getFrameHitRate() const;
+
+private:
+	struct Key {
+		VkDescriptorSetLayout layout;
+		size_t hash;
+
+		bool operator==(const Key& o) const { return layout == o.layout && hash == o.hash; }
+	};
+
+	struct KeyHasher {
+		size_t operator()(const Key& k) const;
+	};
+
+	struct Entry {
+		VkDescriptorSet set = VK_NULL_HANDLE;
+		VkDescriptorPool pool = VK_NULL_HANDLE;
+		uint64_t lastUsedFrame = 0;
+	};
+
+	VkDevice device = VK_NULL_HANDLE;
+	uint32_t framesInFlight = 0;
+	uint32_t setsPerPool = 0;
+	uint32_t staleFrames = 0;
+	uint64_t frame = 0;
+	uint32_t currentFrameHits = 0;
+	uint32_t currentFrameMisses = 0;
+
+	std::unordered_map<Key, Entry, KeyHasher> entries;
+	std::unordered_map<VkDescriptorSetLayout, std::vector<Entry>> freeSets; // Evicted, can be rewritten right away
+	struct Pool {
+		VkDescriptorPool pool = VK_NULL_HANDLE;
+		uint32_t allocatedSets = 0;
+		bool exhausted = false; // Ran out of some descriptor type, skipped until a set is freed from it
+	};
+	std::vector<Pool> pools; // Allocations try the newest first
+	std::unordered_map<VkDescriptorSet, VkDescriptorPool> uncachedSets;
+
+	Stats stats;
+
+	Pool& createPool();
+	Entry allocateEntry(VkDescriptorSetLayout layout);
+	void freeEntry(const Entry& entry);
+	void evictStaleSets();
+};
@@ -4,6 +4,7 @@
 #include <iostream>
 #include <stdexcept>
 #include <cstdlib>
+#include <cstdio>
 #include <vector>
 #include <set>
 #include <optional>
@@ -12,6 +13,10 @@
 #include <array>
 #include <variant>
 #include <map>
+#include <numeric>
+#include <fstream>
+#include <filesystem>
+#include <cstring>
 
 
 #define GLFW_EXPOSE_NATIVE_WIN32
@@ -49,6 +54,18 @@ void Device::init(GLFWwindow* window, DeviceOptions options)
 {
 	this->window = window;
 	this->usesMsaa = options.usesMsaa;
+	this->stagingBufferSize = options.stagingBufferSize;
+	this->geometryVertexHeapSize = options.geometryVertexHeapSize;
+	this->geometryIndexHeapSize = options.geometryIndexHeapSize;
+	this->maxBindlessTextures = options.maxBindlessTextures;
+	this->maxBindlessSamplers = options.maxBindlessSamplers;
+	this->pipelineCachePath = options.pipelineCachePath;
+	this->dynamicRendering = options.useDynamicRendering;
+	this->minDrawsPerRecordThread = std::max(options.minDrawsPerRecordThread, (size_t)1);
+	this->cachePassCommands = options.cachePassCommands;
+	this->indirectDraws = options.useIndirectDraws;
+	this->asyncCompute = options.useAsyncCompute;
+	this->maxFramesInFlight = std::clamp(options.framesInFlight, 1u, MaxFramesInFlightLimit);
 	initVulkan();
 	initImGui();
 }
@@ -305,7 +322,6 @@ void Device::createSurface() {
 	}
 }
 
-// TODO : properly use a separate compute family
 QueueFamilyIndices Device::findQueueFamilies(VkPhysicalDevice device) {
 	QueueFamilyIndices indices;
 
@@ -318,7 +334,6 @@ QueueFamilyIndices Device::findQueueFamilies(VkPhysicalDevice device) {
 
 	int i = 0;
 	for (const auto& queueFamily : queueFamilies) {
-		//TODO try to use a dedicated compute queue
 		if ((queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) && (queueFamily.queueFlags & VK_QUEUE_COMPUTE_BIT)) {
 			indices.graphicsFamily = i;
 		}
@@ -336,6 +351,39 @@ QueueFamilyIndices Device::findQueueFamilies(VkPhysicalDevice device) {
 		i++;
 	}
 
+	// Transfer only families are the copy engines, uploads there run alongside the rendering.
+	// We copy textures a few rows at a time so we only take it if it has no image granularity constraint
+	i = 0;
+	for (const auto& queueFamily : queueFamilies) {
+		const VkExtent3D& granularity = queueFamily.minImageTransferGranularity;
+		if ((queueFamily.queueFlags & VK_QUEUE_TRANSFER_BIT) && !(queueFamily.queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))
+			&& granularity.width == 1 && granularity.height == 1 && granularity.depth == 1) {
+			indices.transferFamily = i;
+			break;
+		}
+
+		i++;
+	}
+
+	if (!indices.transferFamily.has_value()) {
+		indices.transferFamily = indices.graphicsFamily;
+	}
+
+	// Compute only families are the async compute engines, work submitted there overlaps the graphics queue
+	i = 0;
+	for (const auto& queueFamily : queueFamilies) {
+		if ((queueFamily.queueFlags & VK_QUEUE_COMPUTE_BIT) && !(queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+			indices.computeFamily = i;
+			break;
+		}
+
+		i++;
+	}
+
+	if (!indices.computeFamily.has_value()) {
+		indices.computeFamily = indices.graphicsFamily;
+	}
+
 	return indices;
 }
 
@@ -404,13 +452,25 @@ uint32_t Device::rateDeviceSuitability(VkPhysicalDevice device) {
 
 	VkPhysicalDeviceFeatures supportedFeatures;
 	vkGetPhysicalDeviceFeatures(device, &supportedFeatures);
+
+	VkPhysicalDeviceVulkan12Features supportedFeatures12{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES };
+	VkPhysicalDeviceFeatures2 supportedFeatures2{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2, .pNext = &supportedFeatures12 };
+	vkGetPhysicalDeviceFeatures2(device, &supportedFeatures2);
+
+	// Needed by the bindless texture table
+	bool supportsDescriptorIndexing = supportedFeatures12.runtimeDescriptorArray
+		&& supportedFeatures12.descriptorBindingPartiallyBound
+		&& supportedFeatures12.descriptorBindingSampledImageUpdateAfterBind
+		&& supportedFeatures12.descriptorBindingUpdateUnusedWhilePending
+		&& supportedFeatures12.shaderSampledImageArrayNonUniformIndexing;
+
 	VkPhysicalDeviceProperties deviceProperties;
 	vkGetPhysicalDeviceProperties(device, &deviceProperties);
 
 	std::cout << "Detected GPU: " << deviceProperties.deviceName << std::endl;
 
 	bool isGoodGPU =  deviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU;
-	bool isSuitable = indices.isComplete() && extensionsSupported && swapChainAdequate && supportedFeatures.samplerAnisotropy;
+	bool isSuitable = indices.isComplete() && extensionsSupported && swapChainAdequate && supportedFeatures.samplerAnisotropy && supportsDescriptorIndexing;
 
 
 	return isSuitable ? (isGoodGPU ? 1000 : 100) + deviceProperties.limits.maxImageDimension2D : 0;
@@ -448,9 +508,14 @@ void Device::pickPhysicalDevice() {
 void Device::createLogicalDevice() {
 	QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
 
+	// Off, the async passes are recorded with the others
+	if (!asyncCompute)
+		indices.computeFamily = indices.graphicsFamily;
+	asyncCompute = indices.computeFamily != indices.graphicsFamily;
+
 
 	std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
-	std::set<uint32_t> uniqueQueueFamilies = { indices.graphicsFamily.value(), indices.presentFamily.value() };
+	std::set<uint32_t> uniqueQueueFamilies = { indices.graphicsFamily.value(), indices.presentFamily.value(), indices.transferFamily.value(), indices.computeFamily.value() };
 
 	float queuePriority = 1.0f;
 	for (uint32_t queueFamily : uniqueQueueFamilies) {
@@ -471,6 +536,42 @@ void Device::createLogicalDevice() {
 	VkPhysicalDeviceVulkan12Features deviceVulkan12Features{};
 	deviceVulkan12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
 	deviceVulkan12Features.shaderOutputLayer = VK_TRUE;
+	deviceVulkan12Features.runtimeDescriptorArray = VK_TRUE;
+	deviceVulkan12Features.descriptorBindingPartiallyBound = VK_TRUE;
+	deviceVulkan12Features.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+	deviceVulkan12Features.descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+	deviceVulkan12Features.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+	deviceVulkan12Features.timelineSemaphore = VK_TRUE; // Core since 1.2, frames and uploads sync on it
+
+	VkPhysicalDeviceVulkan12Features supportedFeatures12{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES };
+	VkPhysicalDeviceVulkan13Features supportedFeatures13{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES, .pNext = &supportedFeatures12 };
+	VkPhysicalDeviceFeatures2 supportedFeatures2{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2, .pNext = &supportedFeatures13 };
+	vkGetPhysicalDeviceFeatures2(physicalDevice, &supportedFeatures2);
+
+	// Also optional, drawIndirect issues the draws one by one without them
+	indirectDraws = indirectDraws && supportedFeatures2.features.multiDrawIndirect && supportedFeatures2.features.drawIndirectFirstInstance;
+	indirectDrawCount = indirectDraws && supportedFeatures12.drawIndirectCount;
+	deviceFeatures.multiDrawIndirect = indirectDraws;
+	deviceFeatures.drawIndirectFirstInstance = indirectDraws;
+	deviceVulkan12Features.drawIndirectCount = indirectDrawCount;
+
+	// Optional, render passes and framebuffers are still there otherwise
+	dynamicRendering = dynamicRendering && supportedFeatures13.dynamicRendering;
+	VkPhysicalDeviceVulkan13Features deviceVulkan13Features{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES };
+	deviceVulkan13Features.dynamicRendering = dynamicRendering;
+	deviceVulkan12Features.pNext = &deviceVulkan13Features;
+
+	// Per queue GPU timings, both queues have to write timestamps and the queries are reset from the CPU once read
+	uint32_t queueFamilyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+	std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+	const bool timestamps = supportedFeatures12.hostQueryReset && properties.limits.timestampPeriod > 0.0f
+		&& queueFamilies[indices.graphicsFamily.value()].timestampValidBits && queueFamilies[indices.computeFamily.value()].timestampValidBits;
+	deviceVulkan12Features.hostQueryReset = timestamps;
+	timestampPeriod = timestamps ? properties.limits.timestampPeriod : 0.0f;
 
 	VkDeviceCreateInfo createInfo{};
 	createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -501,7 +602,21 @@ void Device::createLogicalDevice() {
 	vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
 	vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
 	vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &computeQueue);
+	vkGetDeviceQueue(device, indices.transferFamily.value(), 0, &transferQueue);
+	vkGetDeviceQueue(device, indices.computeFamily.value(), 0, &asyncComputeQueue);
+
+	graphicsQueueFamily = indices.graphicsFamily.value();
+	transferQueueFamily = indices.transferFamily.value();
+	computeQueueFamily = indices.computeFamily.value();
 
+	// Present only reads the swapchain images
+	std::set<uint32_t> bufferQueueFamilies = { graphicsQueueFamily, transferQueueFamily, computeQueueFamily };
+	if (asyncCompute)
+		concurrentQueueFamilies.assign(bufferQueueFamilies.begin(), bufferQueueFamilies.end());
+
+	allocator.init(physicalDevice, device);
+	descriptorCache.init(device, maxFramesInFlight);
+	shaderCache.init(device);
 }
 
 
@@ -552,7 +667,8 @@ void Device::createSwapChain() {
 	VkPresentModeKHR presentMode = chooseSwapPresentMode(swapChainSupport.presentModes);
 	VkExtent2D extent = chooseSwapExtent(swapChainSupport.capabilities);
 
-	uint32_t imageCount = swapChainSupport.capabilities.minImageCount + 1;
+	// Enough images for every frame in flight to hold one, acquire would block on the extra frames otherwise
+	uint32_t imageCount = std::max(swapChainSupport.capabilities.minImageCount + 1, maxFramesInFlight);
 	if (swapChainSupport.capabilities.maxImageCount > 0 && imageCount > swapChainSupport.capabilities.maxImageCount) {
 		imageCount = swapChainSupport.capabilities.maxImageCount;
 	}
@@ -627,20 +743,6 @@ void Device::createImageViews() {
 	}
 }
 
-VkShaderModule Device::createShaderModule(const std::vector<char>& code) {
-	VkShaderModuleCreateInfo createInfo{};
-	createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-	createInfo.codeSize = code.size();
-	createInfo.pCode = reinterpret_cast<const uint32_t*>(code.data());
-
-	VkShaderModule shaderModule = VK_NULL_HANDLE;
-	if (vkCreateShaderModule(device, &createInfo, nullptr, &shaderModule) != VK_SUCCESS) {
-		throw std::runtime_error("failed to create shader module!");
-	}
-
-	return shaderModule;
-}
-
 void Device::createDefaultRenderPass() {
 
 	RenderPassDesc desc = {
@@ -698,46 +800,51 @@ void Device::createCommandPool() {
 	if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS) {
 		throw std::runtime_error("failed to create command pool!");
 	}
-}
 
+	//Upload command buffers are short lived, they are freed once their batch is done
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+	poolInfo.queueFamilyIndex = queueFamilyIndeices.transferFamily.value();
 
-uint32_t Device::findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
-	VkPhysicalDeviceMemoryProperties memProperties;
-	vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+	if (vkCreateCommandPool(device, &poolInfo, nullptr, &transferCommandPool) != VK_SUCCESS) {
+		throw std::runtime_error("failed to create transfer command pool!");
+	}
+
+	if (asyncCompute) {
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+		poolInfo.queueFamilyIndex = computeQueueFamily;
 
-	for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
-		if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
-			return i;
+		if (vkCreateCommandPool(device, &poolInfo, nullptr, &asyncComputeCommandPool) != VK_SUCCESS) {
+			throw std::runtime_error("failed to create async compute command pool!");
 		}
 	}
-
-	throw std::runtime_error("failed to find suitable memory type!");
 }
 
-void Device::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& out_buffer, VkDeviceMemory& out_bufferMemory) {
+
+void Device::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, Buffer& out_buffer) {
 	VkBufferCreateInfo bufferInfo{};
 	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 	bufferInfo.size = size;
 	bufferInfo.usage = usage;
 	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
-	if (vkCreateBuffer(device, &bufferInfo, nullptr, &out_buffer) != VK_SUCCESS) {
+	// Written by the CPU and read from any queue, async compute included, without ownership transfers
+	if (!concurrentQueueFamilies.empty() && (properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)) {
+		bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+		bufferInfo.queueFamilyIndexCount = (uint32_t)concurrentQueueFamilies.size();
+		bufferInfo.pQueueFamilyIndices = concurrentQueueFamilies.data();
+	}
+
+	if (vkCreateBuffer(device, &bufferInfo, nullptr, &out_buffer.buffer) != VK_SUCCESS) {
 		throw std::runtime_error("failed to create vertex buffer!");
 	}
 
 	VkMemoryRequirements memRequirements;
-	vkGetBufferMemoryRequirements(device, out_buffer, &memRequirements);
+	vkGetBufferMemoryRequirements(device, out_buffer.buffer, &memRequirements);
 
-	VkMemoryAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memRequirements.size;
-	allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
+	out_buffer.allocation = allocator.allocate(memRequirements, properties, true);
+	out_buffer.mapped_memory = out_buffer.allocation.mapped;
 
-	if (vkAllocateMemory(device, &allocInfo, nullptr, &out_bufferMemory) != VK_SUCCESS) {
-		throw std::runtime_error("failed to allocate vertex buffer memory!");
-	}
-
-	vkBindBufferMemory(device, out_buffer, out_bufferMemory, 0);
+	vkBindBufferMemory(device, out_buffer.buffer, out_buffer.allocation.memory, out_buffer.allocation.offset);
 }
 
 void Device::createImage(ImageDesc desc, GpuImage& out_image) {
@@ -766,84 +873,190 @@ void Device::createImage(ImageDesc desc, GpuImage& out_image) {
 	VkMemoryRequirements memRequirements;
 	vkGetImageMemoryRequirements(device, out_image.image, &memRequirements);
 
-	VkMemoryAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memRequirements.size;
-	allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, desc.memory_properties);// VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	out_image.allocation = allocator.allocate(memRequirements, desc.memory_properties, desc.tiling == VK_IMAGE_TILING_LINEAR);
+
+	vkBindImageMemory(device, out_image.image, out_image.allocation.memory, out_image.allocation.offset);
+}
 
-	if (vkAllocateMemory(device, &allocInfo, nullptr, &out_image.memory) != VK_SUCCESS) {
-		throw std::runtime_error("failed to allocate image memory!");
+VkDeviceSize Device::allocateStaging(VkDeviceSize size, VkDeviceSize alignment)
+{
+	VkDeviceSize offset = stagingRing.allocate(size, alignment);
+	if (offset == StagingRing::InvalidOffset) {
+		// Ring is full, push what we have recorded so far and wait for the oldest batches to give their space back
+		flushCommandBuffer();
+		setupCommandBuffer();
+		while ((offset = stagingRing.allocate(size, alignment)) == StagingRing::InvalidOffset) {
+			waitUpload({ pendingUploads.front().id });
+		}
 	}
 
-	vkBindImageMemory(device, out_image.image, out_image.memory, 0);
+	return offset;
+}
+
+// Needs an upload batch to be recording
+void Device::uploadBuffer(VkBuffer dst, VkDeviceSize dstOffset, const void* src, VkDeviceSize size)
+{
+	// Anything bigger than the ring is split in several copies
+	VkDeviceSize done = 0;
+	while (done < size) {
+		VkDeviceSize chunk = std::min(size - done, stagingRing.getCapacity());
+		VkDeviceSize offset = allocateStaging(chunk, 4);
+		memcpy(static_cast<char*>(stagingBuffer.mapped_memory) + offset, static_cast<const char*>(src) + done, chunk);
+
+		VkBufferCopy copyRegion{
+			.srcOffset = offset,
+			.dstOffset = dstOffset + done,
+			.size = chunk,
+		};
+		vkCmdCopyBuffer(currentUpload.transferCmd, stagingBuffer.buffer, dst, 1, &copyRegion);
+
+		done += chunk;
+	}
+}
+
+// Needs an upload batch to be recording, the image must be in TRANSFER_DST
+void Device::uploadImage(VkImage image, const void* src, uint32_t width, uint32_t height, size_t layerSize, uint32_t layerCount) {
+	const VkDeviceSize rowPitch = layerSize / height;
+	const VkDeviceSize texelSize = rowPitch / width;
+	// bufferOffset must be a multiple of 4 and of the texel size
+	const VkDeviceSize alignment = std::lcm(texelSize, VkDeviceSize(4));
+
+	// Layers that don't fit in the ring are copied a few rows at a time
+	const uint32_t maxRows = static_cast<uint32_t>(std::min<VkDeviceSize>(stagingRing.getCapacity() / rowPitch, height));
+	if (maxRows == 0) {
+		throw std::runtime_error("staging buffer is too small for a single texture row");
+	}
+
+	for (uint32_t layer = 0; layer < layerCount; layer++) {
+		const char* layerData = static_cast<const char*>(src) + layerSize * layer;
+
+		for (uint32_t row = 0; row < height;) {
+			const uint32_t rowCount = std::min(height - row, maxRows);
+			const VkDeviceSize chunk = rowPitch * rowCount;
+
+			VkDeviceSize offset = allocateStaging(chunk, alignment);
+			memcpy(static_cast<char*>(stagingBuffer.mapped_memory) + offset, layerData + rowPitch * row, chunk);
+
+			VkBufferImageCopy region = {
+				.bufferOffset = offset,
+				.bufferRowLength = 0,
+				.bufferImageHeight = 0,
+				.imageSubresource = VkImageSubresourceLayers {
+					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+					.mipLevel = 0,
+					.baseArrayLayer = layer,
+					.layerCount = 1
+				},
+				.imageOffset = { 0, static_cast<int32_t>(row), 0 },
+				.imageExtent = {
+					width,
+					rowCount,
+					1
+				},
+			};
+
+			vkCmdCopyBufferToImage(
+				currentUpload.transferCmd,
+				stagingBuffer.buffer,
+				image,
+				VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				1,
+				&region
+			);
+
+			row += rowCount;
+		}
+	}
 }
 
-/* TODO : use a separate command pool */
-void Device::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
-	VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+// Where uploaded data ends up being read
+static constexpr VkPipelineStageFlags uploadConsumerStages = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
 
-	VkBufferCopy copyRegion{};
-	copyRegion.srcOffset = 0; // Optional
-	copyRegion.dstOffset = 0; // Optional
-	copyRegion.size = size;
-	vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
+// Release on the transfer queue and acquire on the graphics one, or just a regular barrier if they are the same family
+void Device::transferBufferOwnership(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size)
+{
+	VkBufferMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT | VK_ACCESS_SHADER_READ_BIT,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.buffer = buffer,
+		.offset = offset,
+		.size = size,
+	};
+
+	if (!hasDedicatedTransferQueue()) {
+		vkCmdPipelineBarrier(currentUpload.graphicsCmd, VK_PIPELINE_STAGE_TRANSFER_BIT, uploadConsumerStages, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+		return;
+	}
+
+	barrier.srcQueueFamilyIndex = transferQueueFamily;
+	barrier.dstQueueFamilyIndex = graphicsQueueFamily;
+
+	// dst access is ignored for the release and src access for the acquire
+	VkBufferMemoryBarrier release = barrier;
+	release.dstAccessMask = 0;
+	vkCmdPipelineBarrier(currentUpload.transferCmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 1, &release, 0, nullptr);
 
-	endSingleTimeCommands(commandBuffer);
+	VkBufferMemoryBarrier acquire = barrier;
+	acquire.srcAccessMask = 0;
+	vkCmdPipelineBarrier(currentUpload.graphicsCmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, uploadConsumerStages, 0, 0, nullptr, 1, &acquire, 0, nullptr);
 }
 
-void Device::copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height, size_t layerSize, uint32_t layerCount) {
-	
-	MyCommandBuffer commandBuffer = getCommandBuffer();
+// Same as above, the image goes from TRANSFER_DST to newLayout on the way
+void Device::transferImageOwnership(VkImage image, VkImageLayout newLayout, VkAccessFlags dstAccess, VkPipelineStageFlags dstStage, uint32_t mipLevels, uint32_t layerCount)
+{
+	VkImageMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = dstAccess,
+		.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		.newLayout = newLayout,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.image = image,
+		.subresourceRange = {
+			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.baseMipLevel = 0,
+			.levelCount = mipLevels,
+			.baseArrayLayer = 0,
+			.layerCount = layerCount,
+		},
+	};
 
-	std::vector<VkBufferImageCopy> regions;
-
-	for (uint32_t i = 0; i < layerCount; i++) {
-		VkBufferImageCopy region = {
-			.bufferOffset = layerSize * i,
-			.bufferRowLength = 0,
-			.bufferImageHeight = 0,
-			.imageSubresource = VkImageSubresourceLayers {
-				.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-				.mipLevel = 0,
-				.baseArrayLayer = i,
-				.layerCount = 1
-			},
-			.imageOffset = { 0, 0, 0 },
-			.imageExtent = {
-				width,
-				height,
-				1
-			},
-		};
-		regions.push_back(region);
+	if (!hasDedicatedTransferQueue()) {
+		vkCmdPipelineBarrier(currentUpload.graphicsCmd, VK_PIPELINE_STAGE_TRANSFER_BIT, dstStage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+		return;
 	}
 
-	vkCmdCopyBufferToImage(
-		commandBuffer,
-		buffer,
-		image,
-		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-		regions.size(),
-		regions.data()
-	);
+	barrier.srcQueueFamilyIndex = transferQueueFamily;
+	barrier.dstQueueFamilyIndex = graphicsQueueFamily;
+
+	// Both sides have to do the same layout transition, it only happens once
+	VkImageMemoryBarrier release = barrier;
+	release.dstAccessMask = 0;
+	vkCmdPipelineBarrier(currentUpload.transferCmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &release);
+
+	VkImageMemoryBarrier acquire = barrier;
+	acquire.srcAccessMask = 0;
+	vkCmdPipelineBarrier(currentUpload.graphicsCmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, dstStage, 0, 0, nullptr, 0, nullptr, 1, &acquire);
 }
 
 
 void Device::createUniformBuffers() {
 	VkDeviceSize bufferSize = sizeof(UniformBufferObject);
 
-	uniformBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+	uniformBuffers.resize(maxFramesInFlight);
 	
 	VkDeviceSize computeBufferSize = sizeof(ParticleUBO);
-	computeUniformBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+	computeUniformBuffers.resize(maxFramesInFlight);
 
-	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-		createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, uniformBuffers[i].buffer, uniformBuffers[i].memory);
-		vkMapMemory(device, uniformBuffers[i].memory, 0, bufferSize, 0, &uniformBuffers[i].mapped_memory);
+	for (size_t i = 0; i < maxFramesInFlight; i++) {
+		createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, uniformBuffers[i]);
 		uniformBuffers[i].size = bufferSize;
 
-		createBuffer(computeBufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, computeUniformBuffers[i].buffer, computeUniformBuffers[i].memory);
-		vkMapMemory(device, computeUniformBuffers[i].memory, 0, computeBufferSize, 0, &computeUniformBuffers[i].mapped_memory);
+		createBuffer(computeBufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, computeUniformBuffers[i]);
 		computeUniformBuffers[i].size = computeBufferSize;
 	}
 
@@ -852,10 +1065,271 @@ void Device::createUniformBuffers() {
 
 }
 
+void Device::createStagingBuffer() {
+	createBuffer(stagingBufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer);
+	stagingBuffer.size = stagingBufferSize;
+	stagingRing.init(stagingBufferSize);
+	SetBufferName(stagingBuffer.buffer, "Staging Ring");
+}
+
+void Device::createGeometryHeap() {
+	geometryVertexBuffer = createVertexBuffer(geometryVertexHeapSize);
+	geometryIndexBuffer = createIndexBuffer(geometryIndexHeapSize);
+	vertexHeap.init(geometryVertexHeapSize);
+	indexHeap.init(geometryIndexHeapSize);
+
+	SetBufferName(geometryVertexBuffer.buffer, "Geometry Heap/Vertices");
+	SetBufferName(geometryIndexBuffer.buffer, "Geometry Heap/Indices");
+}
+
+void Device::createBindlessTable() {
+	VkPhysicalDeviceVulkan12Properties properties12{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES };
+	VkPhysicalDeviceProperties2 properties2{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2, .pNext = &properties12 };
+	vkGetPhysicalDeviceProperties2(physicalDevice, &properties2);
+
+	maxBindlessTextures = std::min(maxBindlessTextures, properties12.maxPerStageDescriptorUpdateAfterBindSampledImages);
+	maxBindlessSamplers = std::min(maxBindlessSamplers, properties12.maxPerStageDescriptorUpdateAfterBindSamplers);
+
+	// Textures and samplers are separate so any texture can be used with any sampler without a combination explosion
+	std::array<VkDescriptorSetLayoutBinding, 2> bindings{};
+	bindings[0] = {
+		.binding = 0,
+		.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
+		.descriptorCount = maxBindlessTextures,
+		.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
+	};
+	bindings[1] = {
+		.binding = 1,
+		.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER,
+		.descriptorCount = maxBindlessSamplers,
+		.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
+	};
+
+	// Slots are written while frames using other slots are in flight, unused ones are never read
+	const VkDescriptorBindingFlags bindlessFlags = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT;
+	std::array<VkDescriptorBindingFlags, 2> bindingFlags = { bindlessFlags, bindlessFlags };
+
+	VkDescriptorSetLayoutBindingFlagsCreateInfo bindingFlagsInfo{
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
+		.bindingCount = static_cast<uint32_t>(bindingFlags.size()),
+		.pBindingFlags = bindingFlags.data(),
+	};
+
+	VkDescriptorSetLayoutCreateInfo layoutInfo{
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+		.pNext = &bindingFlagsInfo,
+		.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
+		.bindingCount = static_cast<uint32_t>(bindings.size()),
+		.pBindings = bindings.data(),
+	};
+
+	if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &bindlessSetLayout) != VK_SUCCESS) {
+		throw std::runtime_error("failed to create bindless descriptor set layout!");
+	}
+
+	std::array<VkDescriptorPoolSize, 2> poolSizes = {
+		VkDescriptorPoolSize{ VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, maxBindlessTextures },
+		VkDescriptorPoolSize{ VK_DESCRIPTOR_TYPE_SAMPLER, maxBindlessSamplers },
+	};
+
+	VkDescriptorPoolCreateInfo poolInfo{
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+		.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT,
+		.maxSets = 1,
+		.poolSizeCount = static_cast<uint32_t>(poolSizes.size()),
+		.pPoolSizes = poolSizes.data(),
+	};
+
+	if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &bindlessPool) != VK_SUCCESS) {
+		throw std::runtime_error("failed to create bindless descriptor pool!");
+	}
+
+	createDescriptorSets(bindlessSetLayout, bindlessPool, &bindlessSet, 1);
+}
+
+// The driver ignores a blob it doesn't like, but some crash on one from another GPU or driver, so check the header ourselves
+static bool isPipelineCacheCompatible(const std::vector<char>& data, const VkPhysicalDeviceProperties& properties)
+{
+	VkPipelineCacheHeaderVersionOne header;
+	if (data.size() < sizeof(header))
+		return false;
+
+	memcpy(&header, data.data(), sizeof(header));
+
+	return header.headerSize >= sizeof(header)
+		&& header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+		&& header.vendorID == properties.vendorID
+		&& header.deviceID == properties.deviceID
+		&& memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+void Device::createPipelineCache() {
+	std::vector<char> data;
+
+	if (!pipelineCachePath.empty()) {
+		std::ifstream file(pipelineCachePath, std::ios::ate | std::ios::binary);
+		if (file.is_open()) {
+			data.resize((size_t)file.tellg());
+			file.seekg(0);
+			file.read(data.data(), data.size());
+		}
+	}
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+	if (!data.empty() && !isPipelineCacheCompatible(data, properties)) {
+		std::cout << "Pipeline cache " << pipelineCachePath << " was made for another device or driver, starting from scratch" << std::endl;
+		data.clear();
+	}
+
+	VkPipelineCacheCreateInfo cacheInfo{
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+		.initialDataSize = data.size(),
+		.pInitialData = data.empty() ? nullptr : data.data(),
+	};
+
+	if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache) != VK_SUCCESS) {
+		// A valid header doesn't mean the rest is, retry empty rather than failing
+		cacheInfo.initialDataSize = 0;
+		cacheInfo.pInitialData = nullptr;
+		data.clear();
+		if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache) != VK_SUCCESS) {
+			throw std::runtime_error("failed to create pipeline cache!");
+		}
+	}
+
+	pipelineCacheLoadedSize = data.size();
+}
+
+void Device::savePipelineCache() {
+	if (pipelineCachePath.empty() || pipelineCache == VK_NULL_HANDLE)
+		return;
+
+	// The cache holds what we loaded plus everything created since, so this is the merged result
+	size_t size = 0;
+	if (vkGetPipelineCacheData(device, pipelineCache, &size, nullptr) != VK_SUCCESS || size == 0)
+		return;
+
+	std::vector<char> data(size);
+	if (vkGetPipelineCacheData(device, pipelineCache, &size, data.data()) != VK_SUCCESS)
+		return;
+
+	// Written next to the old one then renamed over it, which replaces it in one step.
+	// A crash while saving leaves either the old cache or the new one, never a truncated one
+	const std::string tmpPath = pipelineCachePath + ".tmp";
+	{
+		std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) {
+			std::cerr << "failed to write pipeline cache " << tmpPath << std::endl;
+			return;
+		}
+		file.write(data.data(), size);
+	}
+
+	std::error_code error;
+	std::filesystem::rename(tmpPath, pipelineCachePath, error);
+	if (error) {
+		std::cerr << "failed to write pipeline cache " << pipelineCachePath << ": " << error.message() << std::endl;
+	}
+}
+
+uint32_t Device::registerTexture(GpuImage& image)
+{
+	if (image.bindlessIndex != UINT32_MAX)
+		return image.bindlessIndex;
+
+	uint32_t index;
+	if (!freeBindlessTextures.empty()) {
+		index = freeBindlessTextures.back();
+		freeBindlessTextures.pop_back();
+	}
+	else {
+		if (bindlessTextureCount >= maxBindlessTextures)
+			throw std::runtime_error("failed to register texture : bindless table is full");
+		index = bindlessTextureCount++;
+	}
+
+	VkDescriptorImageInfo imageInfo{
+		.imageView = image.view,
+		.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+	};
+
+	VkWriteDescriptorSet write{
+		.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+		.dstSet = bindlessSet,
+		.dstBinding = 0,
+		.dstArrayElement = index,
+		.descriptorCount = 1,
+		.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
+		.pImageInfo = &imageInfo,
+	};
+	vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+
+	image.bindlessIndex = index;
+	return index;
+}
+
+void Device::unregisterTexture(GpuImage& image)
+{
+	if (image.bindlessIndex == UINT32_MAX)
+		return;
+
+	// Partially bound, the stale descriptor is fine as long as nothing indexes it
+	freeBindlessTextures.push_back(image.bindlessIndex);
+	image.bindlessIndex = UINT32_MAX;
+}
+
+uint32_t Device::registerSampler(VkSampler sampler)
+{
+	if (auto it = bindlessSamplers.find(sampler); it != bindlessSamplers.end())
+		return it->second;
+
+	// Few samplers and they live as long as the scene, no need to recycle their slots
+	if (bindlessSamplerCount >= maxBindlessSamplers)
+		throw std::runtime_error("failed to register sampler : bindless table is full");
+	uint32_t index = bindlessSamplerCount++;
+
+	VkDescriptorImageInfo samplerInfo{ .sampler = sampler };
+
+	VkWriteDescriptorSet write{
+		.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+		.dstSet = bindlessSet,
+		.dstBinding = 1,
+		.dstArrayElement = index,
+		.descriptorCount = 1,
+		.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER,
+		.pImageInfo = &samplerInfo,
+	};
+	vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+
+	bindlessSamplers[sampler] = index;
+	return index;
+}
+
+void Device::unregisterSampler(VkSampler sampler)
+{
+	bindlessSamplers.erase(sampler);
+}
+
 
 void Device::createComputeDescriptorSets(const Pipeline& computePipeline) {
-	computeDescriptorSets.resize(MAX_FRAMES_IN_FLIGHT);
-	createDescriptorSets(computePipeline.descriptorSetLayouts[0], computePipeline.descriptorPool, computeDescriptorSets.data(), MAX_FRAMES_IN_FLIGHT);
+	// Created again, the previous ones go back to their pool
+	destroyComputeDescriptorSets();
+
+	computeDescriptorSets.resize(maxFramesInFlight);
+	for (auto& set : computeDescriptorSets) {
+		set = descriptorCache.allocate(computePipeline.descriptorSetLayouts[0]);
+	}
+	computeDescriptorSetLayout = computePipeline.descriptorSetLayouts[0];
+}
+
+void Device::destroyComputeDescriptorSets() {
+	for (VkDescriptorSet set : computeDescriptorSets) {
+		descriptorCache.free(set);
+	}
+	computeDescriptorSets.clear();
+	computeDescriptorSetLayout = VK_NULL_HANDLE;
 }
 
 
@@ -928,7 +1402,7 @@ void Device::updateDescriptorSet(const std::vector<BindingDesc>& bindings, std::
 
 void Device::updateComputeDescriptorSets(const std::vector<Buffer>& buffers) {
 	//TODO: Make this usable with the above one
-	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+	for (size_t i = 0; i < maxFramesInFlight; i++) {
 		VkDescriptorBufferInfo uniformBufferInfo{};
 		uniformBufferInfo.buffer = computeUniformBuffers[i].buffer;
 		uniformBufferInfo.offset = 0;
@@ -947,7 +1421,8 @@ void Device::updateComputeDescriptorSets(const std::vector<Buffer>& buffers) {
 		descriptorWrites[0].pTexelBufferView = nullptr; // Optional
 
 		VkDescriptorBufferInfo storageBufferInfoLastFrame{};
-		storageBufferInfoLastFrame.buffer = buffers[(i - 1) % MAX_FRAMES_IN_FLIGHT].buffer;
+		// There are at least two buffers even with a single frame in flight
+		storageBufferInfoLastFrame.buffer = buffers[(i + buffers.size() - 1) % buffers.size()].buffer;
 		storageBufferInfoLastFrame.offset = 0;
 		storageBufferInfoLastFrame.range = sizeof(Particle) * PARTICLE_COUNT;
 
@@ -976,8 +1451,8 @@ void Device::updateComputeDescriptorSets(const std::vector<Buffer>& buffers) {
 	}
 }
 void Device::createCommandBuffer() {
-	commandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
-	computeCommandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+	commandBuffers.resize(maxFramesInFlight);
+	computeCommandBuffers.resize(maxFramesInFlight);
 
 	VkCommandBufferAllocateInfo allocInfo{};
 	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -992,14 +1467,47 @@ void Device::createCommandBuffer() {
 	if (vkAllocateCommandBuffers(device, &allocInfo, computeCommandBuffers.data()) != VK_SUCCESS) {
 		throw std::runtime_error("failed to allocate compute command buffers!");
 	}
+
+	if (asyncCompute) {
+		asyncComputeCommandBuffers.resize(maxFramesInFlight);
+		allocInfo.commandPool = asyncComputeCommandPool;
+
+		if (vkAllocateCommandBuffers(device, &allocInfo, asyncComputeCommandBuffers.data()) != VK_SUCCESS) {
+			throw std::runtime_error("failed to allocate async compute command buffers!");
+		}
+	}
 }
 
 
+void Device::createSecondaryCommandPools() {
+	QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
+
+	VkCommandPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+	poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+
+	secondaryPools.resize(maxFramesInFlight);
+	for (auto& framePools : secondaryPools) {
+		framePools.resize(recordWorkers.getThreadCount() + 1);
+		for (auto& pool : framePools) {
+			if (vkCreateCommandPool(device, &poolInfo, nullptr, &pool.pool) != VK_SUCCESS) {
+				throw std::runtime_error("failed to create secondary command pool!");
+			}
+		}
+	}
+
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+	if (vkCreateCommandPool(device, &poolInfo, nullptr, &cachedCommandPool) != VK_SUCCESS) {
+		throw std::runtime_error("failed to create cached command pool!");
+	}
+}
+
 void Device::createSyncObjects() {
-	imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-	computeInFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
-	computeFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-	inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+	imageAvailableSemaphores.resize(maxFramesInFlight);
+	frameGraphicsValues.assign(maxFramesInFlight, 0);
+	frameComputeValues.assign(maxFramesInFlight, 0);
+	frameAsyncComputeValues.assign(maxFramesInFlight, 0);
 
 
 	/* Submit semaphores need to be indexed by swapchain image idx
@@ -1012,19 +1520,9 @@ void Device::createSyncObjects() {
 	VkSemaphoreCreateInfo semaphoreInfo{};
 	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-	VkFenceCreateInfo fenceInfo{};
-	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-	fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-
-	for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+	for (uint32_t i = 0; i < maxFramesInFlight; i++) {
 
-		if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]) != VK_SUCCESS ||
-			vkCreateFence(device, &fenceInfo, nullptr, &inFlightFences[i]) != VK_SUCCESS) {
-			throw std::runtime_error("failed to create semaphores!");
-		}
-
-		if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &computeFinishedSemaphores[i]) != VK_SUCCESS ||
-			vkCreateFence(device, &fenceInfo, nullptr, &computeInFlightFences[i]) != VK_SUCCESS) {
+		if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]) != VK_SUCCESS) {
 			throw std::runtime_error("failed to create semaphores!");
 		}
 	}
@@ -1037,6 +1535,91 @@ void Device::createSyncObjects() {
 
 }
 
+void Device::createTimelines()
+{
+	VkSemaphoreTypeCreateInfo typeInfo = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+		.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+		.initialValue = 0,
+	};
+	VkSemaphoreCreateInfo semaphoreInfo = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+		.pNext = &typeInfo,
+	};
+
+	for (QueueTimeline* timeline : { &graphicsTimeline, &computeTimeline, &transferTimeline, &asyncComputeTimeline }) {
+		if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &timeline->semaphore) != VK_SUCCESS) {
+			throw std::runtime_error("failed to create timeline semaphore!");
+		}
+	}
+}
+
+uint64_t Device::getCompletedValue(const QueueTimeline& timeline)
+{
+	uint64_t value = 0;
+	vkGetSemaphoreCounterValue(device, timeline.semaphore, &value);
+	return value;
+}
+
+void Device::waitTimeline(const QueueTimeline& timeline, uint64_t value)
+{
+	VkSemaphoreWaitInfo waitInfo = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+		.semaphoreCount = 1,
+		.pSemaphores = &timeline.semaphore,
+		.pValues = &value,
+	};
+	vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+}
+
+void Device::createTimestampPool()
+{
+	if (timestampPeriod == 0.0f)
+		return;
+
+	VkQueryPoolCreateInfo poolInfo = {
+		.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+		.queryType = VK_QUERY_TYPE_TIMESTAMP,
+		.queryCount = TimestampsPerFrame * maxFramesInFlight,
+	};
+
+	if (vkCreateQueryPool(device, &poolInfo, nullptr, &timestampPool) != VK_SUCCESS) {
+		throw std::runtime_error("failed to create timestamp query pool!");
+	}
+
+	// Queries can't be read or written before their first reset
+	vkResetQueryPool(device, timestampPool, 0, poolInfo.queryCount);
+}
+
+void Device::writeTimestamp(VkCommandBuffer commandBuffer, VkPipelineStageFlagBits stage, FrameTimestamp query)
+{
+	if (timestampPool != VK_NULL_HANDLE)
+		vkCmdWriteTimestamp(commandBuffer, stage, timestampPool, current_frame * TimestampsPerFrame + query);
+}
+
+void Device::readQueueTimings()
+{
+	if (timestampPool == VK_NULL_HANDLE)
+		return;
+
+	// Value and availability of each query, the ones that weren't written this time stay unavailable
+	uint64_t results[TimestampsPerFrame][2] = {};
+	const uint32_t first = current_frame * TimestampsPerFrame;
+	vkGetQueryPoolResults(device, timestampPool, first, TimestampsPerFrame, sizeof(results), results, sizeof(results[0]),
+		VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+	vkResetQueryPool(device, timestampPool, first, TimestampsPerFrame);
+
+	auto elapsedMs = [&](FrameTimestamp begin, FrameTimestamp end) -> std::optional<float> {
+		if (!results[begin][1] || !results[end][1] || results[end][0] < results[begin][0])
+			return std::nullopt;
+		return (float)(results[end][0] - results[begin][0]) * timestampPeriod / 1e6f;
+	};
+
+	// Skipped frames have no graphics timings, the last ones are kept
+	lastQueueTimings.graphicsMs = elapsedMs(GraphicsBegin, GraphicsEnd).value_or(lastQueueTimings.graphicsMs);
+	lastQueueTimings.asyncComputeMs = elapsedMs(AsyncComputeBegin, AsyncComputeEnd).value_or(0.0f);
+}
+
 void Device::recreateSwapChain() {
 
 	int width = 0, height = 0;
@@ -1047,6 +1630,7 @@ void Device::recreateSwapChain() {
 	}
 
 	vkDeviceWaitIdle(device);
+	invalidateCachedCommands();
 
 	vkDestroyRenderPass(device, defaultRenderPass, nullptr);
 	createDefaultRenderPass();
@@ -1068,6 +1652,8 @@ void Device::initVulkan() {
 	createSurface();
 	pickPhysicalDevice();
 	createLogicalDevice();
+	createTimelines();
+	createTimestampPool();
 	createSwapChain();
 	createImageViews();
 	createDefaultRenderPass();
@@ -1076,7 +1662,16 @@ void Device::initVulkan() {
 	createFrameBuffers();
 	createCommandPool();
 	createUniformBuffers();
+	createStagingBuffer();
+	createGeometryHeap();
+	createBindlessTable();
+	createPipelineCache();
+	// Leave a core to the main thread, it keeps recording while pipelines compile
+	pipelineWorkers.init(std::max(std::thread::hardware_concurrency(), 2u) - 1);
+	// Same, the main thread records its own share of the split passes
+	recordWorkers.init(std::max(std::thread::hardware_concurrency(), 2u) - 1);
 	createCommandBuffer();
+	createSecondaryCommandPools();
 	createSyncObjects();
 }
 
@@ -1121,12 +1716,12 @@ void Device::initImGui(){
 	init_info.Device = device;
 	init_info.QueueFamily = indices.graphicsFamily.value();
 	init_info.Queue = graphicsQueue;
-	init_info.PipelineCache = VK_NULL_HANDLE;
+	init_info.PipelineCache = pipelineCache;
 	init_info.DescriptorPool = imgui_descriptorPool;
 	init_info.RenderPass = defaultRenderPass;
 	init_info.Subpass = 0;
 	init_info.MinImageCount = 2;
-	init_info.ImageCount = 2;
+	init_info.ImageCount = std::max(2u, maxFramesInFlight); // ImGui rotates its vertex buffers on it
 	init_info.MSAASamples = getMsaaSamples();
 	init_info.Allocator = nullptr;
 	init_info.CheckVkResultFn = check_vk_result;
@@ -1154,12 +1749,12 @@ void Device::refreshImGui()
 	init_info.Device = device;
 	init_info.QueueFamily = indices.graphicsFamily.value();
 	init_info.Queue = graphicsQueue;
-	init_info.PipelineCache = VK_NULL_HANDLE;
+	init_info.PipelineCache = pipelineCache;
 	init_info.DescriptorPool = imgui_descriptorPool;
 	init_info.RenderPass = defaultRenderPass;
 	init_info.Subpass = 0;
 	init_info.MinImageCount = 2;
-	init_info.ImageCount = 2;
+	init_info.ImageCount = std::max(2u, maxFramesInFlight);
 	init_info.MSAASamples = getMsaaSamples();
 	init_info.Allocator = nullptr;
 	init_info.CheckVkResultFn = check_vk_result;
@@ -1185,9 +1780,33 @@ void Device::newImGuiFrame(){
 
 void Device::beginDraw()
 {
-	vkWaitForFences(device, 1, &inFlightFences[current_frame], VK_TRUE, UINT64_MAX);
+	processUploads();
+
+	// Every command buffer of this slot gets recorded again, graphics usually implies compute as it waited on it
+	auto waitStart = std::chrono::steady_clock::now();
+	const VkSemaphore frameSemaphores[] = { graphicsTimeline.semaphore, computeTimeline.semaphore, asyncComputeTimeline.semaphore };
+	const uint64_t frameValues[] = { frameGraphicsValues[current_frame], frameComputeValues[current_frame], frameAsyncComputeValues[current_frame] };
+	VkSemaphoreWaitInfo waitInfo = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+		.semaphoreCount = 3,
+		.pSemaphores = frameSemaphores,
+		.pValues = frameValues,
+	};
+	vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+	auto waitEnd = std::chrono::steady_clock::now();
+	framePacing.frameWaitMs = std::chrono::duration<float, std::milli>(waitEnd - waitStart).count();
+	readQueueTimings();
+	descriptorCache.nextFrame();
 
+	// Secondaries of this frame slot are done executing, their buffers get recorded again from scratch
+	for (auto& pool : secondaryPools[current_frame]) {
+		vkResetCommandPool(device, pool.pool, 0);
+		pool.used = 0;
+	}
+
+	auto acquireStart = std::chrono::steady_clock::now();
 	VkResult res = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, imageAvailableSemaphores[current_frame], VK_NULL_HANDLE, &current_framebuffer_idx);
+	framePacing.acquireMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - acquireStart).count();
 
 	switch (res) {
 	case VK_ERROR_OUT_OF_DATE_KHR:
@@ -1202,8 +1821,8 @@ void Device::beginDraw()
 	}
 
 
-	//We reset the fence only if we actually will submit work
-	vkResetFences(device, 1, &inFlightFences[current_frame]);
+	swapChainImageLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
 	vkResetCommandBuffer(commandBuffers[current_frame], 0);
 
 
@@ -1216,6 +1835,8 @@ void Device::beginDraw()
 	if (vkBeginCommandBuffer(commandBuffers[current_frame], &beginInfo) != VK_SUCCESS) {
 		throw std::runtime_error("failed to begin recording command buffer!");
 	}
+	graphicsState.reset(commandBuffers[current_frame]);
+	writeTimestamp(commandBuffers[current_frame], VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, GraphicsBegin);
 	//These are define dynamic in the pipeline so we have to set them
 	VkViewport viewport{};
 	viewport.x = 0.0f;
@@ -1238,6 +1859,15 @@ void Device::beginDraw()
 
 void Device::endDraw()
 {
+	addStateStats(graphicsState.takeStats());
+	addStateStats(computeState.takeStats());
+	lastFrameStateStats = frameStateStats;
+	frameStateStats = {};
+	lastFramePassCacheStats = framePassCacheStats;
+	framePassCacheStats = {};
+
+	// If no render pass did it already
+	flushAsyncCompute();
 
 	if (hasRecorededCompute)
 	{
@@ -1247,25 +1877,43 @@ void Device::endDraw()
 		}
 
 
+		// Signaled even when the frame is skipped, the next use of the slot waits on it
+		const uint64_t signalValue = ++computeTimeline.lastSignaled;
+		VkTimelineSemaphoreSubmitInfo timelineInfo = {
+			.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+			.signalSemaphoreValueCount = 1,
+			.pSignalSemaphoreValues = &signalValue,
+		};
+
 		VkSubmitInfo submitInfo{};
 		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submitInfo.pNext = &timelineInfo;
 		submitInfo.commandBufferCount = 1;
 		submitInfo.pCommandBuffers = &computeCommandBuffer;
 		submitInfo.signalSemaphoreCount = 1;
-		submitInfo.pSignalSemaphores = &computeFinishedSemaphores[current_frame];
+		submitInfo.pSignalSemaphores = &computeTimeline.semaphore;
 
 
-		if (vkQueueSubmit(computeQueue, 1, &submitInfo, computeInFlightFences[current_frame]) != VK_SUCCESS) {
+		if (vkQueueSubmit(computeQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
 			throw std::runtime_error("failed to submit compute command buffer!");
 		};
+		frameComputeValues[current_frame] = signalValue;
 	}
 
 	if (skipDraw)
 	{
 		skipDraw = false;
+		hasRecorededCompute = false;
+		hasRecordedAsyncCompute = false;
+		asyncComputeSubmitted = false;
+		pendingGraphicsAcquires.clear();
 		return;
 	}
 
+	if (dynamicRendering)
+		transitionSwapChainForPresent(commandBuffers[current_frame]);
+	writeTimestamp(commandBuffers[current_frame], VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, GraphicsEnd);
+
 	if (vkEndCommandBuffer(commandBuffers[current_frame]) != VK_SUCCESS) {
 		throw std::runtime_error("failed to record command buffer!");
 	}
@@ -1275,30 +1923,58 @@ void Device::endDraw()
 	VkSubmitInfo submitInfo{};
 	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-	VkSemaphore waitSemaphores[] = { imageAvailableSemaphores[current_frame], computeFinishedSemaphores[current_frame] };
-	VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT };
-	submitInfo.waitSemaphoreCount = hasRecorededCompute? 2 : 1;
+	VkSemaphore waitSemaphores[3] = { imageAvailableSemaphores[current_frame] };
+	// Binary semaphores ignore their value
+	uint64_t waitValues[3] = { 0 };
+	VkPipelineStageFlags waitStages[3] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
+	uint32_t waitCount = 1;
+	// Compute also writes indirect draws, read before any vertex. The async acquires are chained to the same stages
+	if (hasRecorededCompute) {
+		waitSemaphores[waitCount] = computeTimeline.semaphore;
+		waitValues[waitCount] = frameComputeValues[current_frame];
+		waitStages[waitCount++] = VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+	}
+	if (hasRecordedAsyncCompute) {
+		waitSemaphores[waitCount] = asyncComputeTimeline.semaphore;
+		waitValues[waitCount] = frameAsyncComputeValues[current_frame];
+		waitStages[waitCount++] = VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+	}
+	submitInfo.waitSemaphoreCount = waitCount;
 	submitInfo.pWaitSemaphores = waitSemaphores;
 	submitInfo.pWaitDstStageMask = waitStages;
 
 	submitInfo.commandBufferCount = 1;
 	submitInfo.pCommandBuffers = &commandBuffers[current_frame];
 
-	VkSemaphore signalSemaphores[] = { renderFinishedSemaphores[current_framebuffer_idx] };
-	submitInfo.signalSemaphoreCount = 1;
+	// The binary one is for the present
+	VkSemaphore signalSemaphores[] = { renderFinishedSemaphores[current_framebuffer_idx], graphicsTimeline.semaphore };
+	const uint64_t signalValues[] = { 0, ++graphicsTimeline.lastSignaled };
+	submitInfo.signalSemaphoreCount = 2;
 	submitInfo.pSignalSemaphores = signalSemaphores;
 
-	if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[current_frame]) != VK_SUCCESS) {
+	VkTimelineSemaphoreSubmitInfo timelineInfo = {
+		.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+		.waitSemaphoreValueCount = submitInfo.waitSemaphoreCount,
+		.pWaitSemaphoreValues = waitValues,
+		.signalSemaphoreValueCount = 2,
+		.pSignalSemaphoreValues = signalValues,
+	};
+	submitInfo.pNext = &timelineInfo;
+
+	if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
 		throw std::runtime_error("failed to submit draw command buffer!");
 	}
+	frameGraphicsValues[current_frame] = signalValues[1];
 
 	hasRecorededCompute = false;
+	hasRecordedAsyncCompute = false;
+	asyncComputeSubmitted = false;
 
 	VkPresentInfoKHR presentInfo{};
 	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
 
 	presentInfo.waitSemaphoreCount = 1;
-	presentInfo.pWaitSemaphores = signalSemaphores;
+	presentInfo.pWaitSemaphores = &signalSemaphores[0];
 
 	VkSwapchainKHR swapChains[] = { swapChain };
 	presentInfo.swapchainCount = 1;
@@ -1306,6 +1982,17 @@ void Device::endDraw()
 	presentInfo.pImageIndices = &current_framebuffer_idx;
 	VkResult result = vkQueuePresentKHR(presentQueue, &presentInfo);
 
+	// Skipped frames don't present and aren't counted, their time ends up in the next interval
+	auto presentTime = std::chrono::steady_clock::now();
+	if (hasPresented)
+		framePacing.presentIntervalMs = std::chrono::duration<float, std::milli>(presentTime - lastPresentTime).count();
+	lastPresentTime = presentTime;
+	hasPresented = true;
+	framePacingHistory[framePacingIndex] = framePacing;
+	framePacingIndex = (framePacingIndex + 1) % FramePacingHistorySize;
+	framePacingCount = std::min(framePacingCount + 1, FramePacingHistorySize);
+	framePacing = {};
+
 	if(nextUsesMsaa.has_value()) {
 		usesMsaa = nextUsesMsaa.value();
 		nextUsesMsaa.reset();
@@ -1319,17 +2006,123 @@ void Device::endDraw()
 		throw std::runtime_error("failed to present swap chain image!");
 	}
 
-	current_frame = (current_frame + 1) % MAX_FRAMES_IN_FLIGHT;
+	current_frame = (current_frame + 1) % maxFramesInFlight;
 
 }
 
+void Device::flushAsyncCompute()
+{
+	submitAsyncCompute();
+
+	if (skipDraw || pendingGraphicsAcquires.empty())
+		return;
+
+	// The graphics submit waits on the async timeline at DRAW_INDIRECT, first stage of anything reading these
+	vkCmdPipelineBarrier(commandBuffers[current_frame], VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+		VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_GEOMETRY_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+		0, 0, nullptr, (uint32_t)pendingGraphicsAcquires.size(), pendingGraphicsAcquires.data(), 0, nullptr);
+	pendingGraphicsAcquires.clear();
+}
+
+void Device::submitAsyncCompute()
+{
+	if (!hasRecordedAsyncCompute || asyncComputeSubmitted)
+		return;
+
+	VkCommandBuffer commandBuffer = asyncComputeCommandBuffers[current_frame];
+	writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, AsyncComputeEnd);
+	if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+		throw std::runtime_error("failed to record async compute command buffer!");
+	}
+
+	// Only the buffers of this slot are written, the graphics queue has to be done reading them from its last use.
+	// Everything else it reads was written by the CPU for this frame
+	const uint64_t waitValue = frameGraphicsValues[current_frame];
+	const VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+	// Signaled even when the frame is skipped, the next use of the slot waits on it
+	const uint64_t signalValue = ++asyncComputeTimeline.lastSignaled;
+	VkTimelineSemaphoreSubmitInfo timelineInfo = {
+		.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+		.waitSemaphoreValueCount = 1,
+		.pWaitSemaphoreValues = &waitValue,
+		.signalSemaphoreValueCount = 1,
+		.pSignalSemaphoreValues = &signalValue,
+	};
+
+	VkSubmitInfo submitInfo{};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.pNext = &timelineInfo;
+	submitInfo.waitSemaphoreCount = 1;
+	submitInfo.pWaitSemaphores = &graphicsTimeline.semaphore;
+	submitInfo.pWaitDstStageMask = &waitStage;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &commandBuffer;
+	submitInfo.signalSemaphoreCount = 1;
+	submitInfo.pSignalSemaphores = &asyncComputeTimeline.semaphore;
+
+	if (vkQueueSubmit(asyncComputeQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+		throw std::runtime_error("failed to submit async compute command buffer!");
+	}
+	frameAsyncComputeValues[current_frame] = signalValue;
+	asyncComputeSubmitted = true;
+}
+
 void Device::dispatchCommand(uint32_t count_x, uint32_t count_y, uint32_t count_z)
 {
-	VkCommandBuffer commandBuffer = computeCommandBuffers[current_frame];
+	VkCommandBuffer commandBuffer = computeState.getCommandBuffer();
 
 	vkCmdDispatch(commandBuffer, count_x, count_y, count_z);
 }
 
+void Device::clearIndirectDrawCount(const IndirectDrawBuffer& draws)
+{
+	VkCommandBuffer commandBuffer = computeState.getCommandBuffer();
+	VkBuffer buffer = draws.commands[current_frame].buffer;
+
+	vkCmdFillBuffer(commandBuffer, buffer, 0, sizeof(uint32_t), 0);
+
+	VkBufferMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.buffer = buffer,
+		.offset = 0,
+		.size = sizeof(uint32_t),
+	};
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+void Device::releaseToGraphics(const Buffer& buffer)
+{
+	// Nothing to hand over on a single queue, or when the pass went on the in order command buffer
+	VkCommandBuffer commandBuffer = computeState.getCommandBuffer();
+	if (!asyncCompute || commandBuffer != asyncComputeCommandBuffers[current_frame])
+		return;
+
+	VkBufferMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT,
+		.srcQueueFamilyIndex = computeQueueFamily,
+		.dstQueueFamilyIndex = graphicsQueueFamily,
+		.buffer = buffer.buffer,
+		.offset = 0,
+		.size = VK_WHOLE_SIZE,
+	};
+
+	// dst access is ignored for the release and src access for the acquire.
+	// Nothing goes back, the next pass writing it again doesn't care about what was there
+	VkBufferMemoryBarrier release = barrier;
+	release.dstAccessMask = 0;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 1, &release, 0, nullptr);
+
+	VkBufferMemoryBarrier acquire = barrier;
+	acquire.srcAccessMask = 0;
+	pendingGraphicsAcquires.push_back(acquire);
+}
+
 void Device::waitIdle()
 {
 	vkDeviceWaitIdle(device);
@@ -1352,14 +2145,18 @@ void Device::cleanupSwapChain() {
 
 void Device::cleanupVulkan() {
 
+	waitUpload({ lastUploadBatch });
+
 	cleanupSwapChain();
 
-	for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-		vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
-		vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
-		vkDestroySemaphore(device, computeFinishedSemaphores[i], nullptr);
-		vkDestroyFence(device, inFlightFences[i], nullptr);
-		vkDestroyFence(device, computeInFlightFences[i], nullptr);
+	for (VkSemaphore semaphore : imageAvailableSemaphores) {
+		vkDestroySemaphore(device, semaphore, nullptr);
+	}
+	for (VkSemaphore semaphore : renderFinishedSemaphores) {
+		vkDestroySemaphore(device, semaphore, nullptr);
+	}
+	for (QueueTimeline* timeline : { &graphicsTimeline, &computeTimeline, &transferTimeline, &asyncComputeTimeline }) {
+		vkDestroySemaphore(device, timeline->semaphore, nullptr);
 	}
 
 	if (enableValidationLayers) {
@@ -1367,18 +2164,38 @@ void Device::cleanupVulkan() {
 	}
 
 
-	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-		vkDestroyBuffer(device, uniformBuffers[i].buffer, nullptr);
-		vkFreeMemory(device, uniformBuffers[i].memory, nullptr);
-
-		vkDestroyBuffer(device, computeUniformBuffers[i].buffer, nullptr);
-		vkFreeMemory(device, computeUniformBuffers[i].memory, nullptr);
+	for (size_t i = 0; i < maxFramesInFlight; i++) {
+		destroyBuffer(uniformBuffers[i]);
+		destroyBuffer(computeUniformBuffers[i]);
 	}
 
+	destroyBuffer(stagingBuffer);
+	destroyBuffer(geometryVertexBuffer);
+	destroyBuffer(geometryIndexBuffer);
+	vkDestroyDescriptorPool(device, bindlessPool, nullptr);
+	vkDestroyDescriptorSetLayout(device, bindlessSetLayout, nullptr);
+
 	vkDestroyCommandPool(device, commandPool, nullptr);
+	vkDestroyCommandPool(device, transferCommandPool, nullptr);
+	vkDestroyCommandPool(device, asyncComputeCommandPool, nullptr);
+	vkDestroyQueryPool(device, timestampPool, nullptr);
+	recordWorkers.cleanup();
+	for (auto& framePools : secondaryPools) {
+		for (auto& pool : framePools)
+			vkDestroyCommandPool(device, pool.pool, nullptr);
+	}
+	vkDestroyCommandPool(device, cachedCommandPool, nullptr);
 
 	vkDestroyRenderPass(device, defaultRenderPass, nullptr);
 
+	pipelineWorkers.cleanup();
+	savePipelineCache();
+	vkDestroyPipelineCache(device, pipelineCache, nullptr);
+
+	descriptorCache.cleanup();
+	shaderCache.cleanup();
+	allocator.cleanup();
+
 	vkDestroySurfaceKHR(instance, surface, nullptr);
 	vkDestroyDevice(device, nullptr);
 	vkDestroyInstance(instance, nullptr);
@@ -1392,28 +2209,23 @@ Buffer Device::createLocalBuffer(size_t size, VkBufferUsageFlags usage, void* sr
 	createBuffer(size,
 		VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage,
 		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, //Important high speed memory
-		ret_buffer.buffer, ret_buffer.memory);
+		ret_buffer);
 
 	ret_buffer.mapped_memory = nullptr;
+	ret_buffer.size = size;
 
 
 	if(src_data) {
-		VkBuffer stagingBuffer;
-		VkDeviceMemory stagingMemory;
-		createBuffer(size,
-			VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-			stagingBuffer, stagingMemory);
-
-		void* data;
-		vkMapMemory(device, stagingMemory, 0, size, 0, &data);
-		memcpy(data, src_data, size);
-		vkUnmapMemory(device, stagingMemory);
+		const bool ownsBatch = !isRecordingUpload();
+		if (ownsBatch)
+			setupCommandBuffer();
 
+		uploadBuffer(ret_buffer.buffer, 0, src_data, size);
+		transferBufferOwnership(ret_buffer.buffer);
+		ret_buffer.upload = { currentUpload.id };
 
-		copyBuffer(stagingBuffer, ret_buffer.buffer, size);
-		vkDestroyBuffer(device, stagingBuffer, nullptr);
-		vkFreeMemory(device, stagingMemory, nullptr);
+		if (ownsBatch)
+			flushCommandBuffer();
 	}
 
 
@@ -1442,8 +2254,18 @@ Buffer Device::createIndexBuffer(size_t size,void* src_data) {
 
 Buffer Device::createUniformBuffer(size_t size, void* src_data) {
 	Buffer ret_buffer;
-	createBuffer(size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, ret_buffer.buffer, ret_buffer.memory);
-	vkMapMemory(device, ret_buffer.memory, 0, size, 0, &ret_buffer.mapped_memory);
+	createBuffer(size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, ret_buffer);
+	ret_buffer.size = size;
+
+	if (src_data)
+		memcpy(ret_buffer.mapped_memory, src_data, size);
+
+	return ret_buffer;
+}
+
+Buffer Device::createStorageBuffer(size_t size, void* src_data) {
+	Buffer ret_buffer;
+	createBuffer(size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, ret_buffer);
 	ret_buffer.size = size;
 
 	if (src_data)
@@ -1453,17 +2275,188 @@ Buffer Device::createUniformBuffer(size_t size, void* src_data) {
 }
 
 void Device::destroyBuffer(Buffer& buffer) {
+	waitUpload(buffer.upload);
 	vkDestroyBuffer(device, buffer.buffer, nullptr);
-	vkFreeMemory(device, buffer.memory, nullptr);
+	allocator.free(buffer.allocation);
 
 	buffer.buffer = VK_NULL_HANDLE;
-	buffer.memory = VK_NULL_HANDLE;
 	buffer.mapped_memory = nullptr;
 }
 
+IndirectDrawBuffer Device::createIndirectDrawBuffer(uint32_t capacity, uint32_t drawDataStride)
+{
+	IndirectDrawBuffer draws = {
+		.counts = std::vector<uint32_t>(maxFramesInFlight, 0),
+		.capacity = capacity,
+		.drawDataStride = drawDataStride,
+	};
+
+	const VkDeviceSize commandsSize = IndirectDrawBuffer::IndirectCommandsOffset + VkDeviceSize(capacity) * sizeof(VkDrawIndexedIndirectCommand);
+	for (uint32_t i = 0; i < maxFramesInFlight; i++)
+	{
+		Buffer commands;
+		createBuffer(commandsSize, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, commands);
+		commands.size = commandsSize;
+		memset(commands.mapped_memory, 0, commandsSize);
+		SetBufferName(commands.buffer, "Indirect Draws/Commands");
+
+		draws.commands.push_back(commands);
+		draws.drawData.push_back(createStorageBuffer(size_t(capacity) * drawDataStride));
+	}
+
+	return draws;
+}
+
+void Device::destroyIndirectDrawBuffer(IndirectDrawBuffer& draws)
+{
+	for (Buffer& buffer : draws.commands)
+		destroyBuffer(buffer);
+	for (Buffer& buffer : draws.drawData)
+		destroyBuffer(buffer);
+
+	draws = {};
+}
+
+void Device::writeIndirectDraw(IndirectDrawBuffer& draws, uint32_t index, const MeshGeometry& geometry, uint32_t firstInstance, uint32_t instanceCount)
+{
+	if (index >= draws.capacity || firstInstance + instanceCount > draws.capacity)
+		throw std::runtime_error("failed to write indirect draw : buffer is full");
+	if (geometry.indexCount == 0)
+		throw std::runtime_error("failed to write indirect draw : geometry is not indexed");
+
+	VkDrawIndexedIndirectCommand command = {
+		.indexCount = geometry.indexCount,
+		.instanceCount = instanceCount,
+		.firstIndex = geometry.firstIndex,
+		.vertexOffset = static_cast<int32_t>(geometry.vertexOffset),
+		.firstInstance = firstInstance,
+	};
+
+	uint8_t* commands = static_cast<uint8_t*>(draws.commands[current_frame].mapped_memory) + IndirectDrawBuffer::IndirectCommandsOffset;
+	memcpy(commands + size_t(index) * sizeof(VkDrawIndexedIndirectCommand), &command, sizeof(command));
+}
+
+void Device::writeIndirectDrawData(IndirectDrawBuffer& draws, uint32_t instance, const void* data)
+{
+	if (instance >= draws.capacity)
+		throw std::runtime_error("failed to write indirect draw data : buffer is full");
+
+	uint8_t* dst = static_cast<uint8_t*>(draws.drawData[current_frame].mapped_memory);
+	memcpy(dst + size_t(instance) * draws.drawDataStride, data, draws.drawDataStride);
+}
+
+IndirectDrawBuffer Device::createGpuIndirectDrawBuffer(uint32_t capacity)
+{
+	IndirectDrawBuffer draws = {
+		.capacity = capacity,
+		.gpuWritten = true,
+	};
+
+	const VkDeviceSize commandsSize = IndirectDrawBuffer::IndirectCommandsOffset + VkDeviceSize(capacity) * sizeof(VkDrawIndexedIndirectCommand);
+	for (uint32_t i = 0; i < maxFramesInFlight; i++)
+	{
+		Buffer commands = createLocalBuffer(commandsSize, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+		SetBufferName(commands.buffer, "Indirect Draws/GPU Commands");
+		draws.commands.push_back(commands);
+	}
+
+	return draws;
+}
+
+void Device::setIndirectDrawCount(IndirectDrawBuffer& draws, uint32_t count)
+{
+	memcpy(draws.commands[current_frame].mapped_memory, &count, sizeof(uint32_t));
+
+	// Without the count in the buffer it is part of the recorded commands, and without indirect draws so are the commands themselves
+	if (!usesIndirectDrawCount() && (count != draws.counts[current_frame] || !indirectDraws))
+		invalidateCachedCommands();
+
+	draws.counts[current_frame] = count;
+}
+
+static_assert(sizeof(Vertex) == sizeof(MeshVertex), "Vertex and MeshVertex must share the geometry heap layout");
+
+MeshGeometry Device::createMeshGeometry(const void* vertices, size_t vertexCount, const uint32_t* indices, size_t indexCount)
+{
+	constexpr VkDeviceSize vertexStride = sizeof(MeshVertex);
+	const VkDeviceSize vertexSize = vertexCount * vertexStride;
+	const VkDeviceSize indexSize = indexCount * sizeof(uint32_t);
+
+	// Aligned on the stride so the offset is a whole number of vertices
+	VkDeviceSize vertexOffset = vertexHeap.allocate(vertexSize, vertexStride);
+	VkDeviceSize indexOffset = indexCount > 0 ? indexHeap.allocate(indexSize, sizeof(uint32_t)) : 0;
+
+	if (vertexOffset == RangeAllocator::InvalidOffset || indexOffset == RangeAllocator::InvalidOffset) {
+		if (vertexOffset != RangeAllocator::InvalidOffset)
+			vertexHeap.free(vertexOffset, vertexSize);
+
+		throw std::runtime_error("failed to allocate mesh geometry : geometry heap is full");
+	}
+
+	MeshGeometry geometry = {
+		.vertexOffset = static_cast<uint32_t>(vertexOffset / vertexStride),
+		.vertexCount = static_cast<uint32_t>(vertexCount),
+		.firstIndex = static_cast<uint32_t>(indexOffset / sizeof(uint32_t)),
+		.indexCount = static_cast<uint32_t>(indexCount),
+	};
+
+	// Sphere around the bounding box, loose but enough for culling
+	const MeshVertex* meshVertices = static_cast<const MeshVertex*>(vertices);
+	auto position = [&](size_t i) { return glm::vec3(meshVertices[i].pos[0], meshVertices[i].pos[1], meshVertices[i].pos[2]); };
+	glm::vec3 boundsMin(std::numeric_limits<float>::max()), boundsMax(std::numeric_limits<float>::lowest());
+	for (size_t i = 0; i < vertexCount; i++)
+	{
+		const glm::vec3 pos = position(i);
+		boundsMin = glm::min(boundsMin, pos);
+		boundsMax = glm::max(boundsMax, pos);
+	}
+	if (vertexCount > 0)
+	{
+		const glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+		float radius = 0.0f;
+		for (size_t i = 0; i < vertexCount; i++)
+			radius = std::max(radius, glm::length(position(i) - center));
+
+		memcpy(geometry.boundingSphere, &center[0], 3 * sizeof(float));
+		geometry.boundingSphere[3] = radius;
+	}
+
+	const bool ownsBatch = !isRecordingUpload();
+	if (ownsBatch)
+		setupCommandBuffer();
+
+	uploadBuffer(geometryVertexBuffer.buffer, vertexOffset, vertices, vertexSize);
+	transferBufferOwnership(geometryVertexBuffer.buffer, vertexOffset, vertexSize);
+
+	if (indexCount > 0) {
+		uploadBuffer(geometryIndexBuffer.buffer, indexOffset, indices, indexSize);
+		transferBufferOwnership(geometryIndexBuffer.buffer, indexOffset, indexSize);
+	}
+
+	geometry.upload = { currentUpload.id };
+
+	if (ownsBatch)
+		flushCommandBuffer();
+
+	return geometry;
+}
+
+void Device::destroyMeshGeometry(MeshGeometry& geometry)
+{
+	waitUpload(geometry.upload);
+
+	vertexHeap.free(VkDeviceSize(geometry.vertexOffset) * sizeof(MeshVertex), VkDeviceSize(geometry.vertexCount) * sizeof(MeshVertex));
+	if (geometry.indexCount > 0)
+		indexHeap.free(VkDeviceSize(geometry.firstIndex) * sizeof(uint32_t), VkDeviceSize(geometry.indexCount) * sizeof(uint32_t));
+
+	geometry = {};
+}
+
 void Device::destroyImage(GpuImage image) {
+	waitUpload(image.upload);
+	unregisterTexture(image);
 	vkDestroyImage(device, image.image, nullptr);
-	vkFreeMemory(device, image.memory, nullptr);
+	allocator.free(image.allocation);
 	vkDestroyImageView(device, image.view, nullptr);
 
 	for (auto& writeView : image.writeViews)
@@ -1548,7 +2541,7 @@ void Device::generateMipmaps(VkImage image, VkFormat format, int32_t texWidth, i
 		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
 
 		vkCmdPipelineBarrier(commandBuffer,
-			VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+			VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
 			0, nullptr,
 			0, nullptr,
 			1, &barrier);
@@ -1566,7 +2559,7 @@ void Device::generateMipmaps(VkImage image, VkFormat format, int32_t texWidth, i
 	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
 
 	vkCmdPipelineBarrier(commandBuffer,
-		VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
 		0, nullptr,
 		0, nullptr,
 		1, &barrier);
@@ -1634,13 +2627,6 @@ VkFormat getFormat(const ImageFormat format)
 GpuImage Device::createTexture(Texture tex) 
 {
 	GpuImage ret_image;
-	Buffer stagingBuffer;
-	createBuffer(tex.size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer.buffer, stagingBuffer.memory);
-
-	void* data;
-	vkMapMemory(device, stagingBuffer.memory, 0, tex.size, 0, &data);
-	memcpy(data, tex.getRawPixels(),  static_cast<size_t>(tex.size));
-	vkUnmapMemory(device, stagingBuffer.memory);
 
 	uint32_t mipLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(tex.width, tex.height)))) + 1;
 	VkFormat format = getFormat(tex);
@@ -1660,20 +2646,26 @@ GpuImage Device::createTexture(Texture tex)
 	createImage(desc, ret_image);
 
 	uint32_t layer_count = tex.is_cubemap ? 6 : 1;
-	size_t layer_size = tex.width * tex.height * tex.channels;
+	size_t layer_size = tex.size / layer_count;
+
+	const bool ownsBatch = !isRecordingUpload();
+	if (ownsBatch)
+		setupCommandBuffer();
 
-	setupCommandBuffer();
-	//Transition to enable copying, copying and transition to pixel shader usable
-	transitionImageLayout(ret_image.image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels, layer_count);
-	copyBufferToImage(stagingBuffer.buffer, ret_image.image, static_cast<uint32_t>(tex.width), static_cast<uint32_t>(tex.height), layer_size, layer_count);
-	if (mipLevels > 1)
+	//Transition and copy on the transfer queue, then the graphics queue takes it for the mips and transition to pixel shader usable
+	transitionImageLayout(ret_image.image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels, layer_count, currentUpload.transferCmd);
+	uploadImage(ret_image.image, tex.getRawPixels(), tex.width, tex.height, layer_size, layer_count);
+	if (mipLevels > 1) {
+		transferImageOwnership(ret_image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, mipLevels, layer_count);
 		generateMipmaps(ret_image.image, VK_FORMAT_R8G8B8A8_SRGB, tex.width, tex.height, mipLevels, layer_count);
-	else 
-		transitionImageLayout(ret_image.image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, mipLevels, layer_count);
+	}
+	else {
+		transferImageOwnership(ret_image.image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, mipLevels, layer_count);
+	}
+	ret_image.upload = { currentUpload.id };
 
-	flushCommandBuffer();
-	
-	destroyBuffer(stagingBuffer);
+	if (ownsBatch)
+		flushCommandBuffer();
 
 	ret_image.view = createImageView(ret_image.image, desc.format, VK_IMAGE_ASPECT_COLOR_BIT, 0, mipLevels, tex.is_cubemap);
 	ret_image.format = getFormat(format);
@@ -1867,11 +2859,11 @@ void Device::createDepthBufferResources() {
 }
 
 
-VkCommandBuffer Device::beginSingleTimeCommands() {
+VkCommandBuffer Device::beginSingleTimeCommands(VkCommandPool pool) {
 	VkCommandBufferAllocateInfo allocInfo{};
 	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
 	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	allocInfo.commandPool = commandPool;
+	allocInfo.commandPool = pool;
 	allocInfo.commandBufferCount = 1;
 
 
@@ -1887,34 +2879,167 @@ VkCommandBuffer Device::beginSingleTimeCommands() {
 	return commandBuffer;
 }
 
-void Device::endSingleTimeCommands(VkCommandBuffer commandBuffer) {
-	vkEndCommandBuffer(commandBuffer);
+void Device::setupCommandBuffer()
+{
+	currentUpload.id = ++lastUploadBatch;
+	currentUpload.graphicsCmd = beginSingleTimeCommands(commandPool);
+	currentUpload.transferCmd = hasDedicatedTransferQueue() ? beginSingleTimeCommands(transferCommandPool) : currentUpload.graphicsCmd;
+}
+
+UploadToken Device::flushCommandBuffer()
+{
+	UploadBatch& batch = pendingUploads.emplace_back(std::exchange(currentUpload, {}));
+
+	// Whatever was staged since the last flush belongs to this batch now
+	stagingRing.submit(batch.id);
+
+	if (hasDedicatedTransferQueue()) {
+		batch.transferValue = ++transferTimeline.lastSignaled;
+
+		vkEndCommandBuffer(batch.transferCmd);
+
+		VkTimelineSemaphoreSubmitInfo timelineInfo = {
+			.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+			.signalSemaphoreValueCount = 1,
+			.pSignalSemaphoreValues = &batch.transferValue,
+		};
+
+		VkSubmitInfo submitInfo{};
+		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submitInfo.pNext = &timelineInfo;
+		submitInfo.commandBufferCount = 1;
+		submitInfo.pCommandBuffers = &batch.transferCmd;
+		submitInfo.signalSemaphoreCount = 1;
+		submitInfo.pSignalSemaphores = &transferTimeline.semaphore;
+
+		if (vkQueueSubmit(transferQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+			throw std::runtime_error("failed to submit transfer command buffer!");
+		}
+
+		// The graphics part goes once the copies are done, see processUploads
+	}
+	else {
+		submitGraphicsUpload(batch);
+	}
+
+	return { batch.id };
+}
+
+void Device::submitGraphicsUpload(UploadBatch& batch)
+{
+	vkEndCommandBuffer(batch.graphicsCmd);
+
+	// The acquire barriers must not run before the release ones
+	const VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+	batch.graphicsValue = ++graphicsTimeline.lastSignaled;
+
+	VkTimelineSemaphoreSubmitInfo timelineInfo = {
+		.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+		.waitSemaphoreValueCount = batch.transferValue != 0 ? 1u : 0u,
+		.pWaitSemaphoreValues = &batch.transferValue,
+		.signalSemaphoreValueCount = 1,
+		.pSignalSemaphoreValues = &batch.graphicsValue,
+	};
 
 	VkSubmitInfo submitInfo{};
 	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.pNext = &timelineInfo;
+	submitInfo.waitSemaphoreCount = timelineInfo.waitSemaphoreValueCount;
+	submitInfo.pWaitSemaphores = &transferTimeline.semaphore;
+	submitInfo.pWaitDstStageMask = &waitStage;
 	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &commandBuffer;
+	submitInfo.pCommandBuffers = &batch.graphicsCmd;
+	submitInfo.signalSemaphoreCount = 1;
+	submitInfo.pSignalSemaphores = &graphicsTimeline.semaphore;
 
-	vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-	vkQueueWaitIdle(graphicsQueue);
+	if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+		throw std::runtime_error("failed to submit upload command buffer!");
+	}
 
-	vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+	batch.graphicsSubmitted = true;
 }
 
-void Device::setupCommandBuffer()
+// The front batch must be done
+void Device::retireUpload()
+{
+	UploadBatch& batch = pendingUploads.front();
+
+	completedUploadBatch = batch.id;
+	stagingRing.release(completedUploadBatch);
+
+	vkFreeCommandBuffers(device, commandPool, 1, &batch.graphicsCmd);
+	if (batch.transferCmd != batch.graphicsCmd) {
+		vkFreeCommandBuffers(device, transferCommandPool, 1, &batch.transferCmd);
+	}
+
+	pendingUploads.pop_front();
+}
+
+// Called every frame, never blocks
+void Device::processUploads()
 {
-	tmpCommandBuffer = beginSingleTimeCommands();
+	if (pendingUploads.empty())
+		return;
+
+	// If we submitted the graphics part right away its acquire barriers would hold back every frame behind it until the copies are done
+	const uint64_t transferDone = getCompletedValue(transferTimeline);
+	for (UploadBatch& batch : pendingUploads) {
+		if (batch.graphicsSubmitted)
+			continue;
+
+		if (batch.transferValue > transferDone)
+			break;
+
+		submitGraphicsUpload(batch);
+	}
+
+	const uint64_t graphicsDone = getCompletedValue(graphicsTimeline);
+	while (!pendingUploads.empty() && pendingUploads.front().graphicsSubmitted && pendingUploads.front().graphicsValue <= graphicsDone) {
+		retireUpload();
+	}
 }
 
-void Device::flushCommandBuffer()
+void Device::beginUploadBatch()
 {
-	endSingleTimeCommands(tmpCommandBuffer);
-	tmpCommandBuffer = VK_NULL_HANDLE;
+	if (uploadBatchDepth++ == 0 && !isRecordingUpload())
+		setupCommandBuffer();
+}
+
+UploadToken Device::endUploadBatch()
+{
+	if (--uploadBatchDepth == 0)
+		return flushCommandBuffer();
+
+	// The outer scope will submit it
+	return { currentUpload.id };
+}
+
+void Device::waitUpload(UploadToken token)
+{
+	if (isUploadComplete(token))
+		return;
+
+	// Still being recorded, submit it and keep recording in a new batch for whoever opened it
+	if (isRecordingUpload() && token.batch >= currentUpload.id) {
+		flushCommandBuffer();
+		setupCommandBuffer();
+	}
+
+	while (!isUploadComplete(token) && !pendingUploads.empty()) {
+		UploadBatch& batch = pendingUploads.front();
+		if (!batch.graphicsSubmitted) {
+			waitTimeline(transferTimeline, batch.transferValue);
+			submitGraphicsUpload(batch);
+		}
+
+		waitTimeline(graphicsTimeline, batch.graphicsValue);
+		retireUpload();
+	}
 }
 
 inline Device::MyCommandBuffer Device::getCommandBuffer()
 {
-	return tmpCommandBuffer ? MyCommandBuffer(tmpCommandBuffer) : std::move(ScopedCommandBuffer(this));
+	return isRecordingUpload() ? MyCommandBuffer(currentUpload.graphicsCmd) : std::move(ScopedCommandBuffer(this));
 }
 
 void Device::transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t mipLevels, uint32_t layerCount, VkCommandBuffer cb) {
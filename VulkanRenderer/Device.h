@@ -15,9 +15,21 @@
 #include <array>
 #include <variant>
 #include <memory>
+#include <deque>
+#include <unordered_map>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 
 #include "Pipeline.h"
 #include "FileUtils.h"
+#include "MemoryAllocator.h"
+#include "StagingRing.h"
+#include "DescriptorCache.h"
+#include "TaskPool.h"
+#include "ShaderCache.h"
+#include "CommandStateTracker.h"
 
 
 typedef VkExtent2D Dimensions;
@@ -31,16 +43,24 @@ struct SwapChainSupportDetails {
 struct QueueFamilyIndices {
 	std::optional<uint32_t> graphicsFamily;
 	std::optional<uint32_t> presentFamily;
+	std::optional<uint32_t> transferFamily; // Same as graphics when there is no dedicated one
+	std::optional<uint32_t> computeFamily; // Compute only family, same fallback
 
 	bool isComplete() {
 		return graphicsFamily.has_value() && presentFamily.has_value();
 	}
 };
 
+// Upload batch that filled a resource, 0 means there was nothing to upload
+struct UploadToken {
+	uint64_t batch = 0;
+};
+
 struct Buffer {
 	VkBuffer buffer = VK_NULL_HANDLE;
-	VkDeviceMemory memory = VK_NULL_HANDLE;
+	MemoryAllocation allocation;
 	void* mapped_memory = nullptr;
+	UploadToken upload;
 
 	size_t size;
 	size_t count;
@@ -73,7 +93,7 @@ enum class ImageFormat {
 
 struct GpuImage {
 	VkImage image;
-	VkDeviceMemory memory;
+	MemoryAllocation allocation;
 	VkImageView view;
 	std::vector<VkImageView> writeViews;
 	ImageFormat format;
@@ -81,6 +101,8 @@ struct GpuImage {
 	uint32_t layerCount = 1;
 	uint32_t width;
 	uint32_t height;
+	UploadToken upload;
+	uint32_t bindlessIndex = UINT32_MAX; // Slot in the bindless texture table, UINT32_MAX when not registered
 };
 
 enum class FilterMode {
@@ -105,6 +127,36 @@ using GpuImageHandle = std::shared_ptr<GpuImage>;
 using Sampler = VkSampler;
 using SamplerHandle = std::shared_ptr<Sampler>;
 
+// Range of the global geometry heap, offsets are in vertices/indices so they go straight in the draw call
+struct MeshGeometry {
+	uint32_t vertexOffset = 0;
+	uint32_t vertexCount = 0;
+	uint32_t firstIndex = 0;
+	uint32_t indexCount = 0; // 0 for non indexed meshes
+	float boundingSphere[4] = {}; // Center and radius, in mesh space
+	UploadToken upload;
+	uint32_t id = 0; // Slot in the resource manager, small and unique unlike the heap offsets
+};
+
+using MeshGeometryHandle = std::shared_ptr<MeshGeometry>;
+
+/*
+* Indexed draws of the geometry heap written by the CPU and issued with a single indirect call.
+* The commands buffer starts with the draw count, commands follow at IndirectCommandsOffset.
+* Each draw covers a range of instances, shaders find their data at their instance index (firstInstance included) of drawData.
+* One of each buffer per frame in flight, only the current frame's ones are written.
+*/
+struct IndirectDrawBuffer {
+	static constexpr VkDeviceSize IndirectCommandsOffset = 16;
+
+	std::vector<Buffer> commands;
+	std::vector<Buffer> drawData;
+	std::vector<uint32_t> counts; // What was written for each frame
+	uint32_t capacity = 0; // Of both draws and instances
+	uint32_t drawDataStride = 0;
+	bool gpuWritten = false; // Commands come from a compute pass, count included, no draw data of its own
+};
+
 struct ImageBindInfo {
 	VkImageView imageview;
 	VkSampler sampl = VK_NULL_HANDLE;
@@ -113,8 +165,7 @@ struct ImageBindInfo {
 //using ImageBindInfo = std::variant<ImageSamplerBindInfo, VkImageView>;
 
 struct MeshPacket {
-	BufferHandle vertexBuffer;
-	BufferHandle indexBuffer;
+	MeshGeometryHandle geometry;
 
 	std::vector<GpuImageHandle> textures;
 	std::vector<SamplerHandle> samplers;
@@ -127,10 +178,6 @@ struct MeshPacket {
 
 	glm::mat4 transform = glm::mat4(1.0);
 
-	struct PushConstantsData {
-		glm::mat4 model;
-	};
-
 	struct ImageSamplerIndices {
 		int texIdx = -1;
 		int samplerIdx = -1;
@@ -161,6 +208,8 @@ struct MeshPacket {
 			float occlusionStrength = 1.0f;
 		} pbrFactors;
 
+		uint32_t materialIndex = UINT32_MAX; // Entry in the renderer material table, set when the packet is added
+
 		float getAlphaCutoff() const {
 			float alphaCutoff;
 			if (alphaCoverage.alphaMode == AlphaCoverage::AlphaMode::Mask)
@@ -446,6 +495,8 @@ struct Particle {
 struct UniformBufferObject {
 	glm::mat4 view;
 	glm::mat4 proj;
+	glm::vec3 eye;
+	uint32_t lightCount;
 };
 
 struct ParticleUBO {
@@ -456,6 +507,37 @@ const uint32_t PARTICLE_COUNT = 512;
 
 struct DeviceOptions {
 	bool usesMsaa;
+	size_t stagingBufferSize = 64 * 1024 * 1024; // Bigger uploads are split
+	size_t geometryVertexHeapSize = 256 * 1024 * 1024;
+	size_t geometryIndexHeapSize = 64 * 1024 * 1024;
+	uint32_t maxBindlessTextures = 4096;
+	uint32_t maxBindlessSamplers = 256;
+	std::string pipelineCachePath = "pipeline_cache.bin"; // Empty to disable
+	bool useDynamicRendering = true; // Falls back to render pass objects if the device can't
+	size_t minDrawsPerRecordThread = 128; // Passes are split across the record workers in chunks at least this big
+	bool cachePassCommands = true; // Passes created with cacheCommands reuse their recorded draws
+	bool useIndirectDraws = true; // drawIndirect falls back to one direct draw per command if off or unsupported
+	uint32_t framesInFlight = 2; // 1 to 4, more smooths out CPU spikes but adds as many frames of latency
+	bool useAsyncCompute = true; // Async compute passes stay on the graphics queue if off or without a compute only family
+};
+
+// CPU side timings of one presented frame, in ms
+struct FramePacingStats {
+	float frameWaitMs = 0.0f;		// beginDraw blocked until the frame slot's last submits are done, grows when the GPU is behind
+	float acquireMs = 0.0f;			// In vkAcquireNextImageKHR, waiting on the presentation engine
+	float presentIntervalMs = 0.0f;	// Since the previous vkQueuePresentKHR returned
+};
+
+// GPU time of each queue for the last frame the slot finished, in ms. Stays 0 without timestamp support
+struct QueueTimingStats {
+	float graphicsMs = 0.0f;		// Whole graphics command buffer, includes waiting on the compute it depends on
+	float asyncComputeMs = 0.0f;	// 0 when nothing ran on the compute only queue
+};
+
+// Cached passes executed as they were / recorded again
+struct PassCacheStats {
+	uint32_t reused = 0;
+	uint32_t recorded = 0;
 };
 
 class Device {
@@ -466,8 +548,23 @@ private:
 	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
 
 	VkDevice device = VK_NULL_HANDLE;
+	MemoryAllocator allocator;
+	DescriptorCache descriptorCache;
+	VkPipelineCache pipelineCache = VK_NULL_HANDLE;
+	TaskPool pipelineWorkers;
+	TaskPool recordWorkers;
+	size_t minDrawsPerRecordThread = 0;
+	ShaderModuleCache shaderCache;
+	std::string pipelineCachePath;
+	size_t pipelineCacheLoadedSize = 0; // 0 when we started from an empty cache
 	VkQueue graphicsQueue = VK_NULL_HANDLE;
 	VkQueue computeQueue = VK_NULL_HANDLE;
+	VkQueue transferQueue = VK_NULL_HANDLE;
+	VkQueue asyncComputeQueue = VK_NULL_HANDLE; // Compute only family, only used with asyncCompute
+	uint32_t graphicsQueueFamily = 0;
+	uint32_t transferQueueFamily = 0;
+	uint32_t computeQueueFamily = 0;
+	std::vector<uint32_t> concurrentQueueFamilies; // Every family a host visible buffer can be used from, when there are several
 
 	VkSurfaceKHR surface;
 	VkQueue presentQueue;
@@ -479,18 +576,26 @@ private:
 
 	std::vector<VkImageView> swapChainImageViews;
 
-	VkRenderPass defaultRenderPass;
+	VkRenderPass defaultRenderPass; // Only ImGui uses it when dynamic rendering is on
 	bool usesMsaa;
+	bool dynamicRendering = false;
+	bool indirectDraws = false;			// multiDrawIndirect and drawIndirectFirstInstance
+	bool indirectDrawCount = false;		// The count is read from the buffer, otherwise it is recorded
+	bool asyncCompute = false;			// Async passes have a queue of their own
+	VkImageLayout swapChainImageLayout = VK_IMAGE_LAYOUT_UNDEFINED; // Of the acquired image, tracked by the dynamic rendering path
 	std::optional<bool> nextUsesMsaa;
 
 
 	Pipeline* currentPipeline;
+	PipelineState currentPipelineState;
 
 
 	std::vector<Buffer> uniformBuffers;
 
 	std::vector<Buffer> computeUniformBuffers;
 	std::vector<VkDescriptorSet> computeDescriptorSets;
+	VkDescriptorSetLayout computeDescriptorSetLayout = VK_NULL_HANDLE; // Of the pipeline they were created for
+	void destroyComputeDescriptorSets();
 
 	GpuImage image;
 	GpuImage depthBuffer;
@@ -499,17 +604,74 @@ private:
 	std::vector<VkFramebuffer> swapChainFramebuffers;
 
 	VkCommandPool commandPool;
+	VkCommandPool transferCommandPool;
 	std::vector<VkCommandBuffer> commandBuffers;
 	std::vector<VkCommandBuffer> computeCommandBuffers;
+	// Async compute passes, submitted before the frame's first render pass so they run next to the previous frame's graphics
+	VkCommandPool asyncComputeCommandPool = VK_NULL_HANDLE;
+	std::vector<VkCommandBuffer> asyncComputeCommandBuffers;
+	// Acquires of what the async passes released, recorded on the graphics command buffer once they are submitted
+	std::vector<VkBufferMemoryBarrier> pendingGraphicsAcquires;
+
+	// One per record worker and frame in flight, reset once the frame slot's last submit is done
+	struct SecondaryCommandPool {
+		VkCommandPool pool = VK_NULL_HANDLE;
+		std::vector<VkCommandBuffer> buffers;
+		uint32_t used = 0;
+	};
+	std::vector<std::vector<SecondaryCommandPool>> secondaryPools; // [frame][worker]
+
+	// Secondaries of the cached passes, kept across frames and reset one by one when recorded again
+	VkCommandPool cachedCommandPool = VK_NULL_HANDLE;
+	bool cachePassCommands = true;
+	std::atomic<uint64_t> commandCacheVersion = 0; // Bumped by anything that makes the cached draws stale
+	PassCacheStats framePassCacheStats;
+	PassCacheStats lastFramePassCacheStats;
+
+	static constexpr size_t FramePacingHistorySize = 128;
+	FramePacingStats framePacing;	// Frame being recorded
+	std::array<FramePacingStats, FramePacingHistorySize> framePacingHistory{};
+	size_t framePacingIndex = 0;	// Next written, also the oldest
+	size_t framePacingCount = 0;	// Entries written so far, the history is only full after FramePacingHistorySize frames
+	std::chrono::steady_clock::time_point lastPresentTime;
+	bool hasPresented = false;
+
+	// Begin and end timestamps of each queue's command buffer, TimestampsPerFrame queries per frame slot
+	enum FrameTimestamp : uint32_t { GraphicsBegin, GraphicsEnd, AsyncComputeBegin, AsyncComputeEnd, TimestampsPerFrame };
+	VkQueryPool timestampPool = VK_NULL_HANDLE;
+	float timestampPeriod = 0.0f; // ns per tick, 0 when the queues can't write timestamps or the queries can't be reset from the CPU
+	QueueTimingStats lastQueueTimings;
+
+	std::mutex descriptorMutex; // The descriptor cache is also used from the record workers
+
+	// Skip redundant binds and pushes, secondaries have their own thread local tracker
+	CommandStateTracker graphicsState;
+	CommandStateTracker computeState;
+	std::mutex stateStatsMutex;
+	CommandStateTracker::Stats frameStateStats;		// Frame being recorded
+	CommandStateTracker::Stats lastFrameStateStats;
 
 	VkSampleCountFlagBits msaaSamples = VK_SAMPLE_COUNT_1_BIT;
 
-	const int MAX_FRAMES_IN_FLIGHT = 2;
+	static constexpr uint32_t MaxFramesInFlightLimit = 4;
+	uint32_t maxFramesInFlight = 2; // From DeviceOptions, every per frame resource is sized with it
+	// The swapchain only takes binary semaphores
 	std::vector<VkSemaphore>  imageAvailableSemaphores;
 	std::vector<VkSemaphore>  renderFinishedSemaphores;
-	std::vector<VkFence> computeInFlightFences;
-	std::vector<VkSemaphore> computeFinishedSemaphores;
-	std::vector<VkFence>  inFlightFences;
+
+	// One timeline per queue, every submit signals the next value. Cross queue dependencies and CPU waits are on values
+	struct QueueTimeline {
+		VkSemaphore semaphore = VK_NULL_HANDLE;
+		uint64_t lastSignaled = 0; // Last value submitted
+	};
+	QueueTimeline graphicsTimeline;
+	QueueTimeline computeTimeline;
+	QueueTimeline transferTimeline;
+	QueueTimeline asyncComputeTimeline;
+	// Values the last submits of each frame slot signal, waited on before the slot is reused
+	std::vector<uint64_t> frameGraphicsValues;
+	std::vector<uint64_t> frameComputeValues;
+	std::vector<uint64_t> frameAsyncComputeValues;
 	uint32_t current_frame = 0;
 	uint32_t current_framebuffer_idx = 0;
 
@@ -539,7 +701,6 @@ private:
 
 	QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device);
 	SwapChainSupportDetails querySwapChainSupport(VkPhysicalDevice device);
-	uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties);
 	
 	VkFormat findSupportedFormat(const std::vector<VkFormat>& candidates, VkImageTiling tiling, VkFormatFeatureFlags features);
 	VkFormat findDepthFormat();
@@ -553,9 +714,28 @@ private:
 	void cleanupSwapChain();
 	void recreateSwapChain();
 
-	VkShaderModule createShaderModule(const std::vector<char>& code);
+	VkShaderModule acquireShaderModule(const char* name);
+	// Run on pipelineWorkers, only touch thread safe device calls and what they are given
+	void compileGraphicsPipeline(const PipelineDesc& desc, const PipelineState& state, VkPipelineLayout pipelineLayout, VkExtent2D defaultExtent, PipelineVariant& out);
+	void compileComputePipeline(const PipelineDesc& desc, VkPipelineLayout pipelineLayout, PipelineVariant& out);
+
+	void beginRendering(VkCommandBuffer commandBuffer, const RenderPass& renderPass, const PipelineState& state, VkExtent2D extent, VkRenderingFlags flags);
+	void transitionSwapChainForPresent(VkCommandBuffer commandBuffer);
+	void setDynamicPipelineState(VkCommandBuffer commandBuffer, const Pipeline& pipeline, const PipelineState& state);
+	void bindPassState(VkCommandBuffer commandBuffer, const RenderPass& renderPass, const PipelineState& state, VkPipeline pipeline, VkExtent2D extent);
+	// Primary of the frame, or the secondary this thread is recording for the current pass
+	VkCommandBuffer graphicsCommandBuffer();
+	CommandStateTracker& stateTracker(PipelineType type = PipelineType::Graphics);
+	void addStateStats(const CommandStateTracker::Stats& stats);
+	VkCommandBuffer getSecondaryCommandBuffer(uint32_t worker);
+	// Reusable ones are not one time submit and give the descriptor sets they bind through usedSets
+	void recordSecondary(VkCommandBuffer commandBuffer, const RenderPass& renderPass, const PipelineState& state, VkPipeline pipeline, VkExtent2D extent, size_t first, size_t count,
+		std::vector<std::pair<VkDescriptorSetLayout, size_t>>* usedSets = nullptr);
+	void executeCachedCommands(VkCommandBuffer commandBuffer, RenderPass& renderPass, const PipelineState& state, VkPipeline pipeline, VkExtent2D extent);
+	void trackDescriptorSet(VkDescriptorSetLayout layout, size_t hash);
 
 	void createCommandBuffer();
+	void createSecondaryCommandPools();
 	void recordComputeCommandBuffer(VkCommandBuffer commandBuffer, const Pipeline& computePipeline);
 
 	void createInstance();
@@ -572,13 +752,30 @@ private:
 	void createFrameBuffers();
 	void createCommandPool();
 	void createUniformBuffers();
+	void createStagingBuffer();
+	void createGeometryHeap();
+	void createBindlessTable();
+	void createPipelineCache();
+	void savePipelineCache();
 	void createSyncObjects();
+	void createTimelines(); // Before anything is submitted, uploads included
+	uint64_t getCompletedValue(const QueueTimeline& timeline);
+	void waitTimeline(const QueueTimeline& timeline, uint64_t value);
+	void createTimestampPool();
+	void writeTimestamp(VkCommandBuffer commandBuffer, VkPipelineStageFlagBits stage, FrameTimestamp query);
+	// Once the frame slot is done, before its queries are written again
+	void readQueueTimings();
+	// Submits the async passes once, the acquires of what they released go on the graphics command buffer
+	void flushAsyncCompute();
+	void submitAsyncCompute();
 
 	VkSampleCountFlagBits getMsaaSamples() { return this->usesMsaa ? msaaSamples : VK_SAMPLE_COUNT_1_BIT; };
 
 
 private:
 	bool hasRecorededCompute = false;
+	bool hasRecordedAsyncCompute = false;
+	bool asyncComputeSubmitted = false; // Later async passes go on the in order command buffer
 	bool skipDraw = false;
 
 public:
@@ -602,7 +799,56 @@ public:
 	void SetBufferName(VkBuffer buffer, const char* name);
 
 	uint32_t getCurrentFrame() { return current_frame; }
-	uint32_t getMaxFramesInFlight() { return MAX_FRAMES_IN_FLIGHT; }
+	uint32_t getMaxFramesInFlight() { return maxFramesInFlight; }
+	const MemoryAllocator::Stats& getMemoryStats() { return allocator.getStats(); }
+	const DescriptorCache::Stats& getDescriptorStats() { return descriptorCache.getStats(); }
+	float getDescriptorHitRate() { return descriptorCache.getFrameHitRate(); }
+	size_t getPipelineCacheLoadedSize() { return pipelineCacheLoadedSize; }
+	uint32_t getPipelineWorkerCount() { return pipelineWorkers.getThreadCount(); }
+	ShaderModuleCache::Stats getShaderStats() { return shaderCache.getStats(); }
+	// Binds and pushes of the last submitted frame, elided ones were already bound
+	const CommandStateTracker::Stats& getStateStats() { return lastFrameStateStats; }
+	// Last submitted frame
+	const PassCacheStats& getPassCacheStats() { return lastFramePassCacheStats; }
+	// Ring of the last presented frames, getFramePacingOffset() is the oldest
+	const std::array<FramePacingStats, FramePacingHistorySize>& getFramePacingHistory() { return framePacingHistory; }
+	size_t getFramePacingOffset() { return framePacingIndex; }
+	// Until the history is full only [0, count) are real frames
+	size_t getFramePacingCount() { return framePacingCount; }
+	const FramePacingStats& getLastFramePacing() { return framePacingHistory[(framePacingIndex + FramePacingHistorySize - 1) % FramePacingHistorySize]; }
+
+	// The cached passes are recorded again before their next use, thread safe
+	void invalidateCachedCommands() { commandCacheVersion++; }
+	void setPassCommandCaching(bool enabled) { cachePassCommands = enabled; invalidateCachedCommands(); }
+	bool usesDynamicRendering() { return dynamicRendering; }
+	bool usesIndirectDraws() { return indirectDraws; }
+	bool usesIndirectDrawCount() { return indirectDraws && indirectDrawCount; }
+	bool usesAsyncCompute() { return asyncCompute; }
+	// Timings of the frame slot's previous use
+	const QueueTimingStats& getQueueTimings() { return lastQueueTimings; }
+
+	// Uploads are asynchronous, a resource should not be used before its token is complete
+	bool isUploadComplete(UploadToken token) const { return token.batch <= completedUploadBatch; }
+	// Batches complete in order so this also waits for everything uploaded before
+	void waitUpload(UploadToken token);
+	// Everything created in between is recorded together and submitted once, unless the staging ring fills up. Can be nested
+	void beginUploadBatch();
+	UploadToken endUploadBatch();
+	// Batch open for its lifetime, closed on the way out even if the loading throws
+	class UploadBatchScope {
+	private:
+		Device* parent_device = nullptr;
+		bool open = true;
+	public:
+		UploadBatchScope(Device* device)
+			:parent_device(device)
+			{ device->beginUploadBatch(); };
+		UploadBatchScope(const UploadBatchScope&) = delete;
+		UploadBatchScope& operator=(const UploadBatchScope&) = delete;
+		~UploadBatchScope() { if (open) parent_device->endUploadBatch(); };
+		UploadToken end() { open = false; return parent_device->endUploadBatch(); }
+	};
+	uint64_t getUploadBatchCount() const { return lastUploadBatch; }
 
 	void newImGuiFrame();
 	void setUsesMsaa(bool usesMsaa) {
@@ -628,11 +874,11 @@ private:
 		friend class MyCommandBuffer;
 		ScopedCommandBuffer(Device* device) 
 			:parent_device(device)
-			{ this->commandBuffer = device->beginSingleTimeCommands(); };
+			{ device->setupCommandBuffer(); this->commandBuffer = device->currentUpload.graphicsCmd; };
 		ScopedCommandBuffer(ScopedCommandBuffer&& o) noexcept 
 			: parent_device(std::exchange(o.parent_device, nullptr)),
 			  commandBuffer(std::exchange(o.commandBuffer, VK_NULL_HANDLE)) {}
-		~ScopedCommandBuffer() { if(commandBuffer) parent_device->endSingleTimeCommands(commandBuffer); commandBuffer = nullptr; };
+		~ScopedCommandBuffer() { if(commandBuffer) parent_device->flushCommandBuffer(); commandBuffer = nullptr; };
 		operator VkCommandBuffer() const { return commandBuffer; }
 	};
 
@@ -654,28 +900,97 @@ private:
 		}
 	};
 
-	VkCommandBuffer tmpCommandBuffer = VK_NULL_HANDLE;
+	/*
+	* Uploads are recorded in batches. Copies go to the transfer queue, then once they are done the graphics queue
+	* acquires the resources and does the layout transitions and mips, so frames never wait on the copies.
+	* Without a dedicated transfer family both command buffers are the same one.
+	*/
+	struct UploadBatch {
+		uint64_t id = 0;
+		VkCommandBuffer transferCmd = VK_NULL_HANDLE;
+		VkCommandBuffer graphicsCmd = VK_NULL_HANDLE;
+		uint64_t transferValue = 0; // Transfer timeline, 0 without a dedicated transfer queue
+		uint64_t graphicsValue = 0; // Graphics timeline, once graphicsSubmitted
+		bool graphicsSubmitted = false;
+	};
+
+	// All uploads go through this one, space is given back once the batch that used it is done
+	Buffer stagingBuffer;
+	StagingRing stagingRing;
+	VkDeviceSize stagingBufferSize;
+
+	UploadBatch currentUpload;
+	std::deque<UploadBatch> pendingUploads;
+	uint64_t lastUploadBatch = 0;
+	uint64_t completedUploadBatch = 0;
+	uint32_t uploadBatchDepth = 0;
+
+	bool hasDedicatedTransferQueue() const { return transferQueueFamily != graphicsQueueFamily; }
+	bool isRecordingUpload() const { return currentUpload.graphicsCmd != VK_NULL_HANDLE; }
+	void submitGraphicsUpload(UploadBatch& batch);
+	void retireUpload();
+	void processUploads();
+
+	VkDeviceSize allocateStaging(VkDeviceSize size, VkDeviceSize alignment);
+	void uploadBuffer(VkBuffer dst, VkDeviceSize dstOffset, const void* src, VkDeviceSize size);
+	void uploadImage(VkImage image, const void* src, uint32_t width, uint32_t height, size_t layerSize, uint32_t layerCount);
+	void transferBufferOwnership(VkBuffer buffer, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE);
+	void transferImageOwnership(VkImage image, VkImageLayout newLayout, VkAccessFlags dstAccess, VkPipelineStageFlags dstStage, uint32_t mipLevels, uint32_t layerCount);
+
+	// Every mesh lives in these two, they are bound once per render pass
+	Buffer geometryVertexBuffer;
+	Buffer geometryIndexBuffer;
+	RangeAllocator vertexHeap;
+	RangeAllocator indexHeap;
+	VkDeviceSize geometryVertexHeapSize;
+	VkDeviceSize geometryIndexHeapSize;
+
+	// Every sampled texture and sampler registered once in a single update after bind set, materials only pass indices
+	VkDescriptorSetLayout bindlessSetLayout = VK_NULL_HANDLE;
+	VkDescriptorPool bindlessPool = VK_NULL_HANDLE;
+	VkDescriptorSet bindlessSet = VK_NULL_HANDLE;
+	uint32_t maxBindlessTextures;
+	uint32_t maxBindlessSamplers;
+	uint32_t bindlessTextureCount = 0;
+	std::vector<uint32_t> freeBindlessTextures;
+	std::unordered_map<VkSampler, uint32_t> bindlessSamplers;
+	uint32_t bindlessSamplerCount = 0;
+
 	void setupCommandBuffer();
-	void flushCommandBuffer();
+	UploadToken flushCommandBuffer();
 	MyCommandBuffer getCommandBuffer();
-	VkCommandBuffer beginSingleTimeCommands();
-	void endSingleTimeCommands(VkCommandBuffer commandBuffer);
+	VkCommandBuffer beginSingleTimeCommands(VkCommandPool pool);
 
-	void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& out_buffer, VkDeviceMemory& out_bufferMemory);
-	void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
+	void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, Buffer& out_buffer);
 	
 	void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t mipLevels, uint32_t layerCount, VkCommandBuffer cb = VK_NULL_HANDLE );
 	void generateMipmaps(VkImage image, VkFormat format, int32_t texWidth, int32_t texheight, uint32_t mipLevels, uint32_t layerCount);
 	void createImage(ImageDesc desc, GpuImage& out_image);
 	VkImageView createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags, uint32_t baseMip, uint32_t mipCount, bool isCubemap, bool write = false);
-	void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height, size_t layerSize, uint32_t layerCount);
 public:
 	Buffer createLocalBuffer(size_t size,VkBufferUsageFlags usage,  void* src_data = nullptr);
 	Buffer createVertexBuffer(size_t size, void* src_data = nullptr);
 	Buffer createIndexBuffer(size_t size, void* src_data = nullptr);
 	Buffer createUniformBuffer(size_t size, void* src_data = nullptr);
+	Buffer createStorageBuffer(size_t size, void* src_data = nullptr); // Host visible, for small tables written from the CPU
 	void destroyBuffer(Buffer& buffer);
 
+	// Vertices are MeshVertex
+	MeshGeometry createMeshGeometry(const void* vertices, size_t vertexCount, const uint32_t* indices, size_t indexCount);
+	void destroyMeshGeometry(MeshGeometry& geometry);
+
+	// Host visible, drawDataStride is the size of the shader's per draw struct
+	IndirectDrawBuffer createIndirectDrawBuffer(uint32_t capacity, uint32_t drawDataStride);
+	void destroyIndirectDrawBuffer(IndirectDrawBuffer& draws);
+	// Fills draw index of the current frame, the geometry must be indexed
+	void writeIndirectDraw(IndirectDrawBuffer& draws, uint32_t index, const MeshGeometry& geometry, uint32_t firstInstance, uint32_t instanceCount = 1);
+	// Data of one instance for the current frame
+	void writeIndirectDrawData(IndirectDrawBuffer& draws, uint32_t instance, const void* data);
+	// Draws [0, count) are the ones drawn this frame
+	void setIndirectDrawCount(IndirectDrawBuffer& draws, uint32_t count);
+	// Device local, for compute passes that write draws in the same layout. Only drawable with usesIndirectDrawCount
+	IndirectDrawBuffer createGpuIndirectDrawBuffer(uint32_t capacity);
+
 	GpuImage createTexture(Texture tex);
 	void createRWTexture(GpuImage& out_image, uint32_t width, uint32_t height, ImageFormat format, bool is_cubemap, bool sampled = false, bool allocateMips = false);
 	void createRenderTarget(GpuImage& out_image, uint32_t width, uint32_t height, bool msaa, bool sampled = false);
@@ -683,11 +998,18 @@ public:
 	void destroyImage(GpuImage image);
 
 	void destroySampler(VkSampler sampler) {
+		unregisterSampler(sampler);
 		vkDestroySampler(device, sampler, nullptr);
 	}
 
 	VkSampler createTextureSampler(SamplerDesc desc);
 
+	// Bindless table, the returned index is what the shaders use. Registering twice gives the same index
+	uint32_t registerTexture(GpuImage& image);
+	void unregisterTexture(GpuImage& image);
+	uint32_t registerSampler(VkSampler sampler);
+	void unregisterSampler(VkSampler sampler);
+
 	void updateUniformBuffer(void* data, size_t size);
 	void updateComputeUniformBuffer(void* data, size_t size);
 	Dimensions getExtent() { return swapChainExtent;};
@@ -710,6 +1032,8 @@ private:
 	void createDescriptorSets(VkDescriptorSetLayout layout, VkDescriptorPool pool, VkDescriptorSet* out_sets, uint32_t count);
 	void recordRenderPass(VkCommandBuffer commandBuffer, RenderPass& renderPass);
 	void recordComputePass(VkCommandBuffer commandBuffer, ComputePass& renderPass);
+	// Waits on the slot's last use of it first
+	void beginComputeCommandBuffer(VkCommandBuffer commandBuffer, const QueueTimeline& timeline, uint64_t value);
 
 public:
 
@@ -718,7 +1042,17 @@ public:
 	RenderPass createRenderPassAndPipeline(RenderPassDesc renderPassDesc, PipelineDesc pipelineDesc);
 	ComputePass createComputePass(ComputePassDesc desc, PipelineDesc pipelineDesc);
 	void setRenderPass(RenderPass& renderPass);
-	void drawPacket(const MeshPacket& packet);
+	// firstInstance is the packet's entry in the bound draw data
+	void drawPacket(const MeshPacket& packet, uint32_t firstInstance, uint32_t instanceCount = 1);
+	// Starts compiling a variant in the background if it doesn't exist yet, e.g. before toggling MSAA
+	std::shared_ptr<PipelineVariant> requestPipelineVariant(const Pipeline& pipeline, const PipelineState& state);
+	// Same but blocks until the variant is compiled
+	VkPipeline getPipelineVariant(const Pipeline& pipeline, const PipelineState& state);
+	// State a pass is recorded with, multisampled only if the pass writes the swapchain
+	PipelineState getRenderPassState(const RenderPass& renderPass, bool msaa);
+	const PipelineState& getCurrentPipelineState();
+	// Selects the shader permutation the pass is recorded with from now on
+	void setSpecializationConstants(RenderPass& renderPass, const std::vector<uint32_t>& values);
 	void destroyPipeline(const Pipeline& pipeline);
 	void destroyRenderPass(const RenderPass& renderPass);
 	void destroyComputePass(const ComputePass& computePass);
@@ -727,16 +1061,23 @@ public:
 	/*Deprecated*/void bindTexture(const GpuImage& image, VkSampler sampler);
 	/*Deprecated*/void bindBuffer(const Buffer& buiffer, uint32_t set, uint32_t binding);
 	void bindRessources(uint32_t set, std::vector<const Buffer*> buffers, std::vector<ImageBindInfo> images, PipelineType binding_point = PipelineType::Graphics);
+	// Only for pipelines created with useBindlessTextures, once per pass is enough
+	void bindBindlessTable(PipelineType binding_point = PipelineType::Graphics);
 	void transitionImage(BarrierDesc desc, PipelineType pipeline_type = PipelineType::Graphics);
 	void generateMipmaps(GpuImage& image, PipelineType pipeline_type = PipelineType::Graphics);
 	void drawCommand(uint32_t vertex_count);
+	// Every draw of the current frame's buffer, its drawData has to be bound by the caller
+	void drawIndirect(const IndirectDrawBuffer& draws);
 	void dispatchCommand(uint32_t count_x, uint32_t count_y, uint32_t count_z);
+	// Zeroes the current frame's count from the compute command buffer, before a dispatch appends draws to it
+	void clearIndirectDrawCount(const IndirectDrawBuffer& draws);
+	// From an async compute pass, for what the graphics queue reads this frame. Its content is only kept on the way there
+	void releaseToGraphics(const Buffer& buffer);
 	void pushConstants(const void* data, uint32_t offset, uint32_t size, StageFlags = e_Vertex, VkPipelineLayout pipelineLayout = VK_NULL_HANDLE);
 
 	void recordRenderPass(RenderPass& renderPass);
 	void recordComputePass(ComputePass& renderPass);
 	void recordImGui();
 
-	VkDescriptorPool createDescriptorPool(BindingDesc* bindingDescs, size_t count);
 	void createComputeDescriptorSets(const Pipeline& computePipeline);
 };
@@ -0,0 +1,226 @@
+#include "MemoryAllocator.h"
+
+#include <stdexcept>
+#include <algorithm>
+
+void RangeAllocator::init(VkDeviceSize size)
+{
+	freeRanges.clear();
+	freeRanges.push_back({ 0, size });
+	totalSize = size;
+	freeSize = size;
+}
+
+VkDeviceSize RangeAllocator::allocate(VkDeviceSize size, VkDeviceSize alignment)
+{
+	alignment = std::max<VkDeviceSize>(alignment, 1);
+
+	//First fit, ranges are sorted by offset so this keeps the low part of the heap packed
+	for (size_t i = 0; i < freeRanges.size(); i++) {
+		Range& range = freeRanges[i];
+
+		VkDeviceSize alignedOffset = (range.offset + alignment - 1) / alignment * alignment;
+		VkDeviceSize padding = alignedOffset - range.offset;
+		if (range.size < padding + size)
+			continue;
+
+		VkDeviceSize remaining = range.size - padding - size;
+
+		// The padding stays in the free list so nothing is lost to alignment
+		if (padding > 0) {
+			range.size = padding;
+			if (remaining > 0)
+				freeRanges.insert(freeRanges.begin() + i + 1, { alignedOffset + size, remaining });
+		}
+		else if (remaining > 0) {
+			range.offset += size;
+			range.size = remaining;
+		}
+		else {
+			freeRanges.erase(freeRanges.begin() + i);
+		}
+
+		freeSize -= size;
+		return alignedOffset;
+	}
+
+	return InvalidOffset;
+}
+
+void RangeAllocator::free(VkDeviceSize offset, VkDeviceSize size)
+{
+	auto it = std::lower_bound(freeRanges.begin(), freeRanges.end(), offset, [](const Range& r, VkDeviceSize o) { return r.offset < o; });
+	it = freeRanges.insert(it, { offset, size });
+	freeSize += size;
+
+	auto next = it + 1;
+	if (next != freeRanges.end() && it->offset + it->size == next->offset) {
+		it->size += next->size;
+		freeRanges.erase(next);
+	}
+
+	if (it != freeRanges.begin()) {
+		auto prev = it - 1;
+		if (prev->offset + prev->size == it->offset) {
+			prev->size += it->size;
+			freeRanges.erase(it);
+		}
+	}
+}
+
+
+void MemoryAllocator::init(VkPhysicalDevice physicalDevice, VkDevice device, VkDeviceSize blockSize)
+{
+	this->device = device;
+	this->blockSize = blockSize;
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+	maxAllocationCount = properties.limits.maxMemoryAllocationCount;
+
+	vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+
+	pools.resize(memProperties.memoryTypeCount * 2);
+	for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+		pools[i * 2].memoryType = i;
+		pools[i * 2 + 1].memoryType = i;
+	}
+}
+
+void MemoryAllocator::cleanup()
+{
+	for (Pool& pool : pools) {
+		for (Block& block : pool.blocks) {
+			if (block.memory != VK_NULL_HANDLE)
+				freeDeviceMemory(block.memory, blockSize);
+		}
+		pool.blocks.clear();
+	}
+}
+
+uint32_t MemoryAllocator::findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties)
+{
+	for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+		if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+			return i;
+		}
+	}
+
+	throw std::runtime_error("failed to find suitable memory type!");
+}
+
+VkDeviceMemory MemoryAllocator::allocateDeviceMemory(VkDeviceSize size, uint32_t memoryType, void** out_mapped)
+{
+	if (stats.deviceAllocations >= maxAllocationCount) {
+		throw std::runtime_error("failed to allocate memory : maxMemoryAllocationCount reached");
+	}
+
+	VkMemoryAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocInfo.allocationSize = size;
+	allocInfo.memoryTypeIndex = memoryType;
+
+	VkDeviceMemory memory;
+	if (vkAllocateMemory(device, &allocInfo, nullptr, &memory) != VK_SUCCESS) {
+		throw std::runtime_error("failed to allocate device memory!");
+	}
+
+	//Host visible memory stays mapped for its whole life, we can't map the same VkDeviceMemory twice anyway
+	*out_mapped = nullptr;
+	if (memProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+		vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, out_mapped);
+	}
+
+	stats.deviceAllocations++;
+	stats.reserved += size;
+
+	return memory;
+}
+
+void MemoryAllocator::freeDeviceMemory(VkDeviceMemory memory, VkDeviceSize size)
+{
+	vkFreeMemory(device, memory, nullptr);
+	stats.deviceAllocations--;
+	stats.reserved -= size;
+}
+
+MemoryAllocation MemoryAllocator::allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, bool linear)
+{
+	uint32_t memoryType = findMemoryType(requirements.memoryTypeBits, properties);
+	uint32_t poolIdx = memoryType * 2 + (linear ? 1 : 0);
+	Pool& pool = pools[poolIdx];
+
+	MemoryAllocation allocation;
+	allocation.pool = poolIdx;
+	allocation.size = requirements.size;
+
+	stats.subAllocations++;
+	stats.used += requirements.size;
+
+	// Big resources (render targets, cubemaps, ...) get their own memory, no need to waste a block on them
+	if (requirements.size > blockSize / 2) {
+		allocation.memory = allocateDeviceMemory(requirements.size, memoryType, &allocation.mapped);
+		allocation.offset = 0;
+		return allocation;
+	}
+
+	uint32_t blockIdx = UINT32_MAX;
+	VkDeviceSize offset = RangeAllocator::InvalidOffset;
+	for (uint32_t i = 0; i < pool.blocks.size() && offset == RangeAllocator::InvalidOffset; i++) {
+		if (pool.blocks[i].memory == VK_NULL_HANDLE)
+			continue;
+
+		offset = pool.blocks[i].ranges.allocate(requirements.size, requirements.alignment);
+		blockIdx = i;
+	}
+
+	if (offset == RangeAllocator::InvalidOffset) {
+		// Reuse a released slot if any so the block indices of live allocations stay valid
+		auto freeSlot = std::find_if(pool.blocks.begin(), pool.blocks.end(), [](const Block& b) { return b.memory == VK_NULL_HANDLE; });
+		blockIdx = static_cast<uint32_t>(freeSlot - pool.blocks.begin());
+		if (freeSlot == pool.blocks.end())
+			pool.blocks.emplace_back();
+
+		Block& block = pool.blocks[blockIdx];
+		block.memory = allocateDeviceMemory(blockSize, memoryType, &block.mapped);
+		block.ranges.init(blockSize);
+		offset = block.ranges.allocate(requirements.size, requirements.alignment);
+	}
+
+	const Block& block = pool.blocks[blockIdx];
+	allocation.memory = block.memory;
+	allocation.offset = offset;
+	allocation.block = blockIdx;
+	allocation.mapped = block.mapped ? static_cast<char*>(block.mapped) + offset : nullptr;
+
+	return allocation;
+}
+
+void MemoryAllocator::free(MemoryAllocation& allocation)
+{
+	if (allocation.memory == VK_NULL_HANDLE)
+		return;
+
+	if (allocation.block == UINT32_MAX) {
+		freeDeviceMemory(allocation.memory, allocation.size);
+	}
+	else {
+		Pool& pool = pools[allocation.pool];
+		Block& block = pool.blocks[allocation.block];
+		block.ranges.free(allocation.offset, allocation.size);
+
+		// Give empty blocks back to the driver but keep one per pool around, scene reloads would allocate it again right away
+		if (block.ranges.isEmpty()) {
+			size_t liveBlocks = std::count_if(pool.blocks.begin(), pool.blocks.end(), [](const Block& b) { return b.memory != VK_NULL_HANDLE; });
+			if (liveBlocks > 1) {
+				freeDeviceMemory(block.memory, blockSize);
+				block.memory = VK_NULL_HANDLE;
+				block.mapped = nullptr;
+			}
+		}
+	}
+
+	stats.subAllocations--;
+	stats.used -= allocation.size;
+	allocation = {};
+}
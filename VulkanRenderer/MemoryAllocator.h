@@ -0,0 +1,94 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <vector>
+#include <cstdint>
+
+/*
+* Sub-allocation handed out by the MemoryAllocator.
+* Resources are bound at (memory, offset), mapped is already offset for host visible memory.
+*/
+struct MemoryAllocation {
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize offset = 0;
+	VkDeviceSize size = 0;
+	void* mapped = nullptr;
+
+	//Needed to give the range back to the right block
+	uint32_t pool = UINT32_MAX;
+	uint32_t block = UINT32_MAX; // UINT32_MAX means dedicated allocation
+};
+
+/*
+* Free-list over a [0, size) range, sorted by offset and coalesced on free.
+* Knows nothing about Vulkan memory so we can also use it for other heaps.
+*/
+class RangeAllocator {
+public:
+	static constexpr VkDeviceSize InvalidOffset = ~0ull;
+
+	void init(VkDeviceSize size);
+
+	// Returns InvalidOffset if no range is big enough
+	VkDeviceSize allocate(VkDeviceSize size, VkDeviceSize alignment = 1);
+	void free(VkDeviceSize offset, VkDeviceSize size);
+
+	VkDeviceSize getSize() const { return totalSize; }
+	VkDeviceSize getFreeSize() const { return freeSize; }
+	bool isEmpty() const { return freeSize == totalSize; }
+
+private:
+	struct Range {
+		VkDeviceSize offset;
+		VkDeviceSize size;
+	};
+
+	std::vector<Range> freeRanges;
+	VkDeviceSize totalSize = 0;
+	VkDeviceSize freeSize = 0;
+};
+
+class MemoryAllocator {
+public:
+	struct Stats {
+		uint32_t deviceAllocations = 0; // Actual vkAllocateMemory count
+		uint32_t subAllocations = 0;
+		VkDeviceSize reserved = 0;
+		VkDeviceSize used = 0;
+	};
+
+	void init(VkPhysicalDevice physicalDevice, VkDevice device, VkDeviceSize blockSize = 64ull * 1024 * 1024);
+	void cleanup();
+
+	// linear is true for buffers and linear images, they get their own pools so we never have to care about bufferImageGranularity
+	MemoryAllocation allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, bool linear);
+	void free(MemoryAllocation& allocation);
+
+	const Stats& getStats() const { return stats; }
+
+private:
+	struct Block {
+		VkDeviceMemory memory = VK_NULL_HANDLE;
+		void* mapped = nullptr;
+		RangeAllocator ranges;
+	};
+
+	struct Pool {
+		uint32_t memoryType;
+		std::vector<Block> blocks;
+	};
+
+	VkDevice device = VK_NULL_HANDLE;
+	VkPhysicalDeviceMemoryProperties memProperties{};
+	VkDeviceSize blockSize = 0;
+	uint32_t maxAllocationCount = 0;
+
+	// Indexed by memoryType * 2 + linear
+	std::vector<Pool> pools;
+	Stats stats;
+
+	uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties);
+	VkDeviceMemory allocateDeviceMemory(VkDeviceSize size, uint32_t memoryType, void** out_mapped);
+	void freeDeviceMemory(VkDeviceMemory memory, VkDeviceSize size);
+};
@@ -40,6 +40,15 @@ static_assert(sizeof(debug_colors) / sizeof(debug_colors[0]) == (int)DebugColor:
 
 static const std::string baseShaderPath = "./shaders/spv/";
 
+// Set while a thread records a secondary command buffer of the current pass, the draw helpers record there instead of in the primary
+struct SecondaryRecording {
+	VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+	PipelineState state;
+	CommandStateTracker tracker;
+	std::vector<std::pair<VkDescriptorSetLayout, size_t>>* usedSets = nullptr; // Only when recording a reusable one
+};
+static thread_local SecondaryRecording t_secondary;
+
 
 uint32_t getVkStageFlags(StageFlags stageFlags)
 {
@@ -52,6 +61,17 @@ uint32_t getVkStageFlags(StageFlags stageFlags)
 	return vkStageFlags;
 }
 
+static VkCullModeFlags getVkCullMode(CullMode cullMode)
+{
+	switch (cullMode)
+	{
+		case CullMode::None: return VK_CULL_MODE_NONE;
+		case CullMode::Front: return VK_CULL_MODE_FRONT_BIT;
+		case CullMode::Back: return VK_CULL_MODE_BACK_BIT;
+	}
+	return VK_CULL_MODE_BACK_BIT;
+}
+
 VkDescriptorSetLayout Device::createDescriptorSetLayout(BindingDesc* bindingDescs, size_t count) {
 	VkDescriptorSetLayout out_layout;
 
@@ -111,43 +131,6 @@ VkPushConstantRange Device::createPushConstantRange(const PushConstantsRange& ra
 		};
 }
 
-VkDescriptorPool Device::createDescriptorPool(BindingDesc* bindingDescs, size_t count) {
-
-	VkDescriptorPool out_pool;
-
-	std::vector<VkDescriptorPoolSize> poolSizes{};
-	poolSizes.resize(count);
-
-	for (int i = 0; i < count; i++)
-	{
-		BindingDesc desc = bindingDescs[i];
-
-		switch (desc.type)
-		{
-		case BindingType::UBO: 				poolSizes[i].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER; break;
-		case BindingType::ImageSampler: 	poolSizes[i].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER; break;
-		case BindingType::StorageBuffer: 	poolSizes[i].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER; break;
-		case BindingType::StorageImage: 	poolSizes[i].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE; break;
-		default:break;
-		}
-
-		//TODO do something about the size, at 100 because no reason, to be safe
-		poolSizes[i].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT) * 300;
-	}
-
-	VkDescriptorPoolCreateInfo poolInfo{};
-	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-	poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
-	poolInfo.pPoolSizes = poolSizes.data();
-	poolInfo.maxSets = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT) * 300;
-
-	if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &out_pool) != VK_SUCCESS) {
-		throw std::runtime_error("failed to create escriptor pool");
-	}
-
-	return out_pool;
-}
-
 void Device::createDescriptorSets(VkDescriptorSetLayout layout, VkDescriptorPool pool, VkDescriptorSet* out_sets, uint32_t count)
 {
 	std::vector<VkDescriptorSetLayout> layouts(count, layout);
@@ -265,21 +248,27 @@ VkRenderPass Device::createRenderPass(RenderPassDesc desc)
 	return out_renderPass;
 }
 
-Pipeline Device::createPipeline(PipelineDesc desc)
+// Kept until the pipeline is destroyed so later pipelines using the same file share the module
+VkShaderModule Device::acquireShaderModule(const char* name)
 {
-	Pipeline out_pipeline;
+	bool created;
+	VkShaderModule module = shaderCache.acquire(baseShaderPath + name, created);
+	if (created)
+		SetShaderModuleName(module, name);
 
-	auto vertShaderCode = readFile(baseShaderPath + desc.vertexShader);
-	auto fragShaderCode = readFile(baseShaderPath + desc.pixelShader);
+	return module;
+}
+
+void Device::compileGraphicsPipeline(const PipelineDesc& desc, const PipelineState& state, VkPipelineLayout pipelineLayout, VkExtent2D defaultExtent, PipelineVariant& out)
+{
 
 	const bool isVertHLSL = strstr(desc.vertexShader, ".vs") != NULL || strstr(desc.vertexShader, ".slang") != NULL;
 	const bool isFragHLSL = strstr(desc.pixelShader, ".ps") != NULL || strstr(desc.vertexShader, ".slang") != NULL;;
 
-	VkShaderModule vertShaderModule = createShaderModule(vertShaderCode);
-	VkShaderModule fragShaderModule = createShaderModule(fragShaderCode);
-
-	SetShaderModuleName(vertShaderModule, desc.vertexShader);
-	SetShaderModuleName(fragShaderModule, desc.pixelShader);
+	VkShaderModule vertShaderModule = acquireShaderModule(desc.vertexShader);
+	out.shaderModules.push_back(vertShaderModule);
+	VkShaderModule fragShaderModule = acquireShaderModule(desc.pixelShader);
+	out.shaderModules.push_back(fragShaderModule);
 
 	VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
 	vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -297,8 +286,8 @@ Pipeline Device::createPipeline(PipelineDesc desc)
 
 	if (desc.geometryShader)
 	{
-		VkShaderModule geomShaderModule = createShaderModule(readFile(baseShaderPath + desc.geometryShader));
-		SetShaderModuleName(geomShaderModule, desc.geometryShader);
+		VkShaderModule geomShaderModule = acquireShaderModule(desc.geometryShader);
+		out.shaderModules.push_back(geomShaderModule);
 
 		const bool isGeomHLSL = strstr(desc.geometryShader, ".gs") != NULL || strstr(desc.geometryShader, ".slang") != NULL;
 		VkPipelineShaderStageCreateInfo geomShaderStageInfo{};
@@ -310,12 +299,37 @@ Pipeline Device::createPipeline(PipelineDesc desc)
 		shaderStages.push_back(geomShaderStageInfo);
 	}
 
+	std::array<VkSpecializationMapEntry, PipelineState::MaxSpecializationConstants> specializationEntries;
+	for (uint32_t i = 0; i < state.specializationCount; i++)
+	{
+		specializationEntries[i] = { .constantID = i, .offset = i * (uint32_t)sizeof(uint32_t), .size = sizeof(uint32_t) };
+	}
+
+	VkSpecializationInfo specializationInfo{
+		.mapEntryCount = state.specializationCount,
+		.pMapEntries = specializationEntries.data(),
+		.dataSize = state.specializationCount * sizeof(uint32_t),
+		.pData = state.specialization.data(),
+	};
+
+	// Every stage gets all of them, ids a stage doesn't declare are ignored
+	if (state.specializationCount > 0) {
+		for (auto& stage : shaderStages)
+			stage.pSpecializationInfo = &specializationInfo;
+	}
 
 	std::vector<VkDynamicState> dynamicStates = {
 		VK_DYNAMIC_STATE_VIEWPORT,
 		VK_DYNAMIC_STATE_SCISSOR
 	};
 
+	if (desc.dynamicStates & e_DynamicCullMode)
+		dynamicStates.push_back(VK_DYNAMIC_STATE_CULL_MODE);
+	if (desc.hasDepth && (desc.dynamicStates & e_DynamicDepthCompare))
+		dynamicStates.push_back(VK_DYNAMIC_STATE_DEPTH_COMPARE_OP);
+	if (desc.hasDepth && (desc.dynamicStates & e_DynamicDepthWrite))
+		dynamicStates.push_back(VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE);
+
 	VkPipelineDynamicStateCreateInfo dynamicState{};
 	dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
 	dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
@@ -351,14 +365,14 @@ Pipeline Device::createPipeline(PipelineDesc desc)
 	VkViewport viewport{};
 	viewport.x = 0.0f;
 	viewport.y = 0.0f;
-	viewport.width = (float)(hasExtent ? desc.extent.x : swapChainExtent.width);
-	viewport.height = (float)(hasExtent ? desc.extent.y : swapChainExtent.height);;
+	viewport.width = (float)(hasExtent ? desc.extent.x : defaultExtent.width);
+	viewport.height = (float)(hasExtent ? desc.extent.y : defaultExtent.height);;
 	viewport.minDepth = 0.0f;
 	viewport.maxDepth = 1.0f;
 
 	VkRect2D scissor{};
 	scissor.offset = { 0, 0 };
-	scissor.extent = hasExtent? VkExtent2D{desc.extent.x, desc.extent.y} : swapChainExtent;
+	scissor.extent = hasExtent? VkExtent2D{desc.extent.x, desc.extent.y} : defaultExtent;
 
 	VkPipelineViewportStateCreateInfo viewportState{};
 	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
@@ -367,13 +381,7 @@ Pipeline Device::createPipeline(PipelineDesc desc)
 	viewportState.scissorCount = 1;
 	viewportState.pScissors = &scissor;
 
-	VkCullModeFlags cullMode = VK_CULL_MODE_BACK_BIT;
-	switch (desc.cullMode)
-	{
-		case CullMode::None: cullMode = VK_CULL_MODE_NONE; break;
-		case CullMode::Front: cullMode = VK_CULL_MODE_FRONT_BIT; break;
-		case CullMode::Back: cullMode = VK_CULL_MODE_BACK_BIT; break;
-	}
+	VkCullModeFlags cullMode = getVkCullMode(state.cullMode);
 
 	//Reminder : activating lots of stuff here like wireframe mode require a GPU feature
 	VkPipelineRasterizationStateCreateInfo rasterizer{};
@@ -393,7 +401,7 @@ Pipeline Device::createPipeline(PipelineDesc desc)
 	VkPipelineMultisampleStateCreateInfo multisampling{};
 	multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
 	multisampling.sampleShadingEnable = VK_FALSE;
-	multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+	multisampling.rasterizationSamples = state.samples;
 	multisampling.minSampleShading = 1.0f; // Optional
 	multisampling.pSampleMask = nullptr; // Optional
 	multisampling.alphaToCoverageEnable = VK_FALSE; // Optional
@@ -404,8 +412,8 @@ Pipeline Device::createPipeline(PipelineDesc desc)
 	VkPipelineDepthStencilStateCreateInfo depthStencil{};
 	depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
 	depthStencil.depthTestEnable = VK_TRUE;
-	depthStencil.depthWriteEnable = desc.blendMode == BlendMode::Opaque;
-	depthStencil.depthCompareOp = static_cast<VkCompareOp>(desc.depthCompareOp); // VK_COMPARE_OP_LESS
+	depthStencil.depthWriteEnable = state.depthWrite;
+	depthStencil.depthCompareOp = static_cast<VkCompareOp>(state.depthCompareOp); // VK_COMPARE_OP_LESS
 	depthStencil.depthBoundsTestEnable = VK_FALSE;
 	depthStencil.minDepthBounds = 0.0f; // Optional
 	depthStencil.maxDepthBounds = 1.0f; // Optional
@@ -421,7 +429,7 @@ Pipeline Device::createPipeline(PipelineDesc desc)
 	{
 		VkPipelineColorBlendAttachmentState& colorBlendAttachment = colorBlendAttachments[i];
 		colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-		switch (desc.blendMode)
+		switch (state.blendMode)
 		{
 		case BlendMode::Opaque:
 			colorBlendAttachment.blendEnable = VK_FALSE;
@@ -459,33 +467,6 @@ Pipeline Device::createPipeline(PipelineDesc desc)
 	colorBlending.blendConstants[3] = 0.0f; // Optional
 
 
-	size_t setCount = desc.bindings.size();
-
-	std::vector<VkDescriptorSetLayout> setLayouts;
-	for (int i = 0; i < setCount; i++)
-	{
-		setLayouts.push_back(createDescriptorSetLayout(desc.bindings[i].data(), desc.bindings[i].size()));
-	}
-
-	std::vector<VkPushConstantRange> pushConstantsRanges;
-
-	for (auto& range : desc.pushConstantsRanges)
-	{
-		pushConstantsRanges.push_back(createPushConstantRange(range));
-	}
-
-	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-	pipelineLayoutInfo.setLayoutCount = setLayouts.size(); // Optional
-	pipelineLayoutInfo.pSetLayouts = setLayouts.data();
-	pipelineLayoutInfo.pushConstantRangeCount = pushConstantsRanges.size(); // Optional
-	pipelineLayoutInfo.pPushConstantRanges = pushConstantsRanges.data(); // Optional
-
-	VkPipelineLayout out_pipelineLayout;
-	if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &out_pipelineLayout) != VK_SUCCESS) {
-		throw std::runtime_error("failed to create pipeline layout!");
-	}
-
 	//VkRenderPass renderPass = desc.useDefaultRenderPass? defaultRenderPass: createRenderPass(desc.colorAttachment, desc.hasDepth, desc.useMsaa);
 
 	// FINALLY ! 
@@ -503,53 +484,116 @@ Pipeline Device::createPipeline(PipelineDesc desc)
 	pipelineInfo.pColorBlendState = &colorBlending;
 	pipelineInfo.pDynamicState = &dynamicState;
 
-	pipelineInfo.layout = out_pipelineLayout;
-	pipelineInfo.renderPass = desc.renderPass;
-	pipelineInfo.subpass = 0;
+	pipelineInfo.layout = pipelineLayout;
+
+	std::vector<VkFormat> colorFormats(desc.attachmentCount, desc.colorFormat);
+	VkPipelineRenderingCreateInfo renderingInfo = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO,
+		.colorAttachmentCount = (uint32_t)colorFormats.size(),
+		.pColorAttachmentFormats = colorFormats.data(),
+		.depthAttachmentFormat = desc.hasDepth ? desc.depthFormat : VK_FORMAT_UNDEFINED,
+		.stencilAttachmentFormat = desc.hasDepth && hasStencilComponent(desc.depthFormat) ? desc.depthFormat : VK_FORMAT_UNDEFINED,
+	};
+
+	if (desc.renderPass == VK_NULL_HANDLE) {
+		pipelineInfo.pNext = &renderingInfo;
+	}
+	else {
+		// Multisampled variants only exist for passes that have an MSAA render pass
+		pipelineInfo.renderPass = state.samples != VK_SAMPLE_COUNT_1_BIT ? desc.renderPassMsaa : desc.renderPass;
+		pipelineInfo.subpass = 0;
+	}
 
 	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
 	pipelineInfo.basePipelineIndex = -1; // Optional
 
-	if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &out_pipeline.graphicsPipeline) != VK_SUCCESS) {
+	if (vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &out.pipeline) != VK_SUCCESS) {
 		throw std::runtime_error("failed to create graphics pipeline!");
 	}
+}
 
-	if (desc.renderPassMsaa != VK_NULL_HANDLE) {
-		multisampling.rasterizationSamples = msaaSamples;
-		pipelineInfo.renderPass = desc.renderPassMsaa;
-		if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &out_pipeline.graphicsPipelineMsaa) != VK_SUCCESS) {
-			throw std::runtime_error("failed to create graphics pipeline!");
-		}
+Pipeline Device::createPipeline(PipelineDesc desc)
+{
+	Pipeline out_pipeline;
+
+	size_t setCount = desc.bindings.size();
+
+	std::vector<VkDescriptorSetLayout> setLayouts;
+	for (int i = 0; i < setCount; i++)
+	{
+		setLayouts.push_back(createDescriptorSetLayout(desc.bindings[i].data(), desc.bindings[i].size()));
+	}
+
+	std::vector<VkPushConstantRange> pushConstantsRanges;
+
+	for (auto& range : desc.pushConstantsRanges)
+	{
+		pushConstantsRanges.push_back(createPushConstantRange(range));
 	}
 
-	vkDestroyShaderModule(device, fragShaderModule, nullptr);
-	vkDestroyShaderModule(device, vertShaderModule, nullptr);
+	// The bindless layout belongs to the device, it must not end up in descriptorSetLayouts or it would be destroyed with the pipeline
+	std::vector<VkDescriptorSetLayout> pipelineSetLayouts = setLayouts;
+	if (desc.useBindlessTextures) {
+		out_pipeline.bindlessSet = pipelineSetLayouts.size();
+		pipelineSetLayouts.push_back(bindlessSetLayout);
+	}
 
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = pipelineSetLayouts.size(); // Optional
+	pipelineLayoutInfo.pSetLayouts = pipelineSetLayouts.data();
+	pipelineLayoutInfo.pushConstantRangeCount = pushConstantsRanges.size(); // Optional
+	pipelineLayoutInfo.pPushConstantRanges = pushConstantsRanges.data(); // Optional
+
+	VkPipelineLayout out_pipelineLayout;
+	if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &out_pipelineLayout) != VK_SUCCESS) {
+		throw std::runtime_error("failed to create pipeline layout!");
+	}
+
+	// Variants are compiled from this later on, the vertex input descriptions usually live on the caller's stack so keep a copy
+	auto variants = std::make_shared<PipelineVariants>();
+	variants->vertexBindings.assign(desc.bindingDescription, desc.bindingDescription + (desc.bindingDescription ? 1 : 0));
+	variants->vertexAttributes.assign(desc.attributeDescriptions, desc.attributeDescriptions + desc.attributeDescriptionsCount);
+	variants->desc = desc;
+	variants->desc.bindingDescription = variants->vertexBindings.empty() ? nullptr : variants->vertexBindings.data();
+	variants->desc.attributeDescriptions = variants->vertexAttributes.data();
+	variants->desc.bindings.clear();
+	variants->extent = swapChainExtent;
 
 	out_pipeline.descriptorSetLayouts = setLayouts;
 	out_pipeline.renderPass = desc.renderPass;
 	out_pipeline.renderPassMsaa = desc.renderPassMsaa;
 	out_pipeline.pipelineLayout = out_pipelineLayout;
-
-	if (desc.bindings.size() > 0)
-		out_pipeline.descriptorPool = createDescriptorPool(desc.bindings[0].data(), desc.bindings[0].size()); //TODO: reconsider this
-	else
-		out_pipeline.descriptorPool = createDescriptorPool(nullptr, 0); //TODO: reconsider this
-
-	out_pipeline.descriptorSets.resize(MAX_FRAMES_IN_FLIGHT);
+	out_pipeline.defaultState = {
+		.samples = VK_SAMPLE_COUNT_1_BIT,
+		.blendMode = desc.blendMode,
+		.cullMode = desc.cullMode,
+		.depthCompareOp = desc.depthCompareOp,
+		.depthWrite = desc.blendMode == BlendMode::Opaque,
+	};
+	if (desc.specializationConstants.size() > PipelineState::MaxSpecializationConstants)
+		throw std::runtime_error("too many specialization constants!");
+	out_pipeline.defaultState.specializationCount = desc.specializationConstants.size();
+	std::copy(desc.specializationConstants.begin(), desc.specializationConstants.end(), out_pipeline.defaultState.specialization.begin());
+	out_pipeline.variants = variants;
+
+	// Only the variant matching the current MSAA setting is started, the other one waits for a toggle
+	PipelineState state = out_pipeline.defaultState;
+	if (usesMsaa && desc.writeSwapChain)
+		state.samples = msaaSamples;
+	requestPipelineVariant(out_pipeline, state);
+
+	out_pipeline.descriptorSets.resize(maxFramesInFlight);
 	out_pipeline.bindings = std::move(desc.bindings);
 
 	return out_pipeline;
 }
 
 
-Pipeline Device::createComputePipeline(PipelineDesc desc)
+void Device::compileComputePipeline(const PipelineDesc& desc, VkPipelineLayout pipelineLayout, PipelineVariant& out)
 {
-	Pipeline out_pipeline;
-
-	auto computeShaderCode = readFile(baseShaderPath + desc.computeShader);
-
-	VkShaderModule computeShaderModule = createShaderModule(computeShaderCode);
+	VkShaderModule computeShaderModule = acquireShaderModule(desc.computeShader);
+	out.shaderModules.push_back(computeShaderModule);
 
 	VkPipelineShaderStageCreateInfo computeShaderStageInfo{};
 	computeShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -558,6 +602,20 @@ Pipeline Device::createComputePipeline(PipelineDesc desc)
 	computeShaderStageInfo.module = computeShaderModule;
 	computeShaderStageInfo.pName = "main";
 
+	VkComputePipelineCreateInfo pipelineInfo{};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.layout = pipelineLayout;
+	pipelineInfo.stage = computeShaderStageInfo;
+
+
+	if (vkCreateComputePipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &out.pipeline) != VK_SUCCESS) {
+		throw std::runtime_error("failed to create compute pipeline!");
+	}
+}
+
+Pipeline Device::createComputePipeline(PipelineDesc desc)
+{
+	Pipeline out_pipeline;
 
 	std::vector<VkDescriptorSetLayout> setLayouts;
 	for (auto& bindingSet : desc.bindings)
@@ -583,32 +641,22 @@ Pipeline Device::createComputePipeline(PipelineDesc desc)
 		throw std::runtime_error("failed to create pipeline layout!");
 	}
 
- 
-	VkComputePipelineCreateInfo pipelineInfo{};
-	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
-	pipelineInfo.layout = computePipelineLayout;
-	pipelineInfo.stage = computeShaderStageInfo;
-
-
-	if (vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &out_pipeline.graphicsPipeline) != VK_SUCCESS) {
-		throw std::runtime_error("failed to create compute pipeline!");
-	}
-
-	vkDestroyShaderModule(device, computeShaderModule, nullptr);
-
+	auto variants = std::make_shared<PipelineVariants>();
+	variants->desc = desc;
+	variants->desc.type = PipelineType::Compute;
+	variants->desc.bindings.clear();
 
 	out_pipeline.renderPass = VK_NULL_HANDLE;
 	out_pipeline.renderPassMsaa = VK_NULL_HANDLE;
-	out_pipeline.graphicsPipelineMsaa = VK_NULL_HANDLE;
 
 	out_pipeline.descriptorSetLayouts = setLayouts;
 	out_pipeline.pipelineLayout = computePipelineLayout;
-	if (desc.bindings.size() > 0)
-		out_pipeline.descriptorPool = createDescriptorPool(desc.bindings[0].data(), desc.bindings[0].size()); //TODO: reconsider this
-	else
-		out_pipeline.descriptorPool = createDescriptorPool(nullptr, 0); //TODO: reconsider this
+	out_pipeline.variants = variants;
+
+	// Compute has no state to vary, the default variant is the only one
+	requestPipelineVariant(out_pipeline, out_pipeline.defaultState);
 
-	out_pipeline.descriptorSets.resize(MAX_FRAMES_IN_FLIGHT);
+	out_pipeline.descriptorSets.resize(maxFramesInFlight);
 	out_pipeline.bindings = std::move(desc.bindings);
 
 	return out_pipeline;
@@ -617,23 +665,31 @@ Pipeline Device::createComputePipeline(PipelineDesc desc)
 
 RenderPass Device::createRenderPassAndPipeline(RenderPassDesc renderPassDesc, PipelineDesc pipelineDesc)
 {
-	renderPassDesc.useMsaa = false;
-	VkRenderPass renderpass = createRenderPass(renderPassDesc);
-	renderPassDesc.useMsaa = true;
-	VkRenderPass renderpassMsaa = renderPassDesc.writeSwapChain ? createRenderPass(renderPassDesc) : VK_NULL_HANDLE;
+	// Dynamic rendering needs no render pass nor framebuffer, only the attachments which are given at record time
+	VkRenderPass renderpass = VK_NULL_HANDLE;
+	VkRenderPass renderpassMsaa = VK_NULL_HANDLE;
+	if (!dynamicRendering) {
+		renderPassDesc.useMsaa = false;
+		renderpass = createRenderPass(renderPassDesc);
+		renderPassDesc.useMsaa = true;
+		renderpassMsaa = renderPassDesc.writeSwapChain ? createRenderPass(renderPassDesc) : VK_NULL_HANDLE;
+	}
 
 	unsigned int colorAttachment_count = std::max(renderPassDesc.framebufferDesc.images.size(), (size_t)renderPassDesc.colorAttachement_count);
 
 	pipelineDesc.renderPass = renderpass;
 	pipelineDesc.renderPassMsaa = renderpassMsaa;
-	//pipelineDesc.useMsaa = renderPassDesc.useMsaa;
+	// Render targets are all created with these
+	pipelineDesc.colorFormat = swapChainImageFormat;
+	pipelineDesc.depthFormat = findDepthFormat();
+	pipelineDesc.writeSwapChain = renderPassDesc.writeSwapChain;
 	pipelineDesc.hasDepth = renderPassDesc.hasDepth;
-	pipelineDesc.attachmentCount = std::max(renderPassDesc.framebufferDesc.images.size(), (size_t)1);
+	pipelineDesc.attachmentCount = colorAttachment_count;
 	pipelineDesc.extent = { renderPassDesc.framebufferDesc.width, renderPassDesc.framebufferDesc.height };
 	Pipeline pipeline = createPipeline(pipelineDesc);
 
 	VkFramebuffer framebuffer = VK_NULL_HANDLE;
-	if (renderPassDesc.framebufferDesc.images.size() > 0 || renderPassDesc.framebufferDesc.depth != nullptr)
+	if (!dynamicRendering && (renderPassDesc.framebufferDesc.images.size() > 0 || renderPassDesc.framebufferDesc.depth != nullptr))
 	{
 
 		auto& images = renderPassDesc.framebufferDesc.images;
@@ -666,7 +722,8 @@ RenderPass Device::createRenderPassAndPipeline(RenderPassDesc renderPassDesc, Pi
 	};
 	memcpy(markerInfo.color, debug_colors[(int)renderPassDesc.debugInfo.color], sizeof(markerInfo.color));
 
-	SetRenderPassName(renderpass, renderPassDesc.debugInfo.name);
+	if (renderpass != VK_NULL_HANDLE)
+		SetRenderPassName(renderpass, renderPassDesc.debugInfo.name);
 
 	if (renderpassMsaa != VK_NULL_HANDLE)
 		SetRenderPassName(renderpassMsaa, renderPassDesc.debugInfo.name);
@@ -676,11 +733,19 @@ RenderPass Device::createRenderPassAndPipeline(RenderPassDesc renderPassDesc, Pi
 		.renderPassMsaa = renderpassMsaa,
 		.colorAttachement_count = colorAttachment_count,
 		.hasDepth = renderPassDesc.hasDepth,
+		.doClear = renderPassDesc.doClear,
+		.writeSwapChain = renderPassDesc.writeSwapChain,
 		.pipeline = pipeline,
 		.framebuffer = framebuffer,
 		.extent = { renderPassDesc.framebufferDesc.width, renderPassDesc.framebufferDesc.height },
+		.colorImages = renderPassDesc.framebufferDesc.images,
+		.depthImage = renderPassDesc.hasDepth ? renderPassDesc.framebufferDesc.depth : nullptr,
+		.layers = renderPassDesc.framebufferDesc.layers,
 		.postDrawBarriers = renderPassDesc.postDrawBarriers,
 		.draw = renderPassDesc.drawFunction,
+		.drawCount = renderPassDesc.drawCountFunction,
+		.drawRange = renderPassDesc.drawRangeFunction,
+		.cachedCommands = renderPassDesc.cacheCommands ? std::make_shared<std::vector<CachedPassCommands>>(maxFramesInFlight) : nullptr,
 		.markerInfo = markerInfo,
 	};
 }
@@ -699,64 +764,55 @@ ComputePass Device::createComputePass(ComputePassDesc computePassDesc, PipelineD
 		.pipeline = pipeline,
 		.dispatch = computePassDesc.dispatchFunction,
 		.markerInfo = markerInfo,
+		.async = computePassDesc.async,
 	};
 }
 
 
 void Device::bindVertexBuffer(Buffer& buffer)
 {
-	VkCommandBuffer commandBuffer = commandBuffers[current_frame];
-
-	VkBuffer vertexBuffers[] = { buffer.buffer };
-	VkDeviceSize offsets[] = { 0 };
-	vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+	stateTracker().bindVertexBuffer(buffer.buffer, 0);
 }
 
 void Device::bindTexture(const GpuImage& image, VkSampler sampler)
 {
-	VkCommandBuffer commandBuffer = commandBuffers[current_frame];
-
-	VkDescriptorPool descriptorPool = currentPipeline->descriptorPool;
 	VkDescriptorSetLayout descriptorSetLayout = currentPipeline->descriptorSetLayouts[0];
 
 	std::hash<VkImage> hasher;
 	size_t hash = 0;
 	hash_combine(hash, hasher(image.image));
 
-	if (currentPipeline->descriptorSetsMap.contains(hash))
-	{
-		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, currentPipeline->pipelineLayout, 0, 1, &currentPipeline->descriptorSetsMap[hash], 0, nullptr);
-		return;
-	}
-	else {
-		VkDescriptorSet descriptorSet;
-		createDescriptorSets(descriptorSetLayout, descriptorPool, &descriptorSet, 1);
-		
-			//updateDescriptorSet(image.view, sampler, descriptorSet);
-
-			VkDescriptorImageInfo imageInfo{ };
-			imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-			imageInfo.imageView = image.view;
-			imageInfo.sampler = sampler;
-
-			VkWriteDescriptorSet descriptorWrite{};
-
-			descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			descriptorWrite.dstSet = descriptorSet;
-			descriptorWrite.dstBinding = 0;
-			descriptorWrite.dstArrayElement = 0;
-			descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-			descriptorWrite.descriptorCount = 1;
-			descriptorWrite.pBufferInfo = nullptr;
-			descriptorWrite.pImageInfo = &imageInfo; // Optional
-			descriptorWrite.pTexelBufferView = nullptr; // Optional
-
-			vkUpdateDescriptorSets(device, 1, &descriptorWrite, 0, nullptr);
-		
-		currentPipeline->descriptorSetsMap[hash] = descriptorSet;
-		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, currentPipeline->pipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
+	std::lock_guard<std::mutex> lock(descriptorMutex);
+	bool created;
+	VkDescriptorSet descriptorSet = descriptorCache.get(descriptorSetLayout, hash, created);
+	trackDescriptorSet(descriptorSetLayout, hash);
+
+	if (created) {
+
+		//updateDescriptorSet(image.view, sampler, descriptorSet);
+
+		VkDescriptorImageInfo imageInfo{ };
+		imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		imageInfo.imageView = image.view;
+		imageInfo.sampler = sampler;
+
+		VkWriteDescriptorSet descriptorWrite{};
+
+		descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		descriptorWrite.dstSet = descriptorSet;
+		descriptorWrite.dstBinding = 0;
+		descriptorWrite.dstArrayElement = 0;
+		descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		descriptorWrite.descriptorCount = 1;
+		descriptorWrite.pBufferInfo = nullptr;
+		descriptorWrite.pImageInfo = &imageInfo; // Optional
+		descriptorWrite.pTexelBufferView = nullptr; // Optional
+
+		vkUpdateDescriptorSets(device, 1, &descriptorWrite, 0, nullptr);
 	}
 
+	stateTracker().bindDescriptorSet(VK_PIPELINE_BIND_POINT_GRAPHICS, currentPipeline->pipelineLayout, 0, descriptorSet);
+
 	//std::hash<T> hasher;
 	//glm::detail::hash_combine(seed, hasher(v));
 
@@ -766,23 +822,18 @@ void Device::bindTexture(const GpuImage& image, VkSampler sampler)
 
 void Device::bindBuffer(const Buffer& buffer, uint32_t set, uint32_t binding)
 {
-	VkCommandBuffer commandBuffer = commandBuffers[current_frame];
-
-	VkDescriptorPool descriptorPool = currentPipeline->descriptorPool;
 	VkDescriptorSetLayout descriptorSetLayout = currentPipeline->descriptorSetLayouts[set];
 
 	std::hash<VkBuffer> hasher;
 	size_t hash = 0;
 	hash_combine(hash, hasher(buffer.buffer));
 
-	if (currentPipeline->descriptorSetsMap.contains(hash))
-	{
-		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, currentPipeline->pipelineLayout, set, 1, &currentPipeline->descriptorSetsMap[hash], 0, nullptr);
-		return;
-	}
-	else {
-		VkDescriptorSet descriptorSet;
-		createDescriptorSets(descriptorSetLayout, descriptorPool, &descriptorSet, 1);
+	std::lock_guard<std::mutex> lock(descriptorMutex);
+	bool created;
+	VkDescriptorSet descriptorSet = descriptorCache.get(descriptorSetLayout, hash, created);
+	trackDescriptorSet(descriptorSetLayout, hash);
+
+	if (created) {
 
 		//updateDescriptorSet(image.view, sampler, descriptorSet);
 
@@ -801,18 +852,14 @@ void Device::bindBuffer(const Buffer& buffer, uint32_t set, uint32_t binding)
 		descriptorWrite.pTexelBufferView = nullptr; // Optional
 
 		vkUpdateDescriptorSets(device, 1, &descriptorWrite, 0, nullptr);
-
-		currentPipeline->descriptorSetsMap[hash] = descriptorSet;
-		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, currentPipeline->pipelineLayout, set, 1, &descriptorSet, 0, nullptr);
 	}
 
+	stateTracker().bindDescriptorSet(VK_PIPELINE_BIND_POINT_GRAPHICS, currentPipeline->pipelineLayout, set, descriptorSet);
+
 }
 
 void Device::bindRessources(uint32_t set, std::vector<const Buffer*> buffers, std::vector<ImageBindInfo> images, PipelineType binding_point)
 {
-	VkCommandBuffer commandBuffer = binding_point == PipelineType::Graphics ? commandBuffers[current_frame] : computeCommandBuffers[current_frame];
-
-	VkDescriptorPool descriptorPool = currentPipeline->descriptorPool;
 	VkDescriptorSetLayout descriptorSetLayout = currentPipeline->descriptorSetLayouts[set];
 	std::vector<BindingDesc>& bindings = currentPipeline->bindings[set];
 
@@ -846,14 +893,13 @@ void Device::bindRessources(uint32_t set, std::vector<const Buffer*> buffers, st
 
 	VkPipelineBindPoint vkBindingPoint = binding_point == PipelineType::Graphics ? VK_PIPELINE_BIND_POINT_GRAPHICS : VK_PIPELINE_BIND_POINT_COMPUTE;
 
-	if (currentPipeline->descriptorSetsMap.contains(hash))
-	{
-		vkCmdBindDescriptorSets(commandBuffer, vkBindingPoint, currentPipeline->pipelineLayout, set, 1, &currentPipeline->descriptorSetsMap[hash], 0, nullptr);
-	}
-	else {
-		VkDescriptorSet descriptorSet;
-		createDescriptorSets(descriptorSetLayout, descriptorPool, &descriptorSet, 1);
+	std::unique_lock<std::mutex> lock(descriptorMutex);
+	bool created;
+	VkDescriptorSet descriptorSet = descriptorCache.get(descriptorSetLayout, hash, created);
+	trackDescriptorSet(descriptorSetLayout, hash);
 
+	// New or recycled set, every binding gets written
+	if (created) {
 		std::vector<VkDescriptorImageInfo> descriptorImageInfos;
 		std::vector<VkDescriptorBufferInfo> descriptorBufferInfos;
 		descriptorImageInfos.reserve(images.size());
@@ -865,9 +911,20 @@ void Device::bindRessources(uint32_t set, std::vector<const Buffer*> buffers, st
 		//auto descriptorBufferInfos = buffers | std::views::transform([&](const Buffer* buff) { return getDescriptorBufferInfo(*buff); });
 
 		updateDescriptorSet(bindings, descriptorImageInfos, descriptorBufferInfos, descriptorSet);
-		currentPipeline->descriptorSetsMap[hash] = descriptorSet;
-		vkCmdBindDescriptorSets(commandBuffer, vkBindingPoint, currentPipeline->pipelineLayout, set, 1, &descriptorSet, 0, nullptr);
 	}
+	lock.unlock();
+
+	stateTracker(binding_point).bindDescriptorSet(vkBindingPoint, currentPipeline->pipelineLayout, set, descriptorSet);
+}
+
+void Device::bindBindlessTable(PipelineType binding_point)
+{
+	VkPipelineBindPoint vkBindingPoint = binding_point == PipelineType::Graphics ? VK_PIPELINE_BIND_POINT_GRAPHICS : VK_PIPELINE_BIND_POINT_COMPUTE;
+
+	if (currentPipeline->bindlessSet == UINT32_MAX)
+		throw std::runtime_error("failed to bind bindless table : pipeline was not created with useBindlessTextures");
+
+	stateTracker(binding_point).bindDescriptorSet(vkBindingPoint, currentPipeline->pipelineLayout, currentPipeline->bindlessSet, bindlessSet);
 }
 
 void Device::transitionImage(BarrierDesc desc, PipelineType pipeline_type)
@@ -883,7 +940,7 @@ void Device::transitionImage(BarrierDesc desc, PipelineType pipeline_type)
 		VK_IMAGE_LAYOUT_PRESENT_SRC_KHR
 	};
 
-	VkCommandBuffer commandBuffer = pipeline_type == PipelineType::Graphics ? commandBuffers[current_frame] : computeCommandBuffers[current_frame];
+	VkCommandBuffer commandBuffer = pipeline_type == PipelineType::Graphics ? commandBuffers[current_frame] : computeState.getCommandBuffer();
 
 	// TODO take care of the format
 	transitionImageLayout(desc.image->image, VK_FORMAT_R8G8B8A8_SRGB, layoutMap[desc.oldLayout], layoutMap[desc.newLayout], desc.mipLevels, desc.layerCount, commandBuffer);
@@ -898,7 +955,8 @@ void Device::generateMipmaps(GpuImage& image, PipelineType pipeline_type)
 		uint32_t mipLevels = image.mipLevels;
 		uint32_t layerCount = image.layerCount;
 
-		VkCommandBuffer commandBuffer = computeCommandBuffers[current_frame];
+		// Blits need a graphics queue, not for async passes
+		VkCommandBuffer commandBuffer = computeState.getCommandBuffer();
 
 		for (uint32_t i = 1; i < mipLevels; i++)
 		{
@@ -936,98 +994,307 @@ void Device::generateMipmaps(GpuImage& image, PipelineType pipeline_type)
 
 void Device::drawCommand(uint32_t vertex_count)
 {
-	VkCommandBuffer commandBuffer = commandBuffers[current_frame];
+	VkCommandBuffer commandBuffer = graphicsCommandBuffer();
 
 	vkCmdDraw(commandBuffer, vertex_count, 1, 0, 0);
 }
 
-void Device::pushConstants(const void* data, uint32_t offset, uint32_t size, StageFlags stageFlags, VkPipelineLayout pipelineLayout)
+void Device::drawIndirect(const IndirectDrawBuffer& draws)
 {
+	VkCommandBuffer commandBuffer = graphicsCommandBuffer();
+	const Buffer& commands = draws.commands[current_frame];
+	const uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+
+	if (draws.gpuWritten && !usesIndirectDrawCount())
+		throw std::runtime_error("failed to draw indirect : count of GPU written draws can't be read without drawIndirectCount");
 
-	VkCommandBuffer commandBuffer = stageFlags & e_Compute ? computeCommandBuffers[current_frame]:commandBuffers[current_frame];
+	if (usesIndirectDrawCount()) {
+		vkCmdDrawIndexedIndirectCount(commandBuffer, commands.buffer, IndirectDrawBuffer::IndirectCommandsOffset, commands.buffer, 0, draws.capacity, stride);
+	}
+	else if (indirectDraws) {
+		vkCmdDrawIndexedIndirect(commandBuffer, commands.buffer, IndirectDrawBuffer::IndirectCommandsOffset, draws.counts[current_frame], stride);
+	}
+	else {
+		// Same draws issued from the CPU copy, firstInstance works on direct draws without any feature
+		const uint8_t* mapped = static_cast<const uint8_t*>(commands.mapped_memory) + IndirectDrawBuffer::IndirectCommandsOffset;
+		for (uint32_t i = 0; i < draws.counts[current_frame]; i++)
+		{
+			VkDrawIndexedIndirectCommand command;
+			memcpy(&command, mapped + size_t(i) * stride, stride);
+			vkCmdDrawIndexed(commandBuffer, command.indexCount, command.instanceCount, command.firstIndex, command.vertexOffset, command.firstInstance);
+		}
+	}
+}
 
+void Device::pushConstants(const void* data, uint32_t offset, uint32_t size, StageFlags stageFlags, VkPipelineLayout pipelineLayout)
+{
 	VkPipelineLayout layout = (pipelineLayout == VK_NULL_HANDLE) ? currentPipeline->pipelineLayout : pipelineLayout;
 
-	vkCmdPushConstants(commandBuffer, layout, getVkStageFlags(stageFlags), offset, size, data);
+	stateTracker(stageFlags & e_Compute ? PipelineType::Compute : PipelineType::Graphics).pushConstants(layout, getVkStageFlags(stageFlags), offset, size, data);
 }
 
-void Device::drawPacket(const MeshPacket& packet)
+void Device::drawPacket(const MeshPacket& packet, uint32_t firstInstance, uint32_t instanceCount)
 {
 
-	VkCommandBuffer commandBuffer = commandBuffers[current_frame];
+	VkCommandBuffer commandBuffer = graphicsCommandBuffer();
 
-	{
-		vkCmdPushConstants(commandBuffer, currentPipeline->pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(MeshPacket::PushConstantsData), &packet.transform);
-	}
+	//Actual draw ! The geometry heap is already bound by recordRenderPass
+	const MeshGeometry& geometry = *packet.geometry;
+	if (geometry.indexCount > 0)
+		vkCmdDrawIndexed(commandBuffer, geometry.indexCount, instanceCount, geometry.firstIndex, static_cast<int32_t>(geometry.vertexOffset), firstInstance);
+	else
+		vkCmdDraw(commandBuffer, geometry.vertexCount, instanceCount, geometry.vertexOffset, firstInstance);
+}
 
-	{
-		VkBuffer vertexBuffers[] = { packet.vertexBuffer->buffer };
-		VkDeviceSize offsets[] = { 0 };
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
 
-		if (packet.indexBuffer->buffer != 0)
-			vkCmdBindIndexBuffer(commandBuffer, packet.indexBuffer->buffer, 0, VK_INDEX_TYPE_UINT32);
+std::shared_ptr<PipelineVariant> Device::requestPipelineVariant(const Pipeline& pipeline, const PipelineState& state)
+{
+	if (!pipeline.variants)
+		return nullptr;
+
+	const PipelineState key = state.variantKey(pipeline.variants->desc.dynamicStates);
+	std::lock_guard<std::mutex> lock(pipeline.variants->mutex);
+	auto& variant = pipeline.variants->compiled[key];
+	if (variant)
+		return variant;
+
+	// Compiled on a worker, whoever needs it first waits in getPipelineVariant
+	variant = std::make_shared<PipelineVariant>();
+	variant->done = pipelineWorkers.submit([this, variants = pipeline.variants, variant, state = key, layout = pipeline.pipelineLayout]() {
+		if (variants->desc.type == PipelineType::Compute)
+			compileComputePipeline(variants->desc, layout, *variant);
+		else
+			compileGraphicsPipeline(variants->desc, state, layout, variants->extent, *variant);
+	});
+
+	return variant;
+}
 
-	}
+VkPipeline Device::getPipelineVariant(const Pipeline& pipeline, const PipelineState& state)
+{
+	std::shared_ptr<PipelineVariant> variant = requestPipelineVariant(pipeline, state);
 
-	//Actual draw !
-	if (packet.indexBuffer->buffer != 0)
-		vkCmdDrawIndexed(commandBuffer, packet.indexBuffer->count, 1, 0, 0, 0);
-	else
-		vkCmdDraw(commandBuffer, packet.vertexBuffer->count, 1, 0, 0);
+	// Rethrows whatever the compile job threw
+	variant->done.get();
+	return variant->pipeline;
 }
 
+PipelineState Device::getRenderPassState(const RenderPass& renderPass, bool msaa)
+{
+	PipelineState state = renderPass.pipeline.defaultState;
+	if (msaa && renderPass.writeSwapChain)
+		state.samples = msaaSamples;
+
+	return state;
+}
+
+void Device::setSpecializationConstants(RenderPass& renderPass, const std::vector<uint32_t>& values)
+{
+	PipelineState& state = renderPass.pipeline.defaultState;
+	if (values.size() > PipelineState::MaxSpecializationConstants)
+		throw std::runtime_error("too many specialization constants!");
+
+	state.specializationCount = values.size();
+	std::copy(values.begin(), values.end(), state.specialization.begin());
+
+	// Already compiled permutations are reused, a new one starts compiling now and the next record waits for it
+	requestPipelineVariant(renderPass.pipeline, getRenderPassState(renderPass, this->usesMsaa));
+}
+
+const PipelineState& Device::getCurrentPipelineState()
+{
+	return t_secondary.commandBuffer != VK_NULL_HANDLE ? t_secondary.state : currentPipelineState;
+}
+
+void Device::setDynamicPipelineState(VkCommandBuffer commandBuffer, const Pipeline& pipeline, const PipelineState& state)
+{
+	const PipelineDesc& desc = pipeline.variants->desc;
+
+	if (desc.dynamicStates & e_DynamicCullMode)
+		vkCmdSetCullMode(commandBuffer, getVkCullMode(state.cullMode));
+	if (desc.hasDepth && (desc.dynamicStates & e_DynamicDepthCompare))
+		vkCmdSetDepthCompareOp(commandBuffer, static_cast<VkCompareOp>(state.depthCompareOp));
+	if (desc.hasDepth && (desc.dynamicStates & e_DynamicDepthWrite))
+		vkCmdSetDepthWriteEnable(commandBuffer, state.depthWrite);
+}
 
 void Device::destroyPipeline(const Pipeline& pipeline)
 {
+	if (pipeline.variants) {
+		for (auto& [state, variant] : pipeline.variants->compiled)
+		{
+			// Might never have been used, the job may still be running
+			variant->done.wait();
+
+			for (VkShaderModule module : variant->shaderModules)
+			{
+				shaderCache.release(module);
+			}
+
+			if (variant->pipeline)
+				vkDestroyPipeline(device, variant->pipeline, nullptr);
+		}
+
+		pipeline.variants->compiled.clear();
+	}
+
 	for (const auto setLayout : pipeline.descriptorSetLayouts)
 	{
+		descriptorCache.releaseLayout(setLayout);
 		vkDestroyDescriptorSetLayout(device, setLayout, nullptr);
 	}
 
-	vkDestroyPipeline(device, pipeline.graphicsPipeline, nullptr);
-
-	if(pipeline.graphicsPipelineMsaa)
-		vkDestroyPipeline(device, pipeline.graphicsPipelineMsaa, nullptr);
-
 	vkDestroyPipelineLayout(device, pipeline.pipelineLayout, nullptr);
-	if(pipeline.descriptorPool)
-		vkDestroyDescriptorPool(device, pipeline.descriptorPool, nullptr);
 }
 
 
 void Device::destroyRenderPass(const RenderPass& renderPass)
 {
-	if (renderPass.renderPass)
+	if (renderPass.pipeline.variants)
 	{
-		vkDestroyRenderPass(device, renderPass.renderPass, nullptr);
+		if (renderPass.framebuffer != VK_NULL_HANDLE)
+			vkDestroyFramebuffer(device, renderPass.framebuffer, nullptr);
+		if (renderPass.renderPass != VK_NULL_HANDLE)
+			vkDestroyRenderPass(device, renderPass.renderPass, nullptr);
 		if (renderPass.renderPassMsaa != VK_NULL_HANDLE)
 			vkDestroyRenderPass(device, renderPass.renderPassMsaa, nullptr);
 
 		destroyPipeline(renderPass.pipeline);
 	}
+
+	if (renderPass.cachedCommands)
+	{
+		for (const CachedPassCommands& cached : *renderPass.cachedCommands)
+		{
+			if (cached.commandBuffer != VK_NULL_HANDLE)
+				vkFreeCommandBuffers(device, cachedCommandPool, 1, &cached.commandBuffer);
+		}
+		renderPass.cachedCommands->clear();
+	}
 }
 
 void Device::destroyComputePass(const ComputePass& computePass)
 {
+	if (!computePass.pipeline.descriptorSetLayouts.empty() && computePass.pipeline.descriptorSetLayouts[0] == computeDescriptorSetLayout)
+		destroyComputeDescriptorSets();
+
 	destroyPipeline(computePass.pipeline);
 }
 
-void Device::recordRenderPass(VkCommandBuffer commandBuffer, RenderPass& renderPass)
+static VkImageMemoryBarrier attachmentBarrier(VkImage image, VkImageAspectFlags aspect, uint32_t layers, VkImageLayout oldLayout, VkImageLayout newLayout)
 {
-	PushCmdLabel(commandBuffer, &renderPass.markerInfo);
-	currentPipeline = &renderPass.pipeline;
+	// Also orders the writes of the previous pass drawing to the same attachment
+	const bool isDepth = (aspect & VK_IMAGE_ASPECT_DEPTH_BIT) != 0;
+	const VkAccessFlags writeAccess = isDepth ? VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT : VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	const VkAccessFlags readAccess = isDepth ? VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT : VK_ACCESS_COLOR_ATTACHMENT_READ_BIT;
 
-	VkExtent2D extent = renderPass.framebuffer != VK_NULL_HANDLE ? renderPass.extent : swapChainExtent;
+	return {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+		.srcAccessMask = oldLayout == VK_IMAGE_LAYOUT_UNDEFINED ? 0u : writeAccess,
+		.dstAccessMask = newLayout == VK_IMAGE_LAYOUT_PRESENT_SRC_KHR ? 0u : readAccess | writeAccess,
+		.oldLayout = oldLayout,
+		.newLayout = newLayout,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.image = image,
+		.subresourceRange = { aspect, 0, 1, 0, layers },
+	};
+}
 
-	VkRenderPassBeginInfo renderPassInfo{};
-	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-	renderPassInfo.renderPass = this->usesMsaa? renderPass.renderPassMsaa:  renderPass.renderPass;
-	renderPassInfo.framebuffer = renderPass.framebuffer != VK_NULL_HANDLE ? renderPass.framebuffer : swapChainFramebuffers[current_framebuffer_idx];
-	renderPassInfo.renderArea.offset = { 0, 0 };
-	renderPassInfo.renderArea.extent = extent;
+void Device::beginRendering(VkCommandBuffer commandBuffer, const RenderPass& renderPass, const PipelineState& state, VkExtent2D extent, VkRenderingFlags flags)
+{
+	const bool toSwapChain = renderPass.colorImages.empty() && renderPass.depthImage == nullptr;
+	const bool msaa = state.samples != VK_SAMPLE_COUNT_1_BIT;
+	const VkAttachmentLoadOp loadOp = renderPass.doClear ? VK_ATTACHMENT_LOAD_OP_CLEAR : VK_ATTACHMENT_LOAD_OP_LOAD;
 
+	// Same layouts the render pass objects leave the attachments in, ImGui still draws with one after us
+	const VkImageLayout colorLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+	const VkImageLayout depthLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
 
+	std::vector<VkImageMemoryBarrier> barriers;
+	std::vector<VkRenderingAttachmentInfo> colorAttachments(renderPass.colorAttachement_count);
+	for (uint32_t i = 0; i < renderPass.colorAttachement_count; i++)
+	{
+		VkRenderingAttachmentInfo& attachment = colorAttachments[i];
+		attachment = {
+			.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+			.imageLayout = colorLayout,
+			.loadOp = loadOp,
+			.storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+			.clearValue = {.color = { 0.0f, 0.0f, 0.0f, 1.0f } },
+		};
+
+		if (!toSwapChain) {
+			attachment.imageView = renderPass.colorImages[i]->view;
+			barriers.push_back(attachmentBarrier(renderPass.colorImages[i]->image, VK_IMAGE_ASPECT_COLOR_BIT, renderPass.layers, renderPass.doClear ? VK_IMAGE_LAYOUT_UNDEFINED : colorLayout, colorLayout));
+			continue;
+		}
+
+		// Multisampled passes draw in colorTarget and resolve in the swapchain image at the end of each pass
+		VkImageLayout swapChainOldLayout = renderPass.doClear || msaa ? VK_IMAGE_LAYOUT_UNDEFINED : swapChainImageLayout;
+		if (msaa) {
+			attachment.imageView = colorTarget.view;
+			attachment.resolveMode = VK_RESOLVE_MODE_AVERAGE_BIT;
+			attachment.resolveImageView = swapChainImageViews[current_framebuffer_idx];
+			attachment.resolveImageLayout = colorLayout;
+			barriers.push_back(attachmentBarrier(colorTarget.image, VK_IMAGE_ASPECT_COLOR_BIT, 1, renderPass.doClear ? VK_IMAGE_LAYOUT_UNDEFINED : colorLayout, colorLayout));
+		}
+		else {
+			attachment.imageView = swapChainImageViews[current_framebuffer_idx];
+		}
+		barriers.push_back(attachmentBarrier(swapChainImages[current_framebuffer_idx], VK_IMAGE_ASPECT_COLOR_BIT, 1, swapChainOldLayout, colorLayout));
+		swapChainImageLayout = colorLayout;
+	}
+
+	// The depth buffer format may have a stencil part, it's then bound and transitioned along with the depth
+	const VkFormat depthFormat = renderPass.pipeline.variants->desc.depthFormat;
+	const bool hasStencil = renderPass.hasDepth && hasStencilComponent(depthFormat);
+	VkRenderingAttachmentInfo depthAttachment{};
+	if (renderPass.hasDepth)
+	{
+		const GpuImage& depth = toSwapChain ? depthBuffer : *renderPass.depthImage;
+		depthAttachment = {
+			.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+			.imageView = depth.view,
+			.imageLayout = depthLayout,
+			.loadOp = loadOp,
+			.storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+			.clearValue = {.depthStencil = { 1.0f, 0 } },
+		};
+		const VkImageAspectFlags aspect = VK_IMAGE_ASPECT_DEPTH_BIT | (hasStencil ? VK_IMAGE_ASPECT_STENCIL_BIT : 0);
+		barriers.push_back(attachmentBarrier(depth.image, aspect, toSwapChain ? 1 : renderPass.layers, renderPass.doClear ? VK_IMAGE_LAYOUT_UNDEFINED : depthLayout, depthLayout));
+	}
+
+	const VkPipelineStageFlags attachmentStages = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	if (!barriers.empty())
+		vkCmdPipelineBarrier(commandBuffer, attachmentStages, attachmentStages, 0, 0, nullptr, 0, nullptr, barriers.size(), barriers.data());
+
+	VkRenderingInfo renderingInfo = {
+		.sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+		.flags = flags,
+		.renderArea = { { 0, 0 }, extent },
+		.layerCount = toSwapChain ? 1 : renderPass.layers,
+		.colorAttachmentCount = (uint32_t)colorAttachments.size(),
+		.pColorAttachments = colorAttachments.data(),
+		.pDepthAttachment = renderPass.hasDepth ? &depthAttachment : nullptr,
+		.pStencilAttachment = hasStencil ? &depthAttachment : nullptr,
+	};
+
+	vkCmdBeginRendering(commandBuffer, &renderingInfo);
+}
+
+void Device::transitionSwapChainForPresent(VkCommandBuffer commandBuffer)
+{
+	if (swapChainImageLayout == VK_IMAGE_LAYOUT_PRESENT_SRC_KHR)
+		return;
+
+	VkImageMemoryBarrier barrier = attachmentBarrier(swapChainImages[current_framebuffer_idx], VK_IMAGE_ASPECT_COLOR_BIT, 1, swapChainImageLayout, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+	swapChainImageLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+}
+
+void Device::bindPassState(VkCommandBuffer commandBuffer, const RenderPass& renderPass, const PipelineState& state, VkPipeline pipeline, VkExtent2D extent)
+{
 	//These are define dynamic in the pipeline so we have to set them
 	VkViewport viewport{};
 	viewport.x = 0.0f;
@@ -1043,28 +1310,260 @@ void Device::recordRenderPass(VkCommandBuffer commandBuffer, RenderPass& renderP
 	scissor.extent = extent;
 	vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
 
-	std::vector<VkClearValue> clearValues{};
-	clearValues.resize(renderPass.colorAttachement_count + (renderPass.hasDepth ? 1 : 0));
-	for (int i = 0; i < renderPass.colorAttachement_count; i++)
-	{
-		clearValues[i].color = { 0.0f, 0.0f, 0.0f, 1.0f };
+	CommandStateTracker& tracker = stateTracker();
+	tracker.bindPipeline(VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+	setDynamicPipelineState(commandBuffer, renderPass.pipeline, state);
+
+	// All meshes share the geometry heap, only the first pass of a command buffer actually binds it
+	tracker.bindVertexBuffer(geometryVertexBuffer.buffer, 0);
+	tracker.bindIndexBuffer(geometryIndexBuffer.buffer, 0, VK_INDEX_TYPE_UINT32);
+}
+
+VkCommandBuffer Device::graphicsCommandBuffer()
+{
+	return t_secondary.commandBuffer != VK_NULL_HANDLE ? t_secondary.commandBuffer : commandBuffers[current_frame];
+}
+
+CommandStateTracker& Device::stateTracker(PipelineType type)
+{
+	if (type == PipelineType::Compute)
+		return computeState;
+	return t_secondary.commandBuffer != VK_NULL_HANDLE ? t_secondary.tracker : graphicsState;
+}
+
+void Device::addStateStats(const CommandStateTracker::Stats& stats)
+{
+	std::lock_guard<std::mutex> lock(stateStatsMutex);
+	frameStateStats += stats;
+}
+
+VkCommandBuffer Device::getSecondaryCommandBuffer(uint32_t worker)
+{
+	SecondaryCommandPool& pool = secondaryPools[current_frame][worker];
+	if (pool.used == pool.buffers.size()) {
+		VkCommandBufferAllocateInfo allocInfo = {
+			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+			.commandPool = pool.pool,
+			.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+			.commandBufferCount = 1,
+		};
+
+		VkCommandBuffer commandBuffer;
+		if (vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer) != VK_SUCCESS) {
+			throw std::runtime_error("failed to allocate secondary command buffer!");
+		}
+		pool.buffers.push_back(commandBuffer);
 	}
 
-	if (renderPass.hasDepth)
-		clearValues.back().depthStencil = {1.0f, 0};
+	return pool.buffers[pool.used++];
+}
 
-	renderPassInfo.clearValueCount = clearValues.size();
-	renderPassInfo.pClearValues = clearValues.data();
+void Device::recordSecondary(VkCommandBuffer commandBuffer, const RenderPass& renderPass, const PipelineState& state, VkPipeline pipeline, VkExtent2D extent, size_t first, size_t count,
+	std::vector<std::pair<VkDescriptorSetLayout, size_t>>* usedSets)
+{
+	const PipelineDesc& desc = renderPass.pipeline.variants->desc;
+	std::vector<VkFormat> colorFormats(renderPass.colorAttachement_count, desc.colorFormat);
+
+	VkCommandBufferInheritanceRenderingInfo renderingInfo = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO,
+		.colorAttachmentCount = (uint32_t)colorFormats.size(),
+		.pColorAttachmentFormats = colorFormats.data(),
+		.depthAttachmentFormat = renderPass.hasDepth ? desc.depthFormat : VK_FORMAT_UNDEFINED,
+		.stencilAttachmentFormat = renderPass.hasDepth && hasStencilComponent(desc.depthFormat) ? desc.depthFormat : VK_FORMAT_UNDEFINED,
+		.rasterizationSamples = state.samples,
+	};
 
-	vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+	VkCommandBufferInheritanceInfo inheritanceInfo = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+		.pNext = dynamicRendering ? &renderingInfo : nullptr,
+		.renderPass = dynamicRendering ? VK_NULL_HANDLE : (state.samples != VK_SAMPLE_COUNT_1_BIT ? renderPass.renderPassMsaa : renderPass.renderPass),
+		.subpass = 0,
+	};
 
+	VkCommandBufferBeginInfo beginInfo = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = (VkCommandBufferUsageFlags)(usedSets ? 0 : VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT) | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+		.pInheritanceInfo = &inheritanceInfo,
+	};
 
-	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, this->usesMsaa?renderPass.pipeline.graphicsPipelineMsaa:renderPass.pipeline.graphicsPipeline);
+	if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+		throw std::runtime_error("failed to begin recording secondary command buffer!");
+	}
 
+	t_secondary.commandBuffer = commandBuffer;
+	t_secondary.state = state;
+	t_secondary.tracker.reset(commandBuffer);
+	t_secondary.usedSets = usedSets;
+	bindPassState(commandBuffer, renderPass, state, pipeline, extent);
+	if (renderPass.drawRange)
+		renderPass.drawRange(first, count);
+	else
+		renderPass.draw();
+	addStateStats(t_secondary.tracker.takeStats());
+	t_secondary.commandBuffer = VK_NULL_HANDLE;
+	t_secondary.usedSets = nullptr;
 
-	renderPass.draw();
+	if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+		throw std::runtime_error("failed to record secondary command buffer!");
+	}
+}
 
-	vkCmdEndRenderPass(commandBuffer);
+void Device::trackDescriptorSet(VkDescriptorSetLayout layout, size_t hash)
+{
+	if (t_secondary.usedSets)
+		t_secondary.usedSets->emplace_back(layout, hash);
+}
+
+void Device::executeCachedCommands(VkCommandBuffer commandBuffer, RenderPass& renderPass, const PipelineState& state, VkPipeline pipeline, VkExtent2D extent)
+{
+	// Per frame in flight, the last submission of this one is done since beginDraw waited on it
+	CachedPassCommands& cached = (*renderPass.cachedCommands)[current_frame];
+
+	bool valid = cached.commandBuffer != VK_NULL_HANDLE && cached.version == commandCacheVersion && cached.state == state
+		&& cached.extent.width == extent.width && cached.extent.height == extent.height;
+
+	// The sets are never bound through the cache again, keep them from being recycled. One that is gone means recording again
+	if (valid) {
+		std::lock_guard<std::mutex> lock(descriptorMutex);
+		for (const auto& [layout, hash] : cached.descriptorSets)
+			valid &= descriptorCache.touch(layout, hash);
+	}
+
+	if (valid) {
+		framePassCacheStats.reused++;
+	}
+	else {
+		if (cached.commandBuffer == VK_NULL_HANDLE) {
+			VkCommandBufferAllocateInfo allocInfo = {
+				.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+				.commandPool = cachedCommandPool,
+				.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+				.commandBufferCount = 1,
+			};
+
+			if (vkAllocateCommandBuffers(device, &allocInfo, &cached.commandBuffer) != VK_SUCCESS) {
+				throw std::runtime_error("failed to allocate cached command buffer!");
+			}
+		}
+
+		// Taken before recording, an invalidation while the draws are recorded is seen next frame
+		cached.version = commandCacheVersion;
+		cached.state = state;
+		cached.extent = extent;
+		cached.descriptorSets.clear();
+
+		const size_t drawCount = renderPass.drawCount ? renderPass.drawCount() : 0;
+		recordSecondary(cached.commandBuffer, renderPass, state, pipeline, extent, 0, drawCount, &cached.descriptorSets);
+
+		std::sort(cached.descriptorSets.begin(), cached.descriptorSets.end());
+		cached.descriptorSets.erase(std::unique(cached.descriptorSets.begin(), cached.descriptorSets.end()), cached.descriptorSets.end());
+		framePassCacheStats.recorded++;
+	}
+
+	vkCmdExecuteCommands(commandBuffer, 1, &cached.commandBuffer);
+	graphicsState.reset(commandBuffer);
+}
+
+void Device::recordRenderPass(VkCommandBuffer commandBuffer, RenderPass& renderPass)
+{
+	// Waits for the variant if it is still compiling
+	const PipelineState state = getRenderPassState(renderPass, this->usesMsaa);
+	VkPipeline pipeline = getPipelineVariant(renderPass.pipeline, state);
+
+	PushCmdLabel(commandBuffer, &renderPass.markerInfo);
+	currentPipeline = &renderPass.pipeline;
+	currentPipelineState = state;
+
+	const bool toSwapChain = renderPass.colorImages.empty() && renderPass.depthImage == nullptr;
+	VkExtent2D extent = toSwapChain ? swapChainExtent : renderPass.extent;
+
+	// Big enough passes are split in chunks recorded in parallel, the main thread does the first one
+	const size_t drawCount = renderPass.drawCount ? renderPass.drawCount() : 0;
+	const uint32_t workerCount = renderPass.drawRange ? (uint32_t)std::min(secondaryPools[current_frame].size(), drawCount / minDrawsPerRecordThread) : 0;
+	// Cached passes are only recorded when something changed, on this thread
+	const bool cached = renderPass.cachedCommands && cachePassCommands;
+	const bool parallel = !cached && workerCount > 1;
+	const bool secondaries = cached || parallel;
+
+	if (dynamicRendering) {
+		beginRendering(commandBuffer, renderPass, state, extent, secondaries ? VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT : 0);
+	}
+	else {
+		VkRenderPassBeginInfo renderPassInfo{};
+		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+		renderPassInfo.renderPass = state.samples != VK_SAMPLE_COUNT_1_BIT ? renderPass.renderPassMsaa : renderPass.renderPass;
+		renderPassInfo.framebuffer = renderPass.framebuffer != VK_NULL_HANDLE ? renderPass.framebuffer : swapChainFramebuffers[current_framebuffer_idx];
+		renderPassInfo.renderArea.offset = { 0, 0 };
+		renderPassInfo.renderArea.extent = extent;
+
+		std::vector<VkClearValue> clearValues{};
+		clearValues.resize(renderPass.colorAttachement_count + (renderPass.hasDepth ? 1 : 0));
+		for (int i = 0; i < renderPass.colorAttachement_count; i++)
+		{
+			clearValues[i].color = { 0.0f, 0.0f, 0.0f, 1.0f };
+		}
+
+		if (renderPass.hasDepth)
+			clearValues.back().depthStencil = {1.0f, 0};
+
+		renderPassInfo.clearValueCount = clearValues.size();
+		renderPassInfo.pClearValues = clearValues.data();
+
+		vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, secondaries ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE);
+	}
+
+	if (cached) {
+		executeCachedCommands(commandBuffer, renderPass, state, pipeline, extent);
+	}
+	else if (parallel) {
+		// Allocated here, the pools are only touched by their worker once recording starts
+		std::vector<VkCommandBuffer> secondaries(workerCount);
+		for (uint32_t i = 0; i < workerCount; i++)
+			secondaries[i] = getSecondaryCommandBuffer(i);
+
+		const size_t chunkSize = (drawCount + workerCount - 1) / workerCount;
+		auto recordChunk = [&, this](uint32_t i) {
+			const size_t first = std::min(i * chunkSize, drawCount);
+			recordSecondary(secondaries[i], renderPass, state, pipeline, extent, first, std::min(chunkSize, drawCount - first));
+		};
+
+		// Everything they reference lives on this stack, wait for all before rethrowing anything,
+		// what this thread records included
+		std::vector<std::shared_future<void>> jobs;
+		try {
+			for (uint32_t i = 1; i < workerCount; i++)
+				jobs.push_back(recordWorkers.submit([&recordChunk, i]() { recordChunk(i); }));
+
+			recordChunk(0);
+		}
+		catch (...) {
+			for (auto& job : jobs)
+				job.wait();
+			throw;
+		}
+
+		for (auto& job : jobs)
+			job.wait();
+		for (auto& job : jobs)
+			job.get();
+
+		vkCmdExecuteCommands(commandBuffer, secondaries.size(), secondaries.data());
+		// What the secondaries bound is undefined in the primary afterwards
+		graphicsState.reset(commandBuffer);
+	}
+	else {
+		bindPassState(commandBuffer, renderPass, state, pipeline, extent);
+
+		if (renderPass.drawRange)
+			renderPass.drawRange(0, drawCount);
+		else
+			renderPass.draw();
+	}
+
+	if (dynamicRendering)
+		vkCmdEndRendering(commandBuffer);
+	else
+		vkCmdEndRenderPass(commandBuffer);
 	EndCmdLabel(commandBuffer);
 
 	for(const auto& barrier : renderPass.postDrawBarriers)
@@ -1076,6 +1575,9 @@ void Device::recordRenderPass(VkCommandBuffer commandBuffer, RenderPass& renderP
 
 void Device::recordRenderPass(RenderPass& renderPass)
 {
+	// The async passes start as soon as possible, before anything of this frame's graphics is recorded
+	flushAsyncCompute();
+
 	if (skipDraw)
 		return;
 
@@ -1083,36 +1585,58 @@ void Device::recordRenderPass(RenderPass& renderPass)
 	recordRenderPass(commandBuffer, renderPass);
 }
 
-void Device::recordComputePass(VkCommandBuffer commandBuffer, ComputePass& computePass) {
+void Device::beginComputeCommandBuffer(VkCommandBuffer commandBuffer, const QueueTimeline& timeline, uint64_t value)
+{
+	// Can be recorded before beginDraw, the slot's last compute submit may still be running
+	waitTimeline(timeline, value);
+	vkResetCommandBuffer(commandBuffer, /*VkCommandBufferResetFlagBits*/ 0);
 
-	if (!hasRecorededCompute) {
 
-		vkWaitForFences(device, 1, &computeInFlightFences[current_frame], VK_TRUE, UINT64_MAX);
-		vkResetFences(device, 1, &computeInFlightFences[current_frame]);
-		vkResetCommandBuffer(commandBuffer, /*VkCommandBufferResetFlagBits*/ 0);
+	VkCommandBufferBeginInfo beginInfo{};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
 
+	if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+		throw std::runtime_error("failed to begin recording compute command buffer!");
+	}
 
-		VkCommandBufferBeginInfo beginInfo{};
-		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	computeState.reset(commandBuffer);
+}
 
-		if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
-			throw std::runtime_error("failed to begin recording compute command buffer!");
-		}
+void Device::recordComputePass(VkCommandBuffer commandBuffer, ComputePass& computePass) {
 
+	// Both compute command buffers share the tracker, the dispatch functions record on whichever it holds
+	if (computeState.getCommandBuffer() != commandBuffer)
+		computeState.reset(commandBuffer);
 
-		hasRecorededCompute = true;
-	}
+	VkPipeline pipeline = getPipelineVariant(computePass.pipeline, computePass.pipeline.defaultState);
 	currentPipeline = &computePass.pipeline;
 
 	PushCmdLabel(commandBuffer, &computePass.markerInfo);
-	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computePass.pipeline.graphicsPipeline);
+	computeState.bindPipeline(VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
 	computePass.dispatch();
 	EndCmdLabel(commandBuffer);
 }
 
 void Device::recordComputePass(ComputePass& computePass)
 {
-	VkCommandBuffer commandBuffer = computeCommandBuffers[current_frame];
+	VkCommandBuffer commandBuffer;
+
+	// Once the async command buffer is submitted, later async passes go with the in order ones
+	if (computePass.async && asyncCompute && !asyncComputeSubmitted) {
+		commandBuffer = asyncComputeCommandBuffers[current_frame];
+		if (!hasRecordedAsyncCompute) {
+			beginComputeCommandBuffer(commandBuffer, asyncComputeTimeline, frameAsyncComputeValues[current_frame]);
+			writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, AsyncComputeBegin);
+			hasRecordedAsyncCompute = true;
+		}
+	}
+	else {
+		commandBuffer = computeCommandBuffers[current_frame];
+		if (!hasRecorededCompute) {
+			beginComputeCommandBuffer(commandBuffer, computeTimeline, frameComputeValues[current_frame]);
+			hasRecorededCompute = true;
+		}
+	}
 
 	recordComputePass(commandBuffer, computePass);
 }
@@ -1124,6 +1648,10 @@ void Device::recordImGui()
 
 	VkCommandBuffer commandBuffer = commandBuffers[current_frame];
 
+	// The default render pass expects the swapchain image ready to present
+	if (dynamicRendering)
+		transitionSwapChainForPresent(commandBuffer);
+
 	VkRenderPassBeginInfo renderPassInfo{};
 	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
 	renderPassInfo.renderPass = defaultRenderPass;
@@ -1141,6 +1669,7 @@ void Device::recordImGui()
 	vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
 
 	ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), commandBuffer);
+	graphicsState.reset(commandBuffer); // ImGui binds its own things
 
 	vkCmdEndRenderPass(commandBuffer);
 
@@ -2,6 +2,12 @@
 #include <vulkan/vulkan.h>
 #include <vector>
 #include <functional>
+#include <memory>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+#include <array>
+#include <utility>
 
 enum class BlendMode {
 	Opaque,
@@ -45,6 +51,13 @@ enum StageFlags {
 	e_Compute	= (1 << 3),
 };
 
+// States set when recording instead of being baked in, core since Vulkan 1.3
+enum DynamicStateFlags {
+	e_DynamicCullMode		= (1 << 0),
+	e_DynamicDepthCompare	= (1 << 1),
+	e_DynamicDepthWrite		= (1 << 2),
+};
+
 struct BindingDesc {
 	uint32_t slot;
 	BindingType type;
@@ -83,15 +96,68 @@ struct PipelineDesc {
 
 	std::vector<PushConstantsRange> pushConstantsRanges;
 
+	// Adds the device bindless texture table as the set right after bindings
+	bool useBindlessTextures = false;
+
+	// Initial values of the shaders specialization constants, constant_id i gets value i
+	std::vector<uint32_t> specializationConstants;
+
+	// DynamicStateFlags, variants only differing by these share the same VkPipeline
+	uint32_t dynamicStates = 0;
+
 	bool isWireframe;
 
 	VkRenderPass renderPass;
 	VkRenderPass renderPassMsaa;
+	// With dynamic rendering renderPass is VK_NULL_HANDLE and the attachments are described by these
+	VkFormat colorFormat = VK_FORMAT_UNDEFINED;
+	VkFormat depthFormat = VK_FORMAT_UNDEFINED;
+	bool writeSwapChain = false; // Only those get multisampled variants
 	bool hasDepth;
 	uint32_t attachmentCount;
 	struct { uint32_t x; uint32_t y;  } extent = { 0, 0 };
 };
 
+// The part of a graphics pipeline that can change between variants of the same Pipeline
+struct PipelineState {
+	static constexpr uint32_t MaxSpecializationConstants = 8;
+
+	VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+	BlendMode blendMode = BlendMode::Opaque;
+	CullMode cullMode = CullMode::None;
+	DepthCompareOp depthCompareOp = DepthCompareOp::Less;
+	bool depthWrite = true;
+
+	// Shader permutations, constant_id i is specialization[i]
+	uint32_t specializationCount = 0;
+	std::array<uint32_t, MaxSpecializationConstants> specialization{};
+
+	size_t hash() const {
+		size_t seed = (size_t)samples | ((size_t)blendMode << 7) | ((size_t)cullMode << 9) | ((size_t)depthCompareOp << 11) | ((size_t)depthWrite << 14);
+		for (uint32_t i = 0; i < specializationCount; i++)
+			seed ^= specialization[i] + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+		return seed;
+	}
+
+	bool operator==(const PipelineState&) const = default;
+
+	// Key of the VkPipeline actually compiled for this state, dynamic states go back to their defaults
+	PipelineState variantKey(uint32_t dynamicStates) const {
+		PipelineState key = *this;
+		if (dynamicStates & e_DynamicCullMode)
+			key.cullMode = CullMode::None;
+		if (dynamicStates & e_DynamicDepthCompare)
+			key.depthCompareOp = DepthCompareOp::Less;
+		if (dynamicStates & e_DynamicDepthWrite)
+			key.depthWrite = true;
+		return key;
+	}
+};
+
+struct PipelineStateHasher {
+	size_t operator()(const PipelineState& state) const { return state.hash(); }
+};
+
 struct GpuImage;
 struct FramebufferDesc {
 	std::vector<const GpuImage*> images;
@@ -154,23 +220,56 @@ struct RenderPassDesc
 	bool useMsaa;
 	bool doClear;
 	bool writeSwapChain;
+	// Draws are recorded once in secondaries reused every frame, until Device::invalidateCachedCommands
+	// or the pass state changes. Only for passes whose draws don't change on their own
+	bool cacheCommands = false;
 
 	std::function<void()> drawFunction;
+	// Instead of drawFunction, lets the pass be split across the record workers. drawRangeFunction is called once per
+	// secondary command buffer and has to redo its per pass binds, secondary command buffers inherit nothing
+	std::function<size_t()> drawCountFunction;
+	std::function<void(size_t first, size_t count)> drawRangeFunction;
 	std::vector<BarrierDesc> postDrawBarriers;
 	DebugMarkerInfo debugInfo;
 };
 
+// One compiled PipelineState, filled by the worker compiling it
+struct PipelineVariant {
+	std::shared_future<void> done;
+	VkPipeline pipeline = VK_NULL_HANDLE;
+	std::vector<VkShaderModule> shaderModules; // References in the device shader cache
+};
+
+// Shared by every copy of a Pipeline, keeps what is needed to compile more variants later
+struct PipelineVariants {
+	PipelineDesc desc; // Vertex input points to the vectors below
+	std::vector<VkVertexInputBindingDescription> vertexBindings;
+	std::vector<VkVertexInputAttributeDescription> vertexAttributes;
+	VkExtent2D extent;
+
+	std::unordered_map<PipelineState, std::shared_ptr<PipelineVariant>, PipelineStateHasher> compiled;
+	std::mutex mutex; // Variants can be requested from the record workers
+};
+
 struct Pipeline {
 	VkRenderPass renderPass;
 	VkRenderPass renderPassMsaa;
 	std::vector<VkDescriptorSetLayout> descriptorSetLayouts;
 	std::vector<VkDescriptorSet> descriptorSets;
-	std::unordered_map<size_t, VkDescriptorSet> descriptorSetsMap;
 	std::vector<std::vector<BindingDesc>> bindings;
-	VkDescriptorPool descriptorPool;
+	uint32_t bindlessSet = UINT32_MAX;
 	VkPipelineLayout pipelineLayout;
-	VkPipeline graphicsPipeline = VK_NULL_HANDLE;
-	VkPipeline graphicsPipelineMsaa = VK_NULL_HANDLE;
+	PipelineState defaultState; // From the desc, single sampled
+	std::shared_ptr<PipelineVariants> variants;
+};
+
+// Recorded draws of a cached pass for one frame in flight
+struct CachedPassCommands {
+	VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+	uint64_t version = UINT64_MAX; // Device cache version when it was recorded
+	PipelineState state;
+	VkExtent2D extent = { 0, 0 };
+	std::vector<std::pair<VkDescriptorSetLayout, size_t>> descriptorSets; // Kept alive in the descriptor cache while reused
 };
 
 struct RenderPass {
@@ -178,16 +277,28 @@ struct RenderPass {
 	VkRenderPass renderPassMsaa = VK_NULL_HANDLE;
 	uint32_t colorAttachement_count = 0;
 	bool hasDepth;
+	bool doClear = false;
+	bool writeSwapChain = false;
 
 	Pipeline pipeline;
 
 	//TODO : put that somewhere else
-	VkFramebuffer framebuffer;
+	VkFramebuffer framebuffer = VK_NULL_HANDLE;
 	VkExtent2D extent;
 
+	// Dynamic rendering attachments, both empty means the swapchain ones
+	std::vector<const GpuImage*> colorImages;
+	const GpuImage* depthImage = nullptr;
+	uint32_t layers = 1;
+
 	std::vector<BarrierDesc> postDrawBarriers;
 
 	std::function<void()> draw;
+	std::function<size_t()> drawCount;
+	std::function<void(size_t first, size_t count)> drawRange;
+
+	// One per frame in flight, shared by the copies. Null when the pass is recorded every frame
+	std::shared_ptr<std::vector<CachedPassCommands>> cachedCommands;
 
 	VkDebugUtilsLabelEXT markerInfo;
 };
@@ -195,10 +306,13 @@ struct RenderPass {
 struct ComputePassDesc {
 	std::function<void()> dispatchFunction;
 	DebugMarkerInfo debugInfo;
+	// Goes to the compute only queue when there is one. Only dispatches and fills, what the graphics queue reads must be released with releaseToGraphics
+	bool async = false;
 };
 
 struct ComputePass {
 	Pipeline pipeline;
 	std::function<void()> dispatch;
 	VkDebugUtilsLabelEXT markerInfo;
+	bool async = false;
 };
\ No newline at end of file
@@ -0,0 +1,72 @@
+#include "RenderQueue.h"
+
+#include <cstring>
+#include <utility>
+
+static constexpr uint32_t PipelineBits = 8;
+static constexpr uint32_t MaterialBits = 16;
+static constexpr uint32_t MeshBits = 16;
+static constexpr uint32_t DepthBits = 24;
+
+static constexpr uint64_t mask(uint32_t bits) { return (1ull << bits) - 1; }
+
+// Positive floats compare like their bits, keep the top ones (exponent and the high mantissa)
+static uint64_t quantizeDepth(float depth)
+{
+	if (!(depth > 0.0f))
+		return 0;
+
+	uint32_t bits;
+	memcpy(&bits, &depth, sizeof(float));
+	return bits >> (32 - DepthBits);
+}
+
+uint64_t RenderQueue::makeKey(SortMode mode, uint32_t pipeline, uint32_t material, uint32_t mesh, float depth)
+{
+	const uint64_t state = ((pipeline & mask(PipelineBits)) << (MeshBits + MaterialBits))
+		| ((mesh & mask(MeshBits)) << MaterialBits)
+		| (material & mask(MaterialBits));
+	const uint64_t d = quantizeDepth(depth);
+
+	if (mode == SortMode::Opaque)
+		return (state << DepthBits) | d;
+
+	// Farthest first
+	return ((~d & mask(DepthBits)) << (PipelineBits + MaterialBits + MeshBits)) | state;
+}
+
+// LSD radix sort on bytes, bytes that are the same for every key are skipped
+void RenderQueue::sort()
+{
+	const size_t count = items.size();
+	if (count < 2)
+		return;
+
+	uint32_t histograms[8][256] = {};
+	for (const DrawItem& item : items)
+	{
+		for (uint32_t b = 0; b < 8; b++)
+			histograms[b][(item.key >> (b * 8)) & 0xFF]++;
+	}
+
+	scratch.resize(count);
+	for (uint32_t b = 0; b < 8; b++)
+	{
+		uint32_t* histogram = histograms[b];
+		if (histogram[(items[0].key >> (b * 8)) & 0xFF] == count)
+			continue;
+
+		uint32_t offset = 0;
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t n = histogram[i];
+			histogram[i] = offset;
+			offset += n;
+		}
+
+		for (const DrawItem& item : items)
+			scratch[histogram[(item.key >> (b * 8)) & 0xFF]++] = item;
+
+		std::swap(items, scratch);
+	}
+}
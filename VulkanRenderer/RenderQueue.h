@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+/*
+* Draws of a pass as a 64 bit sort key and an index into the caller's own packet array.
+* Passes fill a queue each frame, it gets radix sorted and the pass then walks it in order,
+* the caller's array is never moved around.
+*
+* Opaque keys :		pipeline(8) | mesh(16) | material(16) | depth(24), fewest state changes then front to back.
+*					Materials are bindless, the mesh comes first so packets sharing it end up next to each other and get instanced
+* Transparent keys :	depth(24, inverted) | pipeline(8) | mesh(16) | material(16), back to front
+*/
+class RenderQueue {
+public:
+	enum class SortMode {
+		Opaque,
+		Transparent
+	};
+
+	struct DrawItem {
+		uint64_t key;
+		uint32_t index;
+	};
+
+	// Fields are truncated to their bit count, depth is a distance to the camera
+	static uint64_t makeKey(SortMode mode, uint32_t pipeline, uint32_t material, uint32_t mesh, float depth);
+
+	void clear() { items.clear(); }
+	void push(uint64_t key, uint32_t index) { items.push_back({ key, index }); }
+	// Stable, draws with the same key stay in submission order
+	void sort();
+
+	size_t size() const { return items.size(); }
+	bool empty() const { return items.empty(); }
+	const DrawItem& operator[](size_t i) const { return items[i]; }
+
+private:
+	std::vector<DrawItem> items;
+	std::vector<DrawItem> scratch; // Kept between frames so sorting doesn't allocate
+};
@@ -3,6 +3,9 @@
 
 #include <chrono>
 #include <random>
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
 
 #include <imgui.h>
 #include <ImGuizmo.h>
@@ -14,6 +17,8 @@
 
 #include "ResourceManager.h"
 
+#include <tracy/Tracy.hpp>
+
 /* TODOs:
 	- Separate UBO from other descriptor sets, or include it in the hashing ?
 	- Barriers using subpasses
@@ -103,13 +108,21 @@ MaterialData materials[MATERIAL_COUNT] = {
 
 void Renderer::init(GLFWwindow* window, DeviceOptions options)
 {
+	startup.start = std::chrono::steady_clock::now();
 	device_options = options;
 	m_device.init(window, options);
 
-	light_data_gpu = m_device.createUniformBuffer(10 * sizeof(LightData));
+	light_data_gpu = m_device.createUniformBuffer(MAX_LIGHTS * sizeof(LightData));
+	materialTable = m_device.createStorageBuffer(MAX_MATERIALS * sizeof(GpuMaterial));
+	opaqueDraws = m_device.createIndirectDrawBuffer(MAX_DRAWS, sizeof(GpuDrawData));
+	transparentDraws = m_device.createIndirectDrawBuffer(MAX_DRAWS, sizeof(GpuDrawData));
+	lightDraws = m_device.createIndirectDrawBuffer(MAX_LIGHTS, sizeof(glm::mat4));
 
 	createDefaultTextures();
+	// Drawn as fallbacks without any check, the last one covers the others
+	m_device.waitUpload(defaultNormalMap->upload);
 
+	const auto pipelinesStart = std::chrono::steady_clock::now();
 	initPipeline();
 	initPipelinePBR();
 	initDrawLightsRenderPass();
@@ -120,8 +133,10 @@ void Renderer::init(GLFWwindow* window, DeviceOptions options)
 
 	initComputePipeline();
 	initComputeSkyboxPasses();
+	initCullPass();
 	//initTestPipeline();
 	//initTestPipeline2();
+	startup.pipelineSubmitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - pipelinesStart).count();
 
 	initParticlesBuffers();
 
@@ -133,6 +148,24 @@ void Renderer::cleanup()
 {
 
 	destroyAllPackets();
+	// Light gizmos hold the shared cube, the shapes have to go while the device is still there
+	lights.clear();
+	cubeGeometry.reset();
+	coneGeometry.reset();
+	sphereGeometry.reset();
+	m_device.destroyBuffer(materialTable);
+	m_device.destroyIndirectDrawBuffer(opaqueDraws);
+	m_device.destroyIndirectDrawBuffer(transparentDraws);
+	m_device.destroyIndirectDrawBuffer(lightDraws);
+	m_device.destroyIndirectDrawBuffer(culledOpaqueDraws);
+	m_device.destroyIndirectDrawBuffer(culledTransparentDraws);
+	m_device.destroyIndirectDrawBuffer(culledSunDraws);
+	m_device.destroyIndirectDrawBuffer(culledPointDraws);
+	for (Buffer& buffer : cullFrustums)
+		m_device.destroyBuffer(buffer);
+	for (Buffer& buffer : pointShadowFaceMasks)
+		m_device.destroyBuffer(buffer);
+	m_device.destroyComputePass(computeCullPass);
 
 	for (auto& pass : renderPasses)
 	{
@@ -165,11 +198,25 @@ static uint32_t use_pbr = false;
 static uint32_t use_ibl = false;
 static int debug_mode = 0;
 
+// Specialization constants of phong.hlsl and pbr.slang, constant_id order
+static std::vector<uint32_t> phongPermutation() { return { normal_mode, (uint32_t)debug_mode, use_blinn }; }
+// pbr.slang has no debug mode, slot 1 stays fixed so toggling it does not compile an identical variant
+static std::vector<uint32_t> pbrPermutation() { return { normal_mode, 0, use_ibl }; }
+
 void Renderer::draw()
 {
+	if (lastSceneLoad.pending && m_device.isUploadComplete(lastSceneLoad.token))
+	{
+		lastSceneLoad.totalMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - lastSceneLoad.start).count();
+		lastSceneLoad.pending = false;
+		std::cout << "Loaded " << lastSceneLoad.name << " : parse " << lastSceneLoad.parseMs << "ms, record " << lastSceneLoad.recordMs << "ms, "
+			<< lastSceneLoad.uploadBatches << " upload batches, done in " << lastSceneLoad.totalMs << "ms" << std::endl;
+	}
+
 	updateUniformBuffer();
 	updateComputeUniformBuffer();
 	updateLightData();
+	buildRenderQueues();
 
 	//m_device.recordComputePass(computeParticlesPass);
 
@@ -184,6 +231,14 @@ void Renderer::draw()
 	}
 
 	m_device.beginDraw();
+	writeIndirectDraws(opaqueDraws, opaqueDrawIndices, packets, opaqueQueue);
+	writeIndirectDraws(transparentDraws, transparentDrawIndices, transparent_packets, transparentQueue);
+	writeLightDraws();
+	if (usesGpuCulling())
+	{
+		writeCullFrustums();
+		m_device.recordComputePass(computeCullPass);
+	}
 
 	m_device.recordRenderPass(renderPasses[(size_t)RenderPasses::DrawShadowMap]);
 	m_device.recordRenderPass(renderPasses[(size_t)RenderPasses::DrawPointShadowMap]);
@@ -203,6 +258,14 @@ void Renderer::draw()
 
 
 	m_device.endDraw();
+
+	if (!startup.firstFrameDone)
+	{
+		startup.firstFrameMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startup.start).count();
+		startup.firstFrameDone = true;
+		std::cout << "First frame after " << startup.firstFrameMs << "ms (pipeline jobs queued in " << startup.pipelineSubmitMs << "ms on "
+			<< m_device.getPipelineWorkerCount() << " workers), pipeline cache " << (m_device.getPipelineCacheLoadedSize() > 0 ? "warm" : "cold") << std::endl;
+	}
 }
 
 static ImGuizmo::OPERATION mCurrentGizmoOperation(ImGuizmo::TRANSLATE);
@@ -327,16 +390,32 @@ void Renderer::drawImgui()
 {
 	if (ImGui::Checkbox("MSAA", &device_options.usesMsaa)) {
 		m_device.setUsesMsaa(device_options.usesMsaa);
+		// Only takes effect after the next present, get the variants compiling in the meantime
+		for (const auto& pass : renderPasses)
+		{
+			m_device.requestPipelineVariant(pass.pipeline, m_device.getRenderPassState(pass, device_options.usesMsaa));
+		}
 	}
 
-	ImGui::Checkbox("Use Normal Map", (bool*)&normal_mode);
-	ImGui::Checkbox("Use Blinn-Phong", (bool*)&use_blinn);
+	bool permutationChanged = false;
+	permutationChanged |= ImGui::Checkbox("Use Normal Map", (bool*)&normal_mode);
+	permutationChanged |= ImGui::Checkbox("Use Blinn-Phong", (bool*)&use_blinn);
 	ImGui::Checkbox("Use PBR", (bool*)&use_pbr);
+	if (ImGui::Checkbox("Cache static passes", &device_options.cachePassCommands))
+		m_device.setPassCommandCaching(device_options.cachePassCommands);
+	if (m_device.usesIndirectDrawCount() && ImGui::Checkbox("GPU culling", &gpuCulling))
+	{
+		m_device.invalidateCachedCommands();
+		permutationChanged = true;
+	}
 	if (use_pbr)
 	{
-		ImGui::Checkbox("Use IBL", (bool*)&use_ibl);
+		permutationChanged |= ImGui::Checkbox("Use IBL", (bool*)&use_ibl);
 	}
-	ImGui::Combo("Debug Mode", &debug_mode, "None\0Normal\0Tangent\0Binormal\0Normal Map\0Shaded Normal\0");
+	permutationChanged |= ImGui::Combo("Debug Mode", &debug_mode, "None\0Normal\0Tangent\0Binormal\0Normal Map\0Shaded Normal\0");
+
+	if (permutationChanged)
+		updateShaderPermutations();
 
 	if (ImGui::CollapsingHeader("Object List"))
 	{
@@ -355,17 +434,22 @@ void Renderer::drawImgui()
 
 			char label[32];
 			sprintf(label, "Object %d", i);
+			bool edited = false;
 			if (ImGui::TreeNode(p.name.empty() ? label : p.name.c_str()))
 			{
-				ImGui::SliderFloat3("Translate", &translation[0], -5.0f, 5.0f);
-				ImGui::SliderFloat3("Rot", &eulerRotationDegrees[0], 0.0f, 180.0f);
-				ImGui::SliderFloat3("Scale",&scale[0], 0.0f, 4.0f);
+				edited |= ImGui::SliderFloat3("Translate", &translation[0], -5.0f, 5.0f);
+				edited |= ImGui::SliderFloat3("Rot", &eulerRotationDegrees[0], 0.0f, 180.0f);
+				edited |= ImGui::SliderFloat3("Scale",&scale[0], 0.0f, 4.0f);
 
 				ImGui::TreePop();
 			}
 
-			rotationQuat = glm::quat(glm::radians(eulerRotationDegrees));
-			p.transform = glm::recompose(scale, rotationQuat, translation, skew, perspective);
+			// Only when touched, recomposing every frame drifts and would keep the cached passes dirty
+			if (edited) {
+				rotationQuat = glm::quat(glm::radians(eulerRotationDegrees));
+				p.transform = glm::recompose(scale, rotationQuat, translation, skew, perspective);
+				m_device.invalidateCachedCommands();
+			}
 		}
 	}
 
@@ -429,6 +513,68 @@ void Renderer::drawImgui()
 		}
 	}
 
+	if (ImGui::CollapsingHeader("Stats"))
+	{
+		const MemoryAllocator::Stats& memStats = m_device.getMemoryStats();
+		ImGui::Text("GPU memory : %u allocations for %u resources", memStats.deviceAllocations, memStats.subAllocations);
+		ImGui::Text("%.1f MB used / %.1f MB reserved", memStats.used / (1024.0f * 1024.0f), memStats.reserved / (1024.0f * 1024.0f));
+
+		ImGui::Text("First frame after %.1f ms, pipeline jobs queued in %.1f ms on %u workers", startup.firstFrameMs, startup.pipelineSubmitMs, m_device.getPipelineWorkerCount());
+		ImGui::Text("%s pipeline cache (%.1f KB loaded)", m_device.getPipelineCacheLoadedSize() > 0 ? "Warm" : "Cold", m_device.getPipelineCacheLoadedSize() / 1024.0f);
+		const ShaderModuleCache::Stats shaderStats = m_device.getShaderStats();
+		ImGui::Text("Shader modules : %u alive, %llu shared, %llu created", shaderStats.modules, (unsigned long long)shaderStats.hits, (unsigned long long)shaderStats.misses);
+
+		const DescriptorCache::Stats& descStats = m_device.getDescriptorStats();
+		ImGui::Text("Descriptor sets : %.1f%% hits last frame (%u/%u)", m_device.getDescriptorHitRate() * 100.0f, descStats.frameHits, descStats.frameHits + descStats.frameMisses);
+		ImGui::Text("%u cached, %u free, %u pools, %llu evicted", descStats.liveSets, descStats.freeSets, descStats.pools, (unsigned long long)descStats.evictions);
+
+		const CommandStateTracker::Stats& stateStats = m_device.getStateStats();
+		ImGui::Text("Binds & pushes : %u issued, %u elided last frame", stateStats.issued.total(), stateStats.elided.total());
+		ImGui::Text("Elided : %u pipelines, %u sets, %u vertex, %u index, %u push constants", stateStats.elided.pipelines, stateStats.elided.descriptorSets,
+			stateStats.elided.vertexBuffers, stateStats.elided.indexBuffers, stateStats.elided.pushConstants);
+		const PassCacheStats& cacheStats = m_device.getPassCacheStats();
+		ImGui::Text("Cached passes : %u reused, %u recorded last frame", cacheStats.reused, cacheStats.recorded);
+		const char* indirectMode = m_device.usesIndirectDrawCount() ? "indirect count" : m_device.usesIndirectDraws() ? "indirect" : "direct fallback";
+		const uint32_t frame = m_device.getCurrentFrame();
+		ImGui::Text("PBR draws (%s) : %u opaque for %zu packets, %u transparent for %zu", indirectMode,
+			opaqueDraws.counts[frame], packets.size(), transparentDraws.counts[frame], transparent_packets.size());
+
+		// Averaged over the recorded frames, worst present interval to spot hitches
+		const auto& pacing = m_device.getFramePacingHistory();
+		const size_t pacingCount = m_device.getFramePacingCount();
+		FramePacingStats average;
+		float worstInterval = 0.0f;
+		for (size_t i = 0; i < pacingCount; i++)
+		{
+			const FramePacingStats& f = pacing[i];
+			average.frameWaitMs += f.frameWaitMs / pacingCount;
+			average.acquireMs += f.acquireMs / pacingCount;
+			average.presentIntervalMs += f.presentIntervalMs / pacingCount;
+			worstInterval = std::max(worstInterval, f.presentIntervalMs);
+		}
+		ImGui::Text("Frame pacing (%u frames in flight) : %.2f ms frame wait, %.2f ms acquire", m_device.getMaxFramesInFlight(), average.frameWaitMs, average.acquireMs);
+		ImGui::Text("Present interval %.2f ms average, %.2f ms worst of the last %zu", average.presentIntervalMs, worstInterval, pacingCount);
+		// Oldest first once the history wrapped
+		const size_t plotOffset = pacingCount == pacing.size() ? m_device.getFramePacingOffset() : 0;
+		ImGui::PlotLines("##presentInterval", &pacing[0].presentIntervalMs, (int)pacingCount, (int)plotOffset,
+			nullptr, 0.0f, FLT_MAX, ImVec2(0, 40), sizeof(FramePacingStats));
+		const QueueTimingStats& queueTimings = m_device.getQueueTimings();
+		if (m_device.usesAsyncCompute())
+			ImGui::Text("GPU : %.2f ms graphics, %.2f ms async compute", queueTimings.graphicsMs, queueTimings.asyncComputeMs);
+		else
+			ImGui::Text("GPU : %.2f ms graphics, no async compute queue", queueTimings.graphicsMs);
+
+		if (!lastSceneLoad.name.empty())
+		{
+			ImGui::Text("Last scene load : %s", lastSceneLoad.name.c_str());
+			ImGui::Text("Parse %.1f ms, record %.1f ms, %llu upload batches", lastSceneLoad.parseMs, lastSceneLoad.recordMs, (unsigned long long)lastSceneLoad.uploadBatches);
+			if (lastSceneLoad.pending)
+				ImGui::Text("Uploading...");
+			else
+				ImGui::Text("Done in %.1f ms", lastSceneLoad.totalMs);
+		}
+	}
+
 	if ( false)//ImGui::CollapsingHeader("Test guizmo"))
 	{
 		auto m = ubo.proj;
@@ -463,6 +609,7 @@ void Renderer::drawImgui()
 			if (ImGuizmo::IsUsing())
 			{
 				lastUsing = matId;
+				m_device.invalidateCachedCommands();
 			}
 		}
 
@@ -470,42 +617,169 @@ void Renderer::drawImgui()
 }
 
 
-void Renderer::sortTransparentPackets()
+void Renderer::buildRenderQueues()
 {
 	glm::vec3 camPos = glm::make_vec3(cameraInfo.position);
-	std::sort(transparent_packets.begin(), transparent_packets.end(),
-		[camPos](const MeshPacket& a, const MeshPacket& b) {
-			glm::vec3 aPos = glm::vec3(a.transform[3]);
-			glm::vec3 bPos = glm::vec3(b.transform[3]);
-			float distA = glm::length(camPos - aPos);
-			float distB = glm::length(camPos - bPos);
-			return distA > distB; // Sort in descending order (farthest first)
-		});
+	auto fill = [camPos](RenderQueue& queue, const std::vector<MeshPacket>& src, RenderQueue::SortMode mode) {
+		queue.clear();
+		for (uint32_t i = 0; i < src.size(); i++)
+		{
+			const MeshPacket& packet = src[i];
+			float dist = glm::length(camPos - glm::vec3(packet.transform[3]));
+			// Only one pipeline per pass for now, masked packets still get their own bucket since they discard
+			uint32_t pipeline = packet.materialData.alphaCoverage.alphaMode;
+			// The vertex offset would not fit the 16 bits of the key once the heap grows
+			uint32_t mesh = packet.geometry ? packet.geometry->id : 0;
+			queue.push(RenderQueue::makeKey(mode, pipeline, packet.materialData.materialIndex, mesh, dist), i);
+		}
+		queue.sort();
+	};
+
+	fill(opaqueQueue, packets, RenderQueue::SortMode::Opaque);
+	fill(transparentQueue, transparent_packets, RenderQueue::SortMode::Transparent);
+}
+
+void Renderer::writeIndirectDraws(IndirectDrawBuffer& draws, std::vector<uint32_t>& drawIndices, const std::vector<MeshPacket>& src, const RenderQueue& queue)
+{
+	// Packets next to each other in the queue with the same geometry become one instanced draw, everything else
+	// about them is per instance. Only neighbours are merged so the queue order is kept
+	uint32_t count = 0;
+	uint32_t instanceCount = 0;
+	const MeshGeometry* runGeometry = nullptr;
+	uint32_t runStart = 0;
+	auto flush = [&]() {
+		if (runGeometry)
+			m_device.writeIndirectDraw(draws, count++, *runGeometry, runStart, instanceCount - runStart);
+	};
+
+	drawIndices.assign(queue.size(), UINT32_MAX);
+	for (size_t i = 0; i < queue.size(); i++)
+	{
+		const MeshPacket& packet = src[queue[i].index];
+		// Still uploading, it will show up in a few frames
+		if (!isPacketReady(packet))
+			continue;
+
+		const MeshGeometry& geometry = *packet.geometry;
+		const bool sameGeometry = runGeometry && runGeometry->firstIndex == geometry.firstIndex
+			&& runGeometry->indexCount == geometry.indexCount && runGeometry->vertexOffset == geometry.vertexOffset;
+		if (!sameGeometry)
+		{
+			flush();
+			runGeometry = &geometry;
+			runStart = instanceCount;
+		}
+
+		GpuDrawData data = {
+			.model = packet.transform,
+			.pbrFactors = packet.materialData.pbrFactors,
+			.alphaCutoff = packet.materialData.getAlphaCutoff(),
+			.materialIndex = packet.materialData.materialIndex,
+			.normalMatrix = glm::mat4(glm::transpose(glm::inverse(glm::mat3(packet.transform)))),
+		};
+		memcpy(data.boundingSphere, geometry.boundingSphere, sizeof(data.boundingSphere));
+		drawIndices[i] = instanceCount;
+		m_device.writeIndirectDrawData(draws, instanceCount++, &data);
+	}
+	flush();
+
+	m_device.setIndirectDrawCount(draws, count);
+}
+
+void Renderer::writeLightDraws()
+{
+	// Grouped by shape, lights sharing one are a single draw
+	std::vector<const MeshPacket*> gizmos;
+	for (const Light& l : lights)
+	{
+		if (l.cube.geometry != nullptr && isPacketReady(l.cube) && gizmos.size() < MAX_LIGHTS)
+			gizmos.push_back(&l.cube);
+	}
+	std::stable_sort(gizmos.begin(), gizmos.end(), [](const MeshPacket* a, const MeshPacket* b) { return a->geometry->firstIndex < b->geometry->firstIndex; });
+
+	uint32_t count = 0;
+	for (uint32_t first = 0; first < gizmos.size();)
+	{
+		uint32_t last = first;
+		while (last < gizmos.size() && gizmos[last]->geometry == gizmos[first]->geometry)
+		{
+			m_device.writeIndirectDrawData(lightDraws, last, &gizmos[last]->transform);
+			last++;
+		}
+
+		m_device.writeIndirectDraw(lightDraws, count++, *gizmos[first]->geometry, first, last - first);
+		first = last;
+	}
+
+	m_device.setIndirectDrawCount(lightDraws, count);
+}
+
+void Renderer::updateShaderPermutations()
+{
+	m_device.setSpecializationConstants(renderPasses[(size_t)RenderPasses::Main], phongPermutation());
+	m_device.setSpecializationConstants(renderPasses[(size_t)RenderPasses::MainAlpha], phongPermutation());
+	m_device.setSpecializationConstants(renderPasses[(size_t)RenderPasses::MainPBR], pbrPermutation());
+	m_device.setSpecializationConstants(renderPasses[(size_t)RenderPasses::MainAlphaPBR], pbrPermutation());
+	m_device.setSpecializationConstants(renderPasses[(size_t)RenderPasses::DrawPointShadowMap], { (uint32_t)usesGpuCulling() });
+}
+
+// Gribb-Hartmann, planes of a [0, 1] depth clip space, normalized so the distance to a sphere's center can be compared to its radius
+static void extractFrustumPlanes(const glm::mat4& viewProj, glm::vec4 planes[6])
+{
+	const glm::mat4 m = glm::transpose(viewProj); // Rows as columns
+	planes[0] = m[3] + m[0];
+	planes[1] = m[3] - m[0];
+	planes[2] = m[3] + m[1];
+	planes[3] = m[3] - m[1];
+	planes[4] = m[2];
+	planes[5] = m[3] - m[2];
+
+	for (int i = 0; i < 6; i++)
+	{
+		float length = glm::length(glm::vec3(planes[i]));
+		if (length > 0.0f)
+			planes[i] /= length;
+	}
 }
 
-void Renderer::drawRenderPass(const std::vector<MeshPacket>& packets) {
+void Renderer::writeCullFrustums()
+{
+	GpuFrustum* frustums = static_cast<GpuFrustum*>(cullFrustums[m_device.getCurrentFrame()].mapped_memory);
+	for (uint32_t i = 0; i < CullViewCount; i++)
+		extractFrustumPlanes(cullViewProj[i], frustums[i].planes);
+}
+
+void Renderer::drawRenderPass(const std::vector<MeshPacket>& packets, const IndirectDrawBuffer& draws, const std::vector<uint32_t>& drawIndices, const RenderQueue& queue, size_t first, size_t count) {
 	const ImageBindInfo shadowMapBindInfo = ImageBindInfo{ shadowMap->view, *defaultSampler };
 	const ImageBindInfo depthShadowMapBindInfo = ImageBindInfo{ pointShadowMap->view, *defaultSampler };
 	m_device.bindRessources(1, {&light_data_gpu, &material_data, sunViewProj.get()}, {shadowMapBindInfo, depthShadowMapBindInfo});
-	m_device.pushConstants(cameraInfo.position, sizeof(MeshPacket::PushConstantsData), 3 * sizeof(float), (StageFlags)(e_Pixel | e_Vertex));
-
-	uint32_t count = lights.size();
-	m_device.pushConstants(&count, sizeof(MeshPacket::PushConstantsData) + 3 * sizeof(float), sizeof(float), (StageFlags)(e_Pixel | e_Vertex));
 
-	m_device.pushConstants(&normal_mode, sizeof(MeshPacket::PushConstantsData) + 4 * sizeof(float), sizeof(uint32_t), (StageFlags)(e_Pixel | e_Vertex));
-	m_device.pushConstants(&debug_mode, sizeof(MeshPacket::PushConstantsData) + 5 * sizeof(float), sizeof(uint32_t), (StageFlags)(e_Pixel | e_Vertex));
-	m_device.pushConstants(&use_blinn, sizeof(MeshPacket::PushConstantsData) + 6 * sizeof(float), sizeof(uint32_t), (StageFlags)(e_Pixel | e_Vertex));
-	for (const auto& packet : packets)
+	// Eye and light count are in the UBO and everything per packet in the draw data, only the textures still change per draw
+	const Buffer& drawData = draws.drawData[m_device.getCurrentFrame()];
+	auto sameImage = [](const ImageBindInfo& a, const ImageBindInfo& b) { return a.imageview == b.imageview && a.sampl == b.sampl; };
+	for (size_t i = first; i < first + count;)
 	{
+		const MeshPacket& packet = packets[queue[i].index];
 		const ImageBindInfo baseColor = packet.getTextureBindInfo(MeshPacket::TextureType::BaseColor, getDefaultTexture(), defaultSampler);
 		const ImageBindInfo normal = packet.getTextureBindInfo(MeshPacket::TextureType::Normal, getDefaultNormalMap(), defaultSampler);
 
-		//const ImageResourceBindInfo bindInfo = ImageSampler(GET_PACKET_IMAGESAMPLER_PAIR(packet, normal, getDefaultNormalMap(), *defaultSampler));
-		m_device.bindRessources(0, {&m_device.getCurrentUniformBuffer()}, {baseColor , normal});
+		// Neighbours with the same geometry and textures have consecutive draw data, they become one instanced draw.
+		// Textures aren't bindless here so a different one still ends the run
+		size_t last = i + 1;
+		while (drawIndices[i] != UINT32_MAX && last < first + count && drawIndices[last] == drawIndices[i] + (last - i))
+		{
+			const MeshPacket& next = packets[queue[last].index];
+			if (next.geometry != packet.geometry
+				|| !sameImage(next.getTextureBindInfo(MeshPacket::TextureType::BaseColor, getDefaultTexture(), defaultSampler), baseColor)
+				|| !sameImage(next.getTextureBindInfo(MeshPacket::TextureType::Normal, getDefaultNormalMap(), defaultSampler), normal))
+				break;
+			last++;
+		}
 
-		float alphaCutoff = packet.materialData.getAlphaCutoff();
-		m_device.pushConstants(&alphaCutoff, sizeof(MeshPacket::PushConstantsData) + 7 * sizeof(float), sizeof(float), (StageFlags)(e_Pixel | e_Vertex));
-		drawPacket(packet);
+		//const ImageResourceBindInfo bindInfo = ImageSampler(GET_PACKET_IMAGESAMPLER_PAIR(packet, normal, getDefaultNormalMap(), *defaultSampler));
+		m_device.bindRessources(0, {&m_device.getCurrentUniformBuffer(), &drawData}, {baseColor , normal});
+		drawPacket(packet, drawIndices[i], static_cast<uint32_t>(last - i));
+		i = last;
 	}
 }
 
@@ -527,11 +801,11 @@ void Renderer::initPipeline()
 		.topology = PrimitiveToplogy::TriangleList,
 		.bindings = {
 			{
-				// View & proj Matrices
+				// View & proj Matrices, eye and light count
 				{
 					.slot = 0,
 					.type = BindingType::UBO,
-					.stageFlags = e_Vertex,
+					.stageFlags = e_Vertex | e_Pixel,
 				},
 				//Single texture
 				{
@@ -544,6 +818,12 @@ void Renderer::initPipeline()
 					.slot = 2,
 					.type = BindingType::ImageSampler,
 					.stageFlags = e_Pixel,
+				},
+				// Draw data, transform and alpha cutoff
+				{
+					.slot = 3,
+					.type = BindingType::StorageBuffer,
+					.stageFlags = e_Vertex | e_Pixel,
 				}
 			},
 			{
@@ -579,18 +859,8 @@ void Renderer::initPipeline()
 				}
 			}
 		},
-		.pushConstantsRanges = {
-			{
-				.offset = 0,
-				.size = sizeof(MeshPacket::PushConstantsData) + sizeof(float) * 8,
-				.stageFlags = (StageFlags)(e_Vertex | e_Pixel)
-			},
-			//{
-			//	.offset = sizeof(MeshPacket::PushConstantsData),
-			//	.size = ,
-			//	.stageFlags = (StageFlags)(e_Pixel | e_Vertex)
-			//}
-		}
+		.pushConstantsRanges = {},
+		.specializationConstants = phongPermutation(),
 	};
 
 	RenderPassDesc renderPassDesc = {
@@ -599,7 +869,8 @@ void Renderer::initPipeline()
 		.useMsaa = false,
 		.doClear = false,
 		.writeSwapChain = true,
-		.drawFunction = [&]() { drawRenderPass(packets); },
+		.drawCountFunction = [&]() { return opaqueQueue.size(); },
+		.drawRangeFunction = [&](size_t first, size_t count) { drawRenderPass(packets, opaqueDraws, opaqueDrawIndices, opaqueQueue, first, count); },
 		.debugInfo = {
 				.name = "Main Render Pass",
 				.color = DebugColor::Blue,
@@ -615,25 +886,25 @@ void Renderer::initPipeline()
 	desc.blendMode = BlendMode::AlphaBlend;
 	renderPassDesc.doClear = false;
 	renderPassDesc.debugInfo.name = "Transparent Render Pass";
-	renderPassDesc.drawFunction = [&]() { sortTransparentPackets(); drawRenderPass(transparent_packets); };
+	// Sorted back to front, few enough to stay on one thread
+	renderPassDesc.drawFunction = [&]() { drawRenderPass(transparent_packets, transparentDraws, transparentDrawIndices, transparentQueue, 0, transparentQueue.size()); };
+	renderPassDesc.drawCountFunction = nullptr;
+	renderPassDesc.drawRangeFunction = nullptr;
 	renderPasses[(size_t)RenderPasses::MainAlpha] = m_device.createRenderPassAndPipeline(renderPassDesc, desc);
 }
 
 void Renderer::drawLightsRenderPass()
 {
-	for (const auto& l : lights)
-	{
-		const MeshPacket& packet = l.cube;
-		if (l.cube.vertexBuffer != nullptr)
-		{
-			const ImageBindInfo baseColor = packet.getTextureBindInfo(MeshPacket::TextureType::BaseColor, getDefaultTexture(), defaultSampler);
-			const ImageBindInfo normal = packet.getTextureBindInfo(MeshPacket::TextureType::Normal, getDefaultNormalMap(), defaultSampler);
-			m_device.bindRessources(0, { &m_device.getCurrentUniformBuffer() }, { baseColor , normal });
+	if (lights.empty() || lights[0].cube.geometry == nullptr)
+		return;
 
-			m_device.pushConstants((void*)&l.color[0], sizeof(MeshPacket::PushConstantsData), 3 * sizeof(float), (StageFlags)(e_Vertex | e_Pixel));
-			m_device.drawPacket(packet);
-		}
-	}
+	// Every gizmo uses the default textures
+	const MeshPacket& packet = lights[0].cube;
+	const ImageBindInfo baseColor = packet.getTextureBindInfo(MeshPacket::TextureType::BaseColor, getDefaultTexture(), defaultSampler);
+	const ImageBindInfo normal = packet.getTextureBindInfo(MeshPacket::TextureType::Normal, getDefaultNormalMap(), defaultSampler);
+	m_device.bindRessources(0, { &m_device.getCurrentUniformBuffer(), &lightDraws.drawData[m_device.getCurrentFrame()] }, { baseColor , normal });
+
+	m_device.drawIndirect(lightDraws);
 }
 
 void Renderer::initDrawLightsRenderPass()
@@ -668,16 +939,15 @@ void Renderer::initDrawLightsRenderPass()
 					.slot = 2,
 					.type = BindingType::ImageSampler,
 					.stageFlags = e_Pixel,
+				},
+				// Instance transforms
+				{
+					.slot = 3,
+					.type = BindingType::StorageBuffer,
+					.stageFlags = e_Vertex,
 				}
 			}
 		},
-		.pushConstantsRanges = {
-			{
-				.offset = 0,
-				.size = sizeof(MeshPacket::PushConstantsData) + 3 * sizeof(float), // + light color
-				.stageFlags = (StageFlags)(e_Vertex | e_Pixel)
-			}
-		}
 	};
 
 	RenderPassDesc renderPassDesc = {
@@ -922,6 +1192,108 @@ void Renderer::initComputeSkyboxPasses() {
 	}
 }
 
+void Renderer::initCullPass()
+{
+	culledOpaqueDraws = m_device.createGpuIndirectDrawBuffer(MAX_DRAWS);
+	culledTransparentDraws = m_device.createGpuIndirectDrawBuffer(MAX_DRAWS);
+	culledSunDraws = m_device.createGpuIndirectDrawBuffer(MAX_DRAWS);
+	culledPointDraws = m_device.createGpuIndirectDrawBuffer(MAX_DRAWS);
+
+	for (uint32_t i = 0; i < m_device.getMaxFramesInFlight(); i++)
+	{
+		cullFrustums.push_back(m_device.createStorageBuffer(CullViewCount * sizeof(GpuFrustum)));
+		pointShadowFaceMasks.push_back(m_device.createLocalBuffer(MAX_DRAWS * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT));
+	}
+
+	PipelineDesc desc = {
+		.type = PipelineType::Compute,
+		.computeShader = "cull.slang.spv",
+		.bindings = {
+			{
+				// Source commands
+				{
+					.slot = 0,
+					.type = BindingType::StorageBuffer,
+					.stageFlags = e_Compute,
+				},
+				// Source draw data, for the transform and bounds
+				{
+					.slot = 1,
+					.type = BindingType::StorageBuffer,
+					.stageFlags = e_Compute,
+				},
+				// Frustums
+				{
+					.slot = 2,
+					.type = BindingType::StorageBuffer,
+					.stageFlags = e_Compute,
+				},
+				// Culled commands
+				{
+					.slot = 3,
+					.type = BindingType::StorageBuffer,
+					.stageFlags = e_Compute,
+				},
+				// Point shadow face masks
+				{
+					.slot = 4,
+					.type = BindingType::StorageBuffer,
+					.stageFlags = e_Compute,
+				},
+			}
+		},
+		.pushConstantsRanges = {
+			{
+				.offset = 0,
+				.size = 4 * sizeof(uint32_t), // first view, view count, compact, write face masks
+				.stageFlags = (StageFlags)(e_Compute)
+			}
+		}
+	};
+
+	ComputePassDesc computePassDesc = {
+		.dispatchFunction = [&]() { cullDraws(); },
+		.debugInfo = {
+			.name = "Cull Draws",
+			.color = DebugColor::Magenta
+		},
+		// Only reads what the CPU wrote this frame, it can run next to the previous frame's rendering
+		.async = true,
+	};
+
+	computeCullPass = m_device.createComputePass(computePassDesc, desc);
+}
+
+void Renderer::cullDraws()
+{
+	struct CullConstants {
+		uint32_t firstView;
+		uint32_t viewCount;
+		uint32_t compact;
+		uint32_t writeFaceMasks;
+	};
+
+	const uint32_t frame = m_device.getCurrentFrame();
+	auto cull = [&](const IndirectDrawBuffer& src, const IndirectDrawBuffer& dst, const CullConstants& constants) {
+		m_device.clearIndirectDrawCount(dst);
+		m_device.bindRessources(0, { &src.commands[frame], &src.drawData[frame], &cullFrustums[frame], &dst.commands[frame], &pointShadowFaceMasks[frame] }, {}, PipelineType::Compute);
+		m_device.pushConstants(&constants, 0, sizeof(CullConstants), e_Compute);
+		m_device.dispatchCommand((src.counts[frame] + 63) / 64, 1, 1);
+	};
+
+	cull(opaqueDraws, culledOpaqueDraws, { .firstView = CullMain, .viewCount = 1, .compact = 1 });
+	// Kept in place, compacting would lose the back to front order
+	cull(transparentDraws, culledTransparentDraws, { .firstView = CullMain, .viewCount = 1, .compact = 0 });
+	cull(opaqueDraws, culledSunDraws, { .firstView = CullSun, .viewCount = 1, .compact = 1 });
+	// One draw for the 6 faces, the geometry shader skips the faces a draw is not in
+	cull(opaqueDraws, culledPointDraws, { .firstView = CullPointFaces, .viewCount = 6, .compact = 1, .writeFaceMasks = 1 });
+
+	// Drawn on the graphics queue, does nothing if culling runs there too
+	for (const IndirectDrawBuffer* draws : { &culledOpaqueDraws, &culledTransparentDraws, &culledSunDraws, &culledPointDraws })
+		m_device.releaseToGraphics(draws->commands[frame]);
+	m_device.releaseToGraphics(pointShadowFaceMasks[frame]);
+}
+
 
 void Renderer::initSkyboxRenderPass()
 {
@@ -955,6 +1327,7 @@ void Renderer::initSkyboxRenderPass()
 		.useMsaa = device_options.usesMsaa,
 		.doClear = true,
 		.writeSwapChain = true,
+		.cacheCommands = true,
 		.drawFunction = [&]() { 
 				m_device.bindRessources(0, { &m_device.getCurrentUniformBuffer() }, {{ specularMap->view, *defaultSampler}});
 				m_device.drawCommand(36);
@@ -996,15 +1369,14 @@ void Renderer::initDrawShadowMapRenderPass()
 					.type = BindingType::UBO,
 					.stageFlags = e_Vertex,
 				},
+				// Draw data, only the model matrix is read
+				{
+					.slot = 1,
+					.type = BindingType::StorageBuffer,
+					.stageFlags = e_Vertex,
+				},
 			}
 		},
-		.pushConstantsRanges = {
-			{
-				.offset = 0,
-				.size = sizeof(MeshPacket::PushConstantsData),
-				.stageFlags = (StageFlags)(e_Vertex | e_Pixel)
-			}
-		}
 	};
 
 	RenderPassDesc renderPassDesc = {
@@ -1018,12 +1390,10 @@ void Renderer::initDrawShadowMapRenderPass()
 		.hasDepth = true,
 		.useMsaa = false,
 		.doClear = true,
-		.drawFunction = [&]() { 
-			m_device.bindRessources(0, { sunViewProj.get()}, {});
-			for (const auto& packet : packets)
-			{
-				drawPacket(packet);
-			}	
+		.cacheCommands = true,
+		.drawFunction = [&]() {
+			m_device.bindRessources(0, { sunViewProj.get(), &opaqueDraws.drawData[m_device.getCurrentFrame()] }, {});
+			m_device.drawIndirect(usesGpuCulling() ? culledSunDraws : opaqueDraws);
 		},
 		.postDrawBarriers = {
 			{
@@ -1070,15 +1440,21 @@ void Renderer::initDrawPointShadowMapRenderPass()
 					.type = BindingType::UBO,
 					.stageFlags = e_Geometry | e_Pixel,
 				},
+				// Draw data, only the model matrix is read
+				{
+					.slot = 1,
+					.type = BindingType::StorageBuffer,
+					.stageFlags = e_Vertex,
+				},
+				// Cube faces of each draw that passed culling
+				{
+					.slot = 2,
+					.type = BindingType::StorageBuffer,
+					.stageFlags = e_Geometry,
+				},
 			}
 		},
-		.pushConstantsRanges = {
-			{
-				.offset = 0,
-				.size = sizeof(MeshPacket::PushConstantsData),
-				.stageFlags = (StageFlags)(e_Vertex | e_Pixel | e_Geometry)
-			}
-		}
+		.specializationConstants = { (uint32_t)usesGpuCulling() },
 	};
 
 	RenderPassDesc renderPassDesc = {
@@ -1093,12 +1469,11 @@ void Renderer::initDrawPointShadowMapRenderPass()
 		.hasDepth = true,
 		.useMsaa = false,
 		.doClear = true,
+		.cacheCommands = true,
 		.drawFunction = [&]() {
-			m_device.bindRessources(0, { pointLightViewProj.get()}, {});
-			for (const auto& packet : packets)
-			{
-				drawPacket(packet);
-			}
+			const uint32_t frame = m_device.getCurrentFrame();
+			m_device.bindRessources(0, { pointLightViewProj.get(), &opaqueDraws.drawData[frame], &pointShadowFaceMasks[frame] }, {});
+			m_device.drawIndirect(usesGpuCulling() ? culledPointDraws : opaqueDraws);
 		},
 		.postDrawBarriers = {
 			{
@@ -1118,7 +1493,7 @@ void Renderer::initDrawPointShadowMapRenderPass()
 	renderPasses[(size_t)RenderPasses::DrawPointShadowMap] = m_device.createRenderPassAndPipeline(renderPassDesc, desc);
 }
 
-void Renderer::drawRenderPassPBR(const std::vector<MeshPacket>& packets) {
+void Renderer::drawRenderPassPBR(const IndirectDrawBuffer& draws, const IndirectDrawBuffer& culledDraws) {
 	const ImageBindInfo irradiance = { irradianceMap->view , *defaultSampler};
 	const ImageBindInfo specular = { specularMap->view , *defaultSampler};
 	const ImageBindInfo brdf = { BRDF_LUT->view , *defaultSampler };
@@ -1126,31 +1501,11 @@ void Renderer::drawRenderPassPBR(const std::vector<MeshPacket>& packets) {
 	const ImageBindInfo depthShadowMapBindInfo = ImageBindInfo{ pointShadowMap->view, *defaultSampler };
 	m_device.bindRessources(1, { &light_data_gpu, sunViewProj.get()}, {irradiance, specular, brdf, shadowMapBindInfo, depthShadowMapBindInfo});
 
-	uint32_t count = lights.size();
-	size_t start_offset = sizeof(MeshPacket::PushConstantsData);
+	// Everything per packet is in the draw data, the whole list is a single draw call
+	m_device.bindRessources(0, { &m_device.getCurrentUniformBuffer(), &materialTable, &draws.drawData[m_device.getCurrentFrame()] }, {});
+	m_device.bindBindlessTable();
 
-	m_device.pushConstants(cameraInfo.position, start_offset, 3 * sizeof(float), (StageFlags)(e_Vertex | e_Pixel));
-	m_device.pushConstants(&count, start_offset + 3 * sizeof(float), sizeof(float), (StageFlags)(e_Vertex | e_Pixel));
-	m_device.pushConstants(&normal_mode, start_offset + 4 * sizeof(float), sizeof(uint32_t), (StageFlags)(e_Vertex | e_Pixel));
-	m_device.pushConstants(&debug_mode, start_offset + 5 * sizeof(float), sizeof(uint32_t), (StageFlags)(e_Vertex | e_Pixel));
-	m_device.pushConstants(&use_ibl, start_offset + 6 * sizeof(float), sizeof(uint32_t), (StageFlags)(e_Vertex | e_Pixel));
-
-	start_offset += 7 * sizeof(float) + sizeof(float); // 2 is padding
-	for (const auto& packet : packets)
-	{
-		const ImageBindInfo baseColor = packet.getTextureBindInfo(MeshPacket::TextureType::BaseColor, getDefaultTexture(), defaultSampler);
-		const ImageBindInfo normal = packet.getTextureBindInfo(MeshPacket::TextureType::Normal, getDefaultNormalMap(), defaultSampler);
-		const ImageBindInfo  mettalicRoughness = packet.getTextureBindInfo(MeshPacket::TextureType::MetallicRoughness, getDefaultTexture(), defaultSampler);
-		const ImageBindInfo  occlusion = packet.getTextureBindInfo(MeshPacket::TextureType::Occlusion, getDefaultTexture(), defaultSampler);
-		const ImageBindInfo  emissive = packet.getTextureBindInfo(MeshPacket::TextureType::Emissive, getDefaultTextureBlack(), defaultSampler);
-		m_device.bindRessources(0, { &m_device.getCurrentUniformBuffer() }, { baseColor, normal, mettalicRoughness, occlusion, emissive });
-
-		float alphaCutoff = packet.materialData.getAlphaCutoff();
-
-		m_device.pushConstants(&packet.materialData.pbrFactors, start_offset, sizeof(Mesh::Material::PBRFactors), (StageFlags)(e_Vertex | e_Pixel));
-		m_device.pushConstants(&alphaCutoff, start_offset + sizeof(Mesh::Material::PBRFactors), sizeof(float), (StageFlags)(e_Vertex | e_Pixel));
-		drawPacket(packet);
-	}
+	m_device.drawIndirect(usesGpuCulling() ? culledDraws : draws);
 }
 
 void Renderer::initPipelinePBR()
@@ -1171,41 +1526,23 @@ void Renderer::initPipelinePBR()
 		.topology = PrimitiveToplogy::TriangleList,
 		.bindings = {
 			{
-				// View & proj Matrices
+				// View & proj Matrices, eye and light count
 				{
 					.slot = 0,
 					.type = BindingType::UBO,
-					.stageFlags = e_Vertex,
+					.stageFlags = e_Vertex | e_Pixel,
 				},
-				//Base Color
+				// Material table, textures themselves are in the bindless set
 				{
 					.slot = 1,
-					.type = BindingType::ImageSampler,
+					.type = BindingType::StorageBuffer,
 					.stageFlags = e_Pixel,
 				},
-				// Normal
+				// Draw data, transform and material factors
 				{
 					.slot = 2,
-					.type = BindingType::ImageSampler,
-					.stageFlags = e_Pixel,
-				},
-				// MetallicRoughness
-				{
-					.slot = 3,
-					.type = BindingType::ImageSampler,
-					.stageFlags = e_Pixel,
-				},
-				// Occlusion
-				{
-					.slot = 4,
-					.type = BindingType::ImageSampler,
-					.stageFlags = e_Pixel,
-				},
-				// Emissive
-				{
-					.slot = 5,
-					.type = BindingType::ImageSampler,
-					.stageFlags = e_Pixel,
+					.type = BindingType::StorageBuffer,
+					.stageFlags = e_Vertex | e_Pixel,
 				}
 			},
 			{
@@ -1253,13 +1590,8 @@ void Renderer::initPipelinePBR()
 				}
 			}
 		},
-		.pushConstantsRanges = {
-			{
-				.offset = 0,
-				.size = sizeof(MeshPacket::PushConstantsData) + sizeof(float) * 7 + sizeof(Mesh::Material::PBRFactors) + 8 /*padding*/,
-				.stageFlags = (StageFlags)(e_Vertex | e_Pixel)
-			}
-		}
+		.useBindlessTextures = true,
+		.specializationConstants = pbrPermutation(),
 	};
 
 	RenderPassDesc renderPassDesc = {
@@ -1268,7 +1600,8 @@ void Renderer::initPipelinePBR()
 		.useMsaa = false,
 		.doClear = false,
 		.writeSwapChain = true,
-		.drawFunction = [&]() { drawRenderPassPBR(packets); },
+		.cacheCommands = true,
+		.drawFunction = [&]() { drawRenderPassPBR(opaqueDraws, culledOpaqueDraws); },
 		.debugInfo = {
 				.name = "Main Render Pass PBR",
 				.color = DebugColor::Blue,
@@ -1280,23 +1613,25 @@ void Renderer::initPipelinePBR()
 	desc.blendMode = BlendMode::AlphaBlend;
 	renderPassDesc.doClear = false;
 	renderPassDesc.debugInfo.name = "Main Render Pass PBR Alpha Blend";
-	renderPassDesc.drawFunction = [&]() { drawRenderPassPBR(transparent_packets); };
+	renderPassDesc.drawFunction = [&]() { drawRenderPassPBR(transparentDraws, culledTransparentDraws); }; // The back to front order is in the buffer, can stay cached
 	renderPasses[(size_t)RenderPasses::MainAlphaPBR] = m_device.createRenderPassAndPipeline(renderPassDesc, desc);
 }
 
 
 void Renderer::updateParticles()
 {
-	const uint32_t current_frame = m_device.getCurrentFrame();
-	const uint32_t last_frame = (current_frame + 1) % m_device.getMaxFramesInFlight();
+	// Not the frame index, with one frame in flight it would read and write the same buffer
+	const uint32_t count = static_cast<uint32_t>(particleStorageBuffers.size());
+	const uint32_t last_buffer = currentParticleBuffer;
+	currentParticleBuffer = (currentParticleBuffer + 1) % count;
 
-	m_device.bindRessources(0, { &m_device.getCurrentComputeUniformBuffer(), &particleStorageBuffers[last_frame], &particleStorageBuffers[current_frame] }, {}, PipelineType::Compute);
+	m_device.bindRessources(0, { &m_device.getCurrentComputeUniformBuffer(), &particleStorageBuffers[last_buffer], &particleStorageBuffers[currentParticleBuffer] }, {}, PipelineType::Compute);
 	m_device.dispatchCommand(PARTICLE_COUNT / 256, 1, 1);
 }
 
 void Renderer::drawParticles()
 {
-	m_device.bindVertexBuffer(particleStorageBuffers[m_device.getCurrentFrame()]);
+	m_device.bindVertexBuffer(particleStorageBuffers[currentParticleBuffer]);
 	m_device.drawCommand(PARTICLE_COUNT);
 }
 
@@ -1500,7 +1835,9 @@ void Renderer::initTestPipeline2()
 
 void Renderer::initParticlesBuffers()
 {
-	particleStorageBuffers.resize(2);
+	// One per frame in flight, but always two so the update reads and writes different buffers
+	particleStorageBuffers.resize(std::max(m_device.getMaxFramesInFlight(), 2u));
+	currentParticleBuffer = 0;
 	// Initialize particles
 	std::default_random_engine rndEngine((unsigned)time(nullptr));
 	std::uniform_real_distribution<float> rndDist(0.0f, 1.0f);
@@ -1520,7 +1857,7 @@ void Renderer::initParticlesBuffers()
 	VkDeviceSize bufferSize = sizeof(Particle) * PARTICLE_COUNT;
 
 	//TODO change this to not allocate the staging buffer 3 times
-	for (size_t i = 0; i < 2; i++) {
+	for (size_t i = 0; i < particleStorageBuffers.size(); i++) {
 		particleStorageBuffers[i] = m_device.createLocalBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, particles.data());
 		particleStorageBuffers[i].size = bufferSize;
 		particleStorageBuffers[i].stride = sizeof(Particle);
@@ -1567,8 +1904,6 @@ MeshPacket Renderer::createPacket(std::filesystem::path path, std::string textur
 	out_packet.name = path.filename().replace_extension("").string();
 
 	//m_device.SetImageName(out_packet.texture.image, (out_packet.name + "/BaseColor").c_str());
-	m_device.SetBufferName(out_packet.vertexBuffer->buffer, (out_packet.name + "/VertexBuffer").c_str());
-	m_device.SetBufferName(out_packet.indexBuffer->buffer, (out_packet.name + "/IndexBuffer").c_str());
 
 	for (int i = 0; i < out_packet.textures.size();  i++)
 	{
@@ -1588,6 +1923,7 @@ void Renderer::loadSkybox(const std::array<const char*, 6>& faces)
 	const Texture cubeMap = loadCubemapTexture(faces);
 	
 	skyboxTexture = m_resourceManager.createTexture(cubeMap);
+	m_device.waitUpload(skyboxTexture->upload);
 }
 
 void Renderer::loadSkybox(const std::filesystem::path path)
@@ -1596,10 +1932,14 @@ void Renderer::loadSkybox(const std::filesystem::path path)
 	const Texture equirectangular = loadTexture(path.string().c_str());
 
 	equirectangularTexture = m_resourceManager.createTexture(equirectangular);
+	// Needed right away by the IBL compute passes
+	m_device.waitUpload(equirectangularTexture->upload);
 	resultCubemap = m_resourceManager.createRWTexture(2048, 2048, ImageFormat::RGBA_Float, true, true);
 	irradianceMap = m_resourceManager.createRWTexture(32, 32, ImageFormat::RGBA_Float,  true);
 	specularMap = m_resourceManager.createRWTexture(1024, 1024, ImageFormat::RGBA_Float,  true, true);
 	BRDF_LUT = m_resourceManager.createRWTexture(512, 512, ImageFormat::RG16_Float, false, false);
+	// The skybox and PBR passes have the old maps recorded
+	m_device.invalidateCachedCommands();
 }
 
 SamplerDesc getSamplerDesc(const SamplerInfo& info) {
@@ -1637,10 +1977,19 @@ void Renderer::loadScene(std::filesystem::path path)
 	if (path.extension() != ".gltf")
 		return;
 
+	ZoneScopedN("Renderer::loadScene");
+	using clock = std::chrono::steady_clock;
+	const clock::time_point start = clock::now();
 
 	Scene out_scene;
 	loadGltf(path.string().c_str(), &out_scene);
 
+	const clock::time_point parsed = clock::now();
+	const uint64_t firstBatch = m_device.getUploadBatchCount();
+
+	// Every copy, transition and mip generation of the scene goes in the same submission
+	Device::UploadBatchScope uploadBatch(&m_device);
+
 	std::vector<GpuImageHandle> loaded_textures;
 	for(const Texture& t : out_scene.textures)
 	{
@@ -1670,9 +2019,6 @@ void Renderer::loadScene(std::filesystem::path path)
 
 				packet.name = node.name;
 
-				m_device.SetBufferName(packet.vertexBuffer->buffer, (packet.name + "/VertexBuffer").c_str());
-				m_device.SetBufferName(packet.indexBuffer->buffer, (packet.name + "/IndexBuffer").c_str());
-
 				addPacket(packet);
 			}
 		}
@@ -1688,12 +2034,21 @@ void Renderer::loadScene(std::filesystem::path path)
 		loadNode(node);
 	}
 
+	lastSceneLoad.token = uploadBatch.end();
+	lastSceneLoad.name = path.filename().string();
+	lastSceneLoad.parseMs = std::chrono::duration<double, std::milli>(parsed - start).count();
+	lastSceneLoad.recordMs = std::chrono::duration<double, std::milli>(clock::now() - parsed).count();
+	lastSceneLoad.uploadBatches = m_device.getUploadBatchCount() - firstBatch;
+	lastSceneLoad.start = start;
+	lastSceneLoad.pending = true;
 }
 
 void Renderer::destroyPacket(MeshPacket packet)
 {
-	//m_device.destroyBuffer(packet.vertexBuffer);
-	//m_device.destroyBuffer(packet.indexBuffer);
+	m_device.invalidateCachedCommands();
+	destroyMaterial(packet.materialData.materialIndex);
+
+	//m_device.destroyMeshGeometry(packet.geometry);
 
 	//m_device.destroyImage(packet.texture);
 	//m_device.destroySampler(packet.sampler);
@@ -1723,25 +2078,76 @@ void Renderer::destroyAllPackets()
 
 void Renderer::addPacket(const MeshPacket& packet)
 {
-	if (packet.materialData.alphaCoverage.alphaMode == MeshPacket::MaterialData::AlphaCoverage::AlphaMode::Blend)
-	{
-		transparent_packets.push_back(packet);
+	std::vector<MeshPacket>& dst = packet.materialData.alphaCoverage.alphaMode == MeshPacket::MaterialData::AlphaCoverage::AlphaMode::Blend ? transparent_packets : packets;
+
+	MeshPacket& added = dst.emplace_back(packet);
+	added.materialData.materialIndex = createMaterial(added);
+	m_device.invalidateCachedCommands();
+}
+
+uint32_t Renderer::createMaterial(const MeshPacket& packet)
+{
+	uint32_t index;
+	if (!freeMaterials.empty()) {
+		index = freeMaterials.back();
+		freeMaterials.pop_back();
 	}
-	else
+	else {
+		if (materialCount >= MAX_MATERIALS)
+			throw std::runtime_error("failed to create material : material table is full");
+		index = materialCount++;
+	}
+
+	// Fallbacks for the missing textures, in TextureType order
+	const GpuImageHandle defaults[MeshPacket::TextureType::Nb] = { getDefaultTexture(), getDefaultTexture(), getDefaultNormalMap(), getDefaultTextureBlack(), getDefaultTexture() };
+
+	GpuMaterial material;
+	for (int type = 0; type < MeshPacket::TextureType::Nb; type++)
 	{
-		packets.push_back(packet);
+		const MeshPacket::ImageSamplerIndices indices = packet.materialData.texturesIdx[type];
+		const GpuImageHandle& image = indices.texIdx >= 0 ? packet.textures[indices.texIdx] : defaults[type];
+		const SamplerHandle& sampler = indices.samplerIdx >= 0 ? packet.samplers[indices.samplerIdx] : defaultSampler;
+
+		material.textures[type] = m_device.registerTexture(*image);
+		material.samplers[type] = m_device.registerSampler(*sampler);
 	}
+
+	// Never read by frames in flight, the slot was either unused or freed after a waitIdle
+	memcpy(static_cast<GpuMaterial*>(materialTable.mapped_memory) + index, &material, sizeof(GpuMaterial));
+
+	return index;
+}
+
+void Renderer::destroyMaterial(uint32_t index)
+{
+	if (index != UINT32_MAX)
+		freeMaterials.push_back(index);
 }
 
-void Renderer::drawPacket(const MeshPacket& packet)
+bool Renderer::isPacketReady(const MeshPacket& packet)
 {
-	m_device.drawPacket(packet);
+	if (!m_device.isUploadComplete(packet.geometry->upload))
+		return false;
+
+	return std::all_of(packet.textures.begin(), packet.textures.end(), [&](const GpuImageHandle& tex) { return m_device.isUploadComplete(tex->upload); });
+}
+
+void Renderer::drawPacket(const MeshPacket& packet, uint32_t drawIndex, uint32_t instanceCount)
+{
+	// Still uploading, it will show up in a few frames. Cached passes have to be recorded again until then
+	// Packets that weren't ready when the draw data was written don't have an entry
+	if (drawIndex == UINT32_MAX) {
+		m_device.invalidateCachedCommands();
+		return;
+	}
+
+	m_device.drawPacket(packet, drawIndex, instanceCount);
 }
 
 
 void Renderer::cleanupParticles()
 {
-	for (int i = 0; i < 2; i++)
+	for (size_t i = 0; i < particleStorageBuffers.size(); i++)
 	{
 		m_device.destroyBuffer(particleStorageBuffers[i]);
 	}
@@ -1762,6 +2168,9 @@ void Renderer::updateUniformBuffer() {
 	ubo.view = glm::lookAt(pos, center, up);
 	ubo.proj = glm::perspective(glm::radians(45.0f), dim.width / (float)dim.height, 0.1f, 50.0f);
 	ubo.proj[1][1] *= -1;
+	ubo.eye = pos;
+	cullViewProj[CullMain] = ubo.proj * ubo.view;
+	ubo.lightCount = lights.size();
 
 
 	m_device.updateUniformBuffer(&ubo, sizeof(UniformBufferObject));
@@ -1870,6 +2279,7 @@ void Renderer::updateLightData()
 			glm::vec3(0.0f, 1.0f, 0.0f)
 		);
 		memcpy(sunViewProj->mapped_memory, &sun_ubo, sizeof(UniformBufferObject));
+		cullViewProj[CullSun] = sun_ubo.proj * sun_ubo.view;
 	}
 
 	if (pointlight_ptr && pointLightViewProj->buffer != VK_NULL_HANDLE)
@@ -1889,6 +2299,7 @@ void Renderer::updateLightData()
 		};
 		size_t view_size = sizeof(shadowViews);
 		memcpy(pointLightViewProj->mapped_memory, shadowViews, view_size );
+		std::copy(std::begin(shadowViews), std::end(shadowViews), &cullViewProj[CullPointFaces]);
 		memcpy((uint8_t*)pointLightViewProj->mapped_memory + view_size, &lightPos[0], 3 * sizeof(float));
 		memcpy((uint8_t*)pointLightViewProj->mapped_memory + view_size + 3*sizeof(float), &farPlane, sizeof(float));
 	}
@@ -1953,8 +2364,7 @@ void Renderer::addSpotlight(const float pos[3])
 MeshPacket Renderer::createPacket(const Mesh& mesh, const std::vector<GpuImageHandle>& textures, const std::vector<SamplerHandle>& samplers)
 {
 	MeshPacket out_packet;
-	out_packet.vertexBuffer = m_resourceManager.createVertexBuffer(mesh.vertices.size() * sizeof(mesh.vertices[0]), (void*)mesh.vertices.data());
-	out_packet.indexBuffer = m_resourceManager.createIndexBuffer(mesh.indices.size() * sizeof(mesh.indices[0]), (void*)mesh.indices.data());
+	out_packet.geometry = m_resourceManager.createMeshGeometry(mesh.vertices.data(), mesh.vertices.size(), mesh.indices.data(), mesh.indices.size());
 
 
 	memcpy(&out_packet.materialData.pbrFactors, &mesh.material.pbrFactors, sizeof(mesh.material.pbrFactors));
@@ -2011,10 +2421,13 @@ MeshPacket Renderer::createCubePacket(const float pos[3], float size)
 {
 	MeshPacket out_packet;
 
-	auto vertices = Vertex::getCubeVertices();
-	auto indices = Vertex::getCubeIndices();
-	out_packet.vertexBuffer = m_resourceManager.createVertexBuffer(vertices.size() * sizeof(vertices[0]), (void*)vertices.data());
-	out_packet.indexBuffer = m_resourceManager.createIndexBuffer(indices.size() * sizeof(indices[0]), (void*)indices.data());
+	if (cubeGeometry == nullptr)
+	{
+		auto vertices = Vertex::getCubeVertices();
+		auto indices = Vertex::getCubeIndices();
+		cubeGeometry = m_resourceManager.createMeshGeometry(vertices.data(), vertices.size(), indices.data(), indices.size());
+	}
+	out_packet.geometry = cubeGeometry;
 
 
 	out_packet.textures.push_back(getDefaultTexture());
@@ -2036,10 +2449,13 @@ MeshPacket Renderer::createConePacket(const float pos[3], float size)
 {
 	MeshPacket out_packet;
 
-	auto vertices = Vertex::getConeVertices();
-	auto indices = Vertex::getConeIndices();
-	out_packet.vertexBuffer = m_resourceManager.createVertexBuffer(vertices.size() * sizeof(vertices[0]), (void*)vertices.data());
-	out_packet.indexBuffer = m_resourceManager.createIndexBuffer(indices.size() * sizeof(indices[0]), (void*)indices.data());
+	if (coneGeometry == nullptr)
+	{
+		auto vertices = Vertex::getConeVertices();
+		auto indices = Vertex::getConeIndices();
+		coneGeometry = m_resourceManager.createMeshGeometry(vertices.data(), vertices.size(), indices.data(), indices.size());
+	}
+	out_packet.geometry = coneGeometry;
 
 
 	out_packet.textures.push_back(getDefaultTexture());
@@ -2060,21 +2476,16 @@ MeshPacket Renderer::createSpherePacket(const float pos[3], float size)
 {
 	MeshPacket out_packet;
 
-	static BufferHandle vertexBuffer;
-	static BufferHandle indexBuffer;
-
-	if (vertexBuffer == nullptr)
+	if (sphereGeometry == nullptr)
 	{
 		auto vertices = Vertex::generateSphereVertices();
 		auto indices = Vertex::generateSphereIndices();
 		Vertex::ComputeTangents(vertices, indices);
-		vertexBuffer = m_resourceManager.createVertexBuffer(vertices.size() * sizeof(vertices[0]), (void*)vertices.data());
-		indexBuffer = m_resourceManager.createIndexBuffer(indices.size() * sizeof(indices[0]), (void*)indices.data());
+		sphereGeometry = m_resourceManager.createMeshGeometry(vertices.data(), vertices.size(), indices.data(), indices.size());
 	}
 
 
-	out_packet.vertexBuffer = vertexBuffer;
-	out_packet.indexBuffer = indexBuffer;
+	out_packet.geometry = sphereGeometry;
 	out_packet.textures.push_back(getDefaultTexture());
 	out_packet.samplers.push_back(defaultSampler);
 	out_packet.name = "Sphere";
@@ -2,8 +2,12 @@
 
 #include "Device.h"
 #include "ResourceManager.h"
+#include "RenderQueue.h"
 
 #include <filesystem>
+#include <chrono>
+#include <string>
+#include <cstddef>
 
 class Renderer {
 
@@ -115,6 +119,8 @@ private:
 	VkDescriptorPool computeDescriptorPool;
 
 	std::vector<Buffer> particleStorageBuffers;
+	// Written by this frame's update and drawn, the previous one is read. Advances once per update
+	uint32_t currentParticleBuffer = 0;
 
 	GpuImageHandle skyboxTexture;
 	GpuImageHandle equirectangularTexture;
@@ -133,21 +139,109 @@ private:
 	GpuImageHandle defaultNormalMap;
 	SamplerHandle defaultSampler;
 
+	// Shared by every packet of the shape so they can be instanced, created on first use
+	MeshGeometryHandle cubeGeometry;
+	MeshGeometryHandle coneGeometry;
+	MeshGeometryHandle sphereGeometry;
+
 	std::vector<MeshPacket> packets;
 	std::vector<MeshPacket> transparent_packets;
+	// Rebuilt each frame, draw order of packets and transparent_packets
+	RenderQueue opaqueQueue;
+	RenderQueue transparentQueue;
+
+	// Bindless indices of each packet textures, the PBR pass only pushes the index of the entry
+	struct GpuMaterial {
+		uint32_t textures[MeshPacket::TextureType::Nb];
+		uint32_t samplers[MeshPacket::TextureType::Nb];
+	};
+	static constexpr uint32_t MAX_MATERIALS = 4096;
+	Buffer materialTable;
+	uint32_t materialCount = 0;
+	std::vector<uint32_t> freeMaterials;
+
+	// Per draw data of every packet pass, rebuilt each frame. The shaders index it with the draw's firstInstance
+	struct GpuDrawData {
+		glm::mat4 model;
+		MeshPacket::MaterialData::PBRFactors pbrFactors;
+		float alphaCutoff;
+		uint32_t materialIndex;
+		uint32_t pad[3];
+		float boundingSphere[4]; // Mesh space
+		glm::mat4 normalMatrix; // Inverse transpose of the model's 3x3, kept as a mat4 so the shaders can cast it like the model
+	};
+	static_assert(sizeof(GpuDrawData) == 192, "GpuDrawData must match DrawData in pbr.slang");
+	static_assert(offsetof(GpuDrawData, boundingSphere) == 112, "cull.slang reads the bounding sphere at this offset");
+	// Every packet has its own material, there can't be more draws than that
+	static constexpr uint32_t MAX_DRAWS = MAX_MATERIALS;
+	IndirectDrawBuffer opaqueDraws;
+	IndirectDrawBuffer transparentDraws;
+	// Draw data index of each queue entry for the passes still drawing packet by packet, UINT32_MAX while not ready
+	std::vector<uint32_t> opaqueDrawIndices;
+	std::vector<uint32_t> transparentDrawIndices;
+
+	// GPU frustum culling of the lists above, once per view. Needs drawIndirectCount, everything is drawn otherwise
+	enum CullView {
+		CullMain,
+		CullSun,
+		CullPointFaces, // 6 of them, cubemap face order
+		CullViewCount = CullPointFaces + 6
+	};
+	struct GpuFrustum {
+		glm::vec4 planes[6];
+	};
+	bool gpuCulling = true;
+	glm::mat4 cullViewProj[CullViewCount] = {}; // Zero for views that don't exist, nothing gets culled
+	std::vector<Buffer> cullFrustums;			// Per frame in flight
+	std::vector<Buffer> pointShadowFaceMasks;	// Per frame in flight, a bit per cube face for each draw
+	IndirectDrawBuffer culledOpaqueDraws;
+	IndirectDrawBuffer culledTransparentDraws;
+	IndirectDrawBuffer culledSunDraws;
+	IndirectDrawBuffer culledPointDraws;
+	ComputePass computeCullPass;
+
+	struct SceneLoadStats {
+		std::string name;
+		double parseMs = 0.0;	// gltf parsing
+		double recordMs = 0.0;	// Resource creation and upload recording
+		double totalMs = 0.0;	// Until the GPU is done with the uploads
+		uint64_t uploadBatches = 0;
+
+		UploadToken token;
+		std::chrono::steady_clock::time_point start;
+		bool pending = false;
+	} lastSceneLoad;
+	struct StartupStats {
+		double pipelineSubmitMs = 0.0;	// Layouts created and compile jobs queued
+		double firstFrameMs = 0.0;		// From init to the end of the first draw, waits on the pipelines that frame uses
+		std::chrono::steady_clock::time_point start;
+		bool firstFrameDone = false;
+	} startup;
 	std::vector<Light> lights;
+	static constexpr uint32_t MAX_LIGHTS = 10; // Size of the shaders light array
+	IndirectDrawBuffer lightDraws; // Light gizmos, instanced per shape
 
 	CameraInfo cameraInfo;
 
-	void sortTransparentPackets();
+	void buildRenderQueues();
+	// Once beginDraw waited on the frame slot, the buffers are per frame in flight
+	void writeIndirectDraws(IndirectDrawBuffer& draws, std::vector<uint32_t>& drawIndices, const std::vector<MeshPacket>& src, const RenderQueue& queue);
+	void writeLightDraws();
+	bool usesGpuCulling() { return gpuCulling && m_device.usesIndirectDrawCount(); }
+	void writeCullFrustums();
+	void updateShaderPermutations();
+	bool isPacketReady(const MeshPacket& packet);
+	uint32_t createMaterial(const MeshPacket& packet);
+	void destroyMaterial(uint32_t index);
 	//Draw callbacks
-	void drawRenderPass(const std::vector<MeshPacket>& packets);
-	void drawRenderPassPBR(const std::vector<MeshPacket>& packets);
+	void drawRenderPass(const std::vector<MeshPacket>& packets, const IndirectDrawBuffer& draws, const std::vector<uint32_t>& drawIndices, const RenderQueue& queue, size_t first, size_t count);
+	void drawRenderPassPBR(const IndirectDrawBuffer& draws, const IndirectDrawBuffer& culledDraws);
 	void drawParticles();
 	void drawLightsRenderPass();
 
 	//Compute callbacks
 	void updateParticles();
+	void cullDraws();
 
 	double lastTime;
 	double lastFrameTime;
@@ -161,6 +255,7 @@ private:
 
 	void initDrawLightsRenderPass();
 	void initComputeSkyboxPasses();
+	void initCullPass();
 	void initSkyboxRenderPass();
 
 	void initDrawShadowMapRenderPass();
@@ -191,7 +286,7 @@ public:
 	void loadSkybox(const std::filesystem::path); // equirectangular
 	void loadScene(std::filesystem::path path);
 	void addPacket(const MeshPacket& packet);
-	void drawPacket(const MeshPacket& packet);
+	void drawPacket(const MeshPacket& packet, uint32_t drawIndex, uint32_t instanceCount = 1);
 	void destroyPacket(MeshPacket packet);
 	void destroyAllPackets();
 
@@ -38,6 +38,9 @@ private:
 	std::array<Sampler, 256> m_samplers;
 	size_t m_sampler_count = 0;
 
+	std::array<MeshGeometry, 2048> m_geometries;
+	size_t m_geometry_count = 0;
+
 public:
 	ResourceManager(Device* device) : m_device(device) { }
 	~ResourceManager() {}
@@ -90,9 +93,21 @@ public:
 	}
 
 
+	MeshGeometryHandle createMeshGeometry(const void* vertices, size_t vertexCount, const uint32_t* indices, size_t indexCount) {
+		m_geometries[m_geometry_count++] = m_device->createMeshGeometry(vertices, vertexCount, indices, indexCount);
+		MeshGeometry* geometry = &m_geometries[m_geometry_count - 1];
+		geometry->id = static_cast<uint32_t>(m_geometry_count - 1);
+
+		return MeshGeometryHandle(geometry, [this](MeshGeometry* geometry) {
+			m_device->destroyMeshGeometry(*geometry);
+			});
+	}
+
+
 	GpuImageHandle createTexture(const Texture& texture) {
 		m_textures[m_texture_count++] = m_device->createTexture(texture);
 		GpuImage* img = &m_textures[m_texture_count - 1];
+		m_device->registerTexture(*img);
 
 		return GpuImageHandle(img, [this](GpuImage* img) {
 			m_device->destroyImage(*img);
@@ -130,6 +145,7 @@ public:
 	SamplerHandle createSampler(SamplerDesc desc)
 	{
 		m_samplers[m_sampler_count++] = m_device->createTextureSampler(desc);
+		m_device->registerSampler(m_samplers[m_sampler_count - 1]);
 
 		return SamplerHandle(&m_samplers[m_sampler_count - 1], [this](Sampler* sampl) {
 			m_device->destroySampler(*sampl);
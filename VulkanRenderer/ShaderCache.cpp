@@ -0,0 +1,141 @@
+#include "ShaderCache.h"
+#include "FileUtils.h"
+
+#include <stdexcept>
+#include <functional>
+
+// FNV-1a, only used to tell two versions of a file apart
+static uint64_t hashContent(const std::vector<char>& data)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (char c : data) {
+		hash ^= static_cast<uint8_t>(c);
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+size_t ShaderModuleCache::KeyHasher::operator()(const Key& k) const
+{
+	size_t seed = std::hash<std::string>()(k.path);
+	seed ^= static_cast<size_t>(k.hash) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+	return seed;
+}
+
+void ShaderModuleCache::init(VkDevice device)
+{
+	this->device = device;
+	stats = {};
+}
+
+void ShaderModuleCache::cleanup()
+{
+	std::lock_guard lock(mutex);
+
+	for (auto& [key, entry] : entries) {
+		vkDestroyShaderModule(device, entry.module, nullptr);
+	}
+
+	entries.clear();
+	keys.clear();
+	files.clear();
+	stats = {};
+}
+
+VkShaderModule ShaderModuleCache::findAndAcquire(const Key& key)
+{
+	auto it = entries.find(key);
+	if (it == entries.end())
+		return VK_NULL_HANDLE;
+
+	it->second.refCount++;
+	return it->second.module;
+}
+
+VkShaderModule ShaderModuleCache::acquire(const std::string& path, bool& out_created)
+{
+	out_created = false;
+
+	std::error_code ec;
+	const auto writeTime = std::filesystem::last_write_time(path, ec);
+	const uintmax_t size = ec ? 0 : std::filesystem::file_size(path, ec);
+
+	{
+		std::lock_guard lock(mutex);
+
+		auto file = files.find(path);
+		if (!ec && file != files.end() && file->second.writeTime == writeTime && file->second.size == size) {
+			if (VkShaderModule module = findAndAcquire({ path, file->second.hash })) {
+				stats.hits++;
+				return module;
+			}
+		}
+	}
+
+	// Read and create outside the lock so workers don't wait on each other's I/O
+	std::vector<char> code = readFile(path);
+	const Key key{ path, hashContent(code) };
+
+	{
+		// Same content under a new timestamp, or another worker got there first
+		std::lock_guard lock(mutex);
+		if (!ec)
+			files[path] = { writeTime, size, key.hash };
+
+		if (VkShaderModule module = findAndAcquire(key)) {
+			stats.hits++;
+			return module;
+		}
+	}
+
+	VkShaderModuleCreateInfo createInfo{
+		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+		.codeSize = code.size(),
+		.pCode = reinterpret_cast<const uint32_t*>(code.data()),
+	};
+
+	VkShaderModule shaderModule = VK_NULL_HANDLE;
+	if (vkCreateShaderModule(device, &createInfo, nullptr, &shaderModule) != VK_SUCCESS) {
+		throw std::runtime_error("failed to create shader module!");
+	}
+
+	std::lock_guard lock(mutex);
+
+	// Lost a race with another worker creating the same module, keep theirs
+	if (VkShaderModule module = findAndAcquire(key)) {
+		vkDestroyShaderModule(device, shaderModule, nullptr);
+		stats.hits++;
+		return module;
+	}
+
+	entries[key] = { shaderModule, 1 };
+	keys[shaderModule] = key;
+	stats.misses++;
+	stats.modules = static_cast<uint32_t>(entries.size());
+
+	out_created = true;
+	return shaderModule;
+}
+
+void ShaderModuleCache::release(VkShaderModule module)
+{
+	std::lock_guard lock(mutex);
+
+	auto keyIt = keys.find(module);
+	if (keyIt == keys.end())
+		return;
+
+	auto it = entries.find(keyIt->second);
+	if (--it->second.refCount == 0) {
+		vkDestroyShaderModule(device, module, nullptr);
+		entries.erase(it);
+		keys.erase(keyIt);
+		stats.modules = static_cast<uint32_t>(entries.size());
+	}
+}
+
+ShaderModuleCache::Stats ShaderModuleCache::getStats()
+{
+	std::lock_guard lock(mutex);
+	return stats;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <unordered_map>
+#include <filesystem>
+#include <string>
+#include <mutex>
+#include <cstddef>
+#include <cstdint>
+
+/*
+* Shader modules shared between pipelines, keyed by (SPIR-V path, hash of its content).
+* A file is only read again when its timestamp or size changed, and a module is destroyed
+* once the last pipeline holding it releases it.
+* Thread safe, pipelines are compiled on the device workers.
+*/
+class ShaderModuleCache {
+public:
+	struct Stats {
+		uint64_t hits = 0;
+		uint64_t misses = 0;	// Each one is a file read and a vkCreateShaderModule
+		uint32_t modules = 0;
+	};
+
+	void init(VkDevice device);
+	// Destroys everything, pipelines still holding modules must be gone
+	void cleanup();
+
+	// One reference per call, out_created is true when the module was just created (to name it)
+	VkShaderModule acquire(const std::string& path, bool& out_created);
+	void release(VkShaderModule module);
+
+	Stats getStats();
+
+private:
+	struct Key {
+		std::string path;
+		uint64_t hash;
+
+		bool operator==(const Key& o) const { return hash == o.hash && path == o.path; }
+	};
+
+	struct KeyHasher {
+		size_t operator()(const Key& k) const;
+	};
+
+	struct Entry {
+		VkShaderModule module = VK_NULL_HANDLE;
+		uint32_t refCount = 0;
+	};
+
+	// What we last read from a file, to skip the read when it didn't change
+	struct FileState {
+		std::filesystem::file_time_type writeTime;
+		uintmax_t size = 0;
+		uint64_t hash = 0;
+	};
+
+	VkDevice device = VK_NULL_HANDLE;
+	std::mutex mutex;
+
+	std::unordered_map<Key, Entry, KeyHasher> entries;
+	std::unordered_map<VkShaderModule, Key> keys;
+	std::unordered_map<std::string, FileState> files;
+
+	Stats stats;
+
+	VkShaderModule findAndAcquire(const Key& key);
+};
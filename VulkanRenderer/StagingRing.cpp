@@ -0,0 +1,65 @@
+#include "StagingRing.h"
+
+void StagingRing::init(VkDeviceSize capacity)
+{
+	this->capacity = capacity;
+	head = 0;
+	pendingBegin = 0;
+	inFlight.clear();
+}
+
+VkDeviceSize StagingRing::allocate(VkDeviceSize size, VkDeviceSize alignment)
+{
+	if (size > capacity)
+		return InvalidOffset;
+
+	//Nothing in use, restart from the beginning to get the biggest contiguous span
+	if (isEmpty()) {
+		pendingBegin = 0;
+		head = size;
+		return 0;
+	}
+
+	const VkDeviceSize tail = inFlight.empty() ? pendingBegin : inFlight.front().begin;
+	const VkDeviceSize offset = (head + alignment - 1) / alignment * alignment;
+
+	if (head > tail) {
+		// Free space is [head, capacity) then [0, tail)
+		if (offset + size <= capacity) {
+			head = offset + size;
+			return offset;
+		}
+
+		// Wrap around, the end of the buffer is skipped until the tail passes it
+		if (size < tail) {
+			head = size;
+			return 0;
+		}
+	}
+	else if (head < tail) {
+		// Free space is [head, tail)
+		if (offset + size < tail) {
+			head = offset + size;
+			return offset;
+		}
+	}
+
+	// head == tail while not empty means we are full
+	return InvalidOffset;
+}
+
+void StagingRing::submit(uint64_t batch)
+{
+	if (!hasPendingAllocations())
+		return;
+
+	inFlight.push_back({ pendingBegin, batch });
+	pendingBegin = head;
+}
+
+void StagingRing::release(uint64_t completedBatch)
+{
+	while (!inFlight.empty() && inFlight.front().batch <= completedBatch) {
+		inFlight.pop_front();
+	}
+}
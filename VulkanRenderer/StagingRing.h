@@ -0,0 +1,42 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <deque>
+#include <cstdint>
+
+/*
+* Ring allocator over the persistent staging buffer.
+* Allocations are grouped by the batch they were submitted with, and a batch's space
+* comes back once the device tells us that batch is done on the GPU.
+* Only deals with offsets, the Device owns the actual buffer.
+*/
+class StagingRing {
+public:
+	static constexpr VkDeviceSize InvalidOffset = ~0ull;
+
+	void init(VkDeviceSize capacity);
+
+	// Returns InvalidOffset when there is no room left until some batch completes
+	VkDeviceSize allocate(VkDeviceSize size, VkDeviceSize alignment);
+
+	// Everything allocated since the last submit now belongs to batch
+	void submit(uint64_t batch);
+	// Frees the space of every batch up to completedBatch
+	void release(uint64_t completedBatch);
+
+	bool hasPendingAllocations() const { return pendingBegin != head; }
+	bool isEmpty() const { return inFlight.empty() && !hasPendingAllocations(); }
+	VkDeviceSize getCapacity() const { return capacity; }
+
+private:
+	struct Region {
+		VkDeviceSize begin;
+		uint64_t batch;
+	};
+
+	VkDeviceSize capacity = 0;
+	VkDeviceSize head = 0;			// Next allocation
+	VkDeviceSize pendingBegin = 0;	// Start of the allocations that were not submitted yet
+	std::deque<Region> inFlight;
+};
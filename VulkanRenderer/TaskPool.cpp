@@ -0,0 +1,74 @@
+#include "TaskPool.h"
+
+void TaskPool::init(uint32_t threadCount)
+{
+	stopping = false;
+	threads.reserve(threadCount);
+	for (uint32_t i = 0; i < threadCount; i++) {
+		threads.emplace_back(&TaskPool::workerLoop, this);
+	}
+}
+
+void TaskPool::cleanup()
+{
+	{
+		std::lock_guard lock(mutex);
+		stopping = true;
+	}
+	wakeUp.notify_all();
+
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	threads.clear();
+}
+
+std::shared_future<void> TaskPool::submit(std::function<void()> task)
+{
+	Job job{ .task = std::move(task) };
+	std::shared_future<void> future = job.done.get_future().share();
+
+	if (threads.empty()) {
+		run(job);
+		return future;
+	}
+
+	{
+		std::lock_guard lock(mutex);
+		jobs.push_back(std::move(job));
+	}
+	wakeUp.notify_one();
+
+	return future;
+}
+
+void TaskPool::run(Job& job)
+{
+	try {
+		job.task();
+		job.done.set_value();
+	}
+	catch (...) {
+		job.done.set_exception(std::current_exception());
+	}
+}
+
+void TaskPool::workerLoop()
+{
+	for (;;) {
+		Job job;
+		{
+			std::unique_lock lock(mutex);
+			wakeUp.wait(lock, [this] { return stopping || !jobs.empty(); });
+
+			// Only leave once the queue is drained so no future is left hanging
+			if (jobs.empty())
+				return;
+
+			job = std::move(jobs.front());
+			jobs.pop_front();
+		}
+
+		run(job);
+	}
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <cstdint>
+
+/*
+* Small fixed set of worker threads eating a FIFO of tasks.
+* An exception thrown by a task is rethrown by whoever gets its future.
+*/
+class TaskPool {
+public:
+	// With 0 threads tasks run inline in submit
+	void init(uint32_t threadCount);
+	// Finishes the queued tasks then joins
+	void cleanup();
+
+	std::shared_future<void> submit(std::function<void()> task);
+
+	uint32_t getThreadCount() const { return static_cast<uint32_t>(threads.size()); }
+
+private:
+	struct Job {
+		std::function<void()> task;
+		std::promise<void> done;
+	};
+
+	std::vector<std::thread> threads;
+	std::deque<Job> jobs;
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	bool stopping = false;
+
+	static void run(Job& job);
+	void workerLoop();
+};
@@ -12,8 +12,7 @@
 #include "FileUtils.h"
 
 /* Optional TODOs :
-	- Use the transfer queue for staging buffer
-	- Use separate commandPool for copy buffer */
+	- Use a separate compute queue for the compute passes */
 
 
 
@@ -17,7 +17,7 @@ struct PSInput
 	[[vk::location(4)]] float3 tangent : TANGENT;
 	[[vk::location(5)]] float sign : BINORMAL;
 	[[vk::location(6)]] float4 lightSpacePos : LIGHTSPACEPOS;
-	
+	[[vk::location(7)]] nointerpolation uint drawIndex : DRAWINDEX;
 };
 
 
@@ -27,9 +27,18 @@ struct UBO
 	float4x4 proj;
 };
 
+// Same start as UBO, only the camera one has the rest
+struct CameraUBO
+{
+	float4x4 view;
+	float4x4 proj;
+	float3 eye;
+	uint light_count;
+};
+
 cbuffer ubo : register(b0, space0)
 {
-	UBO ubo;
+	CameraUBO ubo;
 }
 
 struct Light
@@ -81,74 +90,41 @@ cbuffer sun_viewproj : register(b2, space1)
 	UBO sun_ubo;
 }
 
-struct Constants
+// Same layout as DrawData in pbr.slang, the factors and material index are only used there
+struct DrawData
 {
 	float4x4 model;
-	
-	float3 eye;
-	uint light_count;
-	
-	uint normal_mode;
-	uint debug_mode;
-	uint blinn;
+	float4 baseColorFactor;
+	float3 pbrFactors;
 	float alphaCutoff;
+	uint4 materialIndex;
+	float4 boundingSphere;
+	float4x4 normalMatrix;
 };
 
-[[vk::push_constant]]
-Constants pc;
+[[vk::binding(3, 0)]]
+StructuredBuffer<DrawData> g_draws : register(t4);
 
-//ChatGPT generated as it's not built-in, but we won't need this when we upgrade models
-float3x3 Inverse3x3(float3x3 m)
-{
-    // Compute determinant of the 3x3 matrix
-	float det =
-        m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
-        m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
-        m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
-
-	if (abs(det) < 1e-6)
-	{
-        // If determinant is too small, return identity matrix (fallback)
-		return float3x3(1.0, 0.0, 0.0,
-                        0.0, 1.0, 0.0,
-                        0.0, 0.0, 1.0);
-	}
-
-	float invDet = 1.0 / det;
-
-    // Compute inverse using cofactor method
-	float3x3 invMat;
-	invMat[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * invDet;
-	invMat[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * invDet;
-	invMat[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invDet;
+// Set per pipeline variant, the branches on them are compiled out
+[[vk::constant_id(0)]] const uint NORMAL_MODE = 1;
+[[vk::constant_id(1)]] const uint DEBUG_MODE = 0;
+[[vk::constant_id(2)]] const uint USE_BLINN = 1;
 
-	invMat[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * invDet;
-	invMat[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invDet;
-	invMat[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * invDet;
-
-	invMat[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * invDet;
-	invMat[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * invDet;
-	invMat[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * invDet;
-
-	return invMat;
-}
-
-PSInput VSMain(VSInput input)
+// The draw's firstInstance is its draw data index, SV_InstanceID includes it unless dxc is told otherwise
+PSInput VSMain(VSInput input, uint drawIndex : SV_InstanceID)
 {
 	PSInput result = (PSInput)0;
+	DrawData draw = g_draws[drawIndex];
 
-	result.worldPos = mul(pc.model, float4(input.Position.xyz, 1.0f));
+	result.drawIndex = drawIndex;
+	result.worldPos = mul(draw.model, float4(input.Position.xyz, 1.0f));
 	result.position = mul(ubo.proj, mul(ubo.view, float4(result.worldPos, 1.0f)));;
 	result.uv = input.TexCoords;
 	result.color = input.Color;
 	result.lightSpacePos = mul(sun_ubo.proj, mul(sun_ubo.view, float4(result.worldPos, 1.0f)));
 	
-	// Extract the upper-left 3x3 part of the model matrix
-	float3x3 normalMatrix = (float3x3) pc.model;
+	float3x3 normalMatrix = (float3x3) draw.normalMatrix;
 
-    // Compute the inverse transpose of the normal matrix
-	normalMatrix = transpose(Inverse3x3(normalMatrix));
-	
 	result.normal = normalize(mul(normalMatrix, input.Normal));
 	result.tangent = normalize(mul(normalMatrix, input.Tangent.xyz));
 	result.sign = input.Tangent.w;//normalize(cross(result.tangent, result.normal));
@@ -226,7 +202,7 @@ float calcPointShadow(float3 worldPos, float3 lightPos)
 	
 	float shadow = 0.0;
 	int samples = 20;
-	float viewDistance = length(pc.eye - worldPos);
+	float viewDistance = length(ubo.eye - worldPos);
 	float diskRadius = (1.0 + (viewDistance / 25.0)) / 100.0; // 25 is far_plane
 	for (int i = 0; i < samples; ++i)
 	{
@@ -259,10 +235,10 @@ float4 calcLight(PSInput input, Light l, float3 norm)
 	float4 diffuseLight = float4(l.color * (diffuse /* * mat_diffuse*/), 1.0f);
 	
 	//Specular
-	float3 view_vec = normalize(pc.eye - input.worldPos.xyz);
+	float3 view_vec = normalize(ubo.eye - input.worldPos.xyz);
 	
 	float specular = 0.0f;
-	if (pc.blinn)
+	if (USE_BLINN)
 	{
 		float3 halfwayDir = normalize(light_vec + view_vec);
 		specular = pow(max(dot(norm, halfwayDir), 0.0), 32.0);
@@ -304,7 +280,7 @@ float4 PSMain(PSInput input) : SV_TARGET
 {
 	float4 texColor = g_texture.Sample(g_sampler, input.uv) * float4(input.color, 1.0f);
 	
-	if(texColor.a < pc.alphaCutoff)
+	if(texColor.a < g_draws[input.drawIndex].alphaCutoff)
 		discard;
 	
 	float4 output = 0;
@@ -319,9 +295,9 @@ float4 PSMain(PSInput input) : SV_TARGET
 	float3 vB = input.sign * cross(vN, vT);
 	float3 vNout = normalize(vNt.x * vT + vNt.y * vB + vNt.z * vN);
 	
-	float3 norm = pc.normal_mode == 1 && !isnan(input.tangent.x) ? normalize(vNout) : normalize(input.normal);
+	float3 norm = NORMAL_MODE == 1 && !isnan(input.tangent.x) ? normalize(vNout) : normalize(input.normal);
 	
-	for (int i = 0; i < pc.light_count; i++)
+	for (int i = 0; i < ubo.light_count; i++)
 	{
 		output += texColor * calcLight(input, light[i], norm);
 	}
@@ -332,7 +308,7 @@ float4 PSMain(PSInput input) : SV_TARGET
 	
 	float4 final_output =  output;
 	
-	switch (pc.debug_mode)
+	switch (DEBUG_MODE)
 	{
 		case 0 : final_output = output; break;
 		case 1 : final_output = float4(vN * 0.5 + 0.5, 0); break;